@@ -1,6 +1,7 @@
 #include "filter/static.h"
 
 #include <stdio.h>
+#include <string.h>
 
 // *Really* minimal PCG32 code / (c) 2014 M.E. O'Neill / pcg-random.org
 // Licensed under Apache License 2.0 (NO WARRANTY, etc. see website)
@@ -30,11 +31,32 @@ int main() {
       hashes[i] |= pcg32_random_r(&seed);
     }
     libfilter_static filter = libfilter_static_construct(size, hashes);
+    assert(filter.region_.block != NULL);
     printf("%zu\t%f\n", size, 1.0 * filter.length_ / size);
     fflush(stdout);
     for (unsigned i = 0; i < size; ++i) {
       assert(libfilter_static_find_hash(filter, hashes[i]));
     }
+    // Shards may run in any order, and the filter does not depend on how many there are
+    // or on whether the edges are partitioned
+    for (int partitioned = 0; partitioned < 2; ++partitioned) {
+      libfilter_static_builder builder;
+      // Not in an assert, which would leave the builder uninitialized under NDEBUG
+      if (0 != libfilter_static_builder_init(size, hashes, 3, &builder)) {
+        fprintf(stderr, "libfilter_static_builder_init failed\n");
+        return 1;
+      }
+      libfilter_static_builder_set_partitioned(&builder, partitioned);
+      while (libfilter_static_builder_next(&builder)) {
+        for (int shard = 2; shard >= 0; --shard) {
+          libfilter_static_builder_step(&builder, shard);
+        }
+      }
+      libfilter_static sharded = libfilter_static_builder_finish(&builder);
+      assert(sharded.length_ == filter.length_);
+      assert(0 == memcmp(sharded.region_.block, filter.region_.block, filter.length_));
+      libfilter_static_destruct(sharded);
+    }
     libfilter_static_destruct(filter);
   }
 }
@@ -16,7 +16,8 @@
 #include <limits.h>             // for CHAR_BIT
 #include <stdalign.h>           // for alignas
 #include <stdbool.h>            // for bool, false, true
-#include <stdint.h>             // for uint64_t
+#include <stddef.h>             // for size_t
+#include <stdint.h>             // for uint64_t, uint8_t
 
 #if defined (__x86_64)
 #include <immintrin.h>
@@ -49,6 +50,68 @@ inline void libfilter_block_add_hash(uint64_t hash, libfilter_block *);
 // usage and the number of distinct hash values that have been added. As in
 // libfilter_block_add_hash, the hash value is expected to be pseudorandom.
 inline bool libfilter_block_find_hash(uint64_t hash, const libfilter_block *);
+// Finds n hash values at once, setting out[i] to 1 if libfilter_block_find_hash would
+// return true for hashes[i] and to 0 otherwise. The bucket of each hash value is computed
+// and prefetched LIBFILTER_BLOCK_BATCH_WINDOW hash values ahead of the one being tested,
+// so that many cache misses are outstanding at once rather than one at a time. This is
+// much faster than calling libfilter_block_find_hash in a loop when the filter is larger
+// than the last-level cache.
+inline void libfilter_block_find_hash_batch(const uint64_t *hashes, size_t n,
+                                            uint8_t *out, const libfilter_block *);
+// Adds n hash values, prefetching the bucket of each one a window ahead, in the same way
+// as libfilter_block_find_hash_batch.
+inline void libfilter_block_add_hash_batch(const uint64_t *hashes, size_t n,
+                                           libfilter_block *);
+// Adds n hash values, first partitioning them by bucket so that the buckets written to at
+// any one time are close together. This uses n * sizeof(uint64_t) bytes of scratch space
+// but is faster than libfilter_block_add_hash_batch for large filters and large n.
+// Returns 0 on success and < 0 if the scratch space could not be allocated, in which case
+// no hash values have been added.
+int libfilter_block_add_hash_batch_partitioned(const uint64_t *hashes, size_t n,
+                                               libfilter_block *);
+// Adds a hash value to the filter, like libfilter_block_add_hash, but in a way that is
+// safe to call from many threads at once on the same filter, and concurrently with
+// libfilter_block_find_hash. Each word of the bucket that does not already have its bit
+// set is updated with an atomic OR. The updates are relaxed: once the adding threads are
+// joined (or otherwise synchronized with), every value they added will be found.
+inline void libfilter_block_add_hash_atomic(uint64_t hash, libfilter_block *);
+// Like libfilter_block_add_hash_batch, but using libfilter_block_add_hash_atomic.
+inline void libfilter_block_add_hash_batch_atomic(const uint64_t *hashes, size_t n,
+                                                  libfilter_block *);
+// The following are equivalent to the functions above of the same name without
+// "_runtime". The library contains scalar, AVX2, and AVX-512 versions of them, and the
+// first time any of them is called, the fastest version the CPU supports is chosen. This
+// allows one build to run on many x86-64 CPUs. Code compiled with AVX2 enabled can
+// instead use the inline versions above; the filters they operate on are the same.
+//
+// When the header is compiled for x86-64 without AVX2, libfilter_block_add_hash and the
+// like call these.
+void libfilter_block_runtime_add_hash(uint64_t hash, libfilter_block *);
+bool libfilter_block_runtime_find_hash(uint64_t hash, const libfilter_block *);
+void libfilter_block_runtime_find_hash_batch(const uint64_t *hashes, size_t n,
+                                             uint8_t *out, const libfilter_block *);
+void libfilter_block_runtime_add_hash_batch(const uint64_t *hashes, size_t n,
+                                            libfilter_block *);
+// Returns the name of the instruction set the _runtime functions use: "scalar", "avx2",
+// "avx512", or, outside of x86-64, "native", meaning whatever the library was compiled
+// for.
+const char *libfilter_block_runtime_isa(void);
+// Sets dst to the union of dst and src: afterwards, dst finds every hash value that either
+// filter found before. The filters must be the same size, as when they were initialized
+// with the same heap_space. Returns 0 on success and < 0 if the sizes differ.
+int libfilter_block_union(libfilter_block *dst, const libfilter_block *src);
+// Sets dst to the intersection of dst and src. Afterwards, dst finds every hash value that
+// was added to both, but the false positive probability is higher than that of a filter
+// to which only the values in both were added. Returns 0 on success and < 0 if the sizes
+// differ.
+int libfilter_block_intersect(libfilter_block *dst, const libfilter_block *src);
+// The same as the above, but only for the buckets in [begin, end). Different threads may
+// operate on disjoint ranges of the same filters at once. The number of buckets is
+// libfilter_block_size_in_bytes / 32. Returns < 0 if the range is out of bounds.
+int libfilter_block_union_range(libfilter_block *dst, const libfilter_block *src,
+                                uint64_t begin, uint64_t end);
+int libfilter_block_intersect_range(libfilter_block *dst, const libfilter_block *src,
+                                    uint64_t begin, uint64_t end);
 // TODO: write docs for this
 int libfilter_block_clone(const libfilter_block *, libfilter_block*);
 
@@ -57,7 +120,14 @@ double libfilter_block_fpp(double ndv, double bytes);
 uint64_t libfilter_block_capacity(uint64_t bytes, double fpp);
 void libfilter_block_zero_out(libfilter_block *);
 bool libfilter_block_equals(const libfilter_block *, const libfilter_block *);
+// Writes libfilter_block_size_in_bytes bytes: each 32-bit word of the filter,
+// little-endian
 void libfilter_block_serialize(const libfilter_block *, char *);
+// Writes bytes [offset, offset + len) of what libfilter_block_serialize would write, so
+// that a large filter can be written out in pieces without a full-size copy. Returns < 0
+// if the range is out of bounds.
+int libfilter_block_serialize_range(const libfilter_block *, uint64_t offset,
+                                    uint64_t len, char *to);
 // returns < 0 on error
 int libfilter_block_deserialize(uint64_t size_in_bytes, const char *from,
                                 libfilter_block *to);
@@ -69,15 +139,53 @@ inline uint64_t libfilter_block_size_in_bytes(const libfilter_block *);
 
 inline void libfilter_block_scalar_add_hash(uint64_t hash, libfilter_block *);
 inline bool libfilter_block_scalar_find_hash(uint64_t hash, const libfilter_block *);
+inline void libfilter_block_scalar_find_hash_batch(const uint64_t *hashes, size_t n,
+                                                   uint8_t *out, const libfilter_block *);
+inline void libfilter_block_scalar_add_hash_batch(const uint64_t *hashes, size_t n,
+                                                  libfilter_block *);
 #if defined(__AVX2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
 inline void libfilter_block_simd_add_hash(uint64_t hash, libfilter_block *);
 inline bool libfilter_block_simd_find_hash(uint64_t hash, const libfilter_block *);
+inline void libfilter_block_simd_find_hash_batch(const uint64_t *hashes, size_t n,
+                                                 uint8_t *out, const libfilter_block *);
+inline void libfilter_block_simd_add_hash_batch(const uint64_t *hashes, size_t n,
+                                                libfilter_block *);
+#endif
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+// These use the same layout as the other variants, so a filter built with one can be
+// queried with another. The _pair functions operate on two hash values at once by holding
+// both of their masks in one 512-bit register.
+inline void libfilter_block_avx512_add_hash(uint64_t hash, libfilter_block *);
+inline bool libfilter_block_avx512_find_hash(uint64_t hash, const libfilter_block *);
+inline void libfilter_block_avx512_add_hash_pair(uint64_t hash0, uint64_t hash1,
+                                                 libfilter_block *);
+// Returns a bitmask with bit 0 set if hash0 is found and bit 1 set if hash1 is found.
+inline unsigned libfilter_block_avx512_find_hash_pair(uint64_t hash0, uint64_t hash1,
+                                                      const libfilter_block *);
+inline void libfilter_block_avx512_find_hash_batch(const uint64_t *hashes, size_t n,
+                                                   uint8_t *out, const libfilter_block *);
+inline void libfilter_block_avx512_add_hash_batch(const uint64_t *hashes, size_t n,
+                                                  libfilter_block *);
 #endif
 
 #if defined(LIBFILTER_BLOCK_SIMD)
 #error "An exported feature macro cannot be defined"
 #endif
 
+#if defined(LIBFILTER_BLOCK_AVX512)
+#error "An exported feature macro cannot be defined"
+#endif
+
+#if defined(LIBFILTER_BLOCK_BATCH_WINDOW)
+#error "An exported feature macro cannot be defined"
+#endif
+
+// The number of hash values that the batch operations look ahead of the one they are
+// working on. It must be a power of two. It should be large enough to keep the memory
+// system busy with independent misses, but small enough that prefetched buckets are not
+// evicted before they are used.
+#define LIBFILTER_BLOCK_BATCH_WINDOW 16
+
 #if defined(LIBFILTER_INTERNAL_HASH_SEEDS)
 #error "An internal macro cannot be defined"
 #endif
@@ -94,6 +202,39 @@ struct libfilter_block_struct {
   libfilter_region block_;
 };
 
+// Zero-copy, read-only views of serialized filters.
+//
+// libfilter_block_serialize_view writes a filter as a 64-byte header followed by the
+// buckets exactly as they are laid out in memory. The header records a format version,
+// the byte order of the writing machine, the hash scheme, and the number of buckets. A
+// view can then be opened on such an image without copying it, either in a buffer the
+// caller owns or by mapping a file into memory.
+//
+// The view's filter is read-only: it may be passed to the find functions, but not to
+// any function that adds to, frees, or resizes it. Images can only be viewed on machines
+// with the byte order of the machine that wrote them.
+typedef struct {
+  libfilter_block filter;
+  // If the view was created by libfilter_block_view_map, the mapping to unmap, otherwise
+  // NULL
+  void *mapping;
+  uint64_t mapping_bytes;
+} libfilter_block_view;
+
+// The number of bytes libfilter_block_serialize_view writes
+uint64_t libfilter_block_view_bytes(const libfilter_block *);
+void libfilter_block_serialize_view(const libfilter_block *, char *to);
+// Opens a view of the image in the bytes bytes at from, which must be 32-byte aligned and
+// must outlive the view. Returns 0 on success and < 0 if the header is invalid, is from
+// another version or hash scheme or byte order, or does not match bytes.
+int libfilter_block_view_init(const void *from, uint64_t bytes, libfilter_block_view *);
+// Opens a view of the image in the file at path by mapping it into memory, so pages are
+// read from the file only when they are first probed. Returns 0 on success and < 0 on
+// error, including the errors of libfilter_block_view_init.
+int libfilter_block_view_map(const char *path, libfilter_block_view *);
+// Returns 0 on success and < 0 on error. A view that failed to open may also be destructed.
+int libfilter_block_view_destruct(libfilter_block_view *);
+
 __attribute__((visibility("hidden")))
 __attribute__((always_inline)) inline uint64_t libfilter_block_index(
     const uint64_t hash, const uint32_t num_buckets) {
@@ -124,9 +265,50 @@ libfilter_block_scalar_make_mask(uint64_t hash) {
   return hash_data;
 }
 
-__attribute__((always_inline)) inline void libfilter_block_scalar_add_hash(
-    uint64_t hash, libfilter_block *here) {
-  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+// Loads the bucket at bucket_idx into cache ahead of an add or a find. for_write should
+// be a constant so that the branch is folded away.
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline void libfilter_block_prefetch(
+    uint64_t bucket_idx, const libfilter_block *here, const bool for_write) {
+  const uint32_t *bucket = &here->block_.block[bucket_idx * 8];
+  if (for_write) {
+    __builtin_prefetch(bucket, 1, 3);
+  } else {
+    __builtin_prefetch(bucket, 0, 3);
+  }
+}
+
+// Fills the window of upcoming bucket indexes used by the batch operations and prefetches
+// the buckets they point to.
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline void libfilter_block_batch_start(
+    const uint64_t *hashes, size_t n, uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW],
+    const libfilter_block *here, const bool for_write) {
+  for (size_t i = 0; i < n && i < LIBFILTER_BLOCK_BATCH_WINDOW; ++i) {
+    window[i] = libfilter_block_index(hashes[i], here->num_buckets_);
+    libfilter_block_prefetch(window[i], here, for_write);
+  }
+}
+
+// Returns the bucket index of hashes[i], then replaces it in the window by the bucket
+// index of the hash value LIBFILTER_BLOCK_BATCH_WINDOW places later, which is prefetched.
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline uint64_t libfilter_block_batch_next(
+    const uint64_t *hashes, size_t n, size_t i,
+    uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW], const libfilter_block *here,
+    const bool for_write) {
+  uint64_t *slot = &window[i & (LIBFILTER_BLOCK_BATCH_WINDOW - 1)];
+  const uint64_t result = *slot;
+  if (i + LIBFILTER_BLOCK_BATCH_WINDOW < n) {
+    *slot = libfilter_block_index(hashes[i + LIBFILTER_BLOCK_BATCH_WINDOW],
+                                  here->num_buckets_);
+    libfilter_block_prefetch(*slot, here, for_write);
+  }
+  return result;
+}
+
+__attribute__((always_inline)) inline void libfilter_block_scalar_add_hash_at(
+    uint64_t hash, uint64_t bucket_idx, libfilter_block *here) {
   const libfilter_block_scalar_bucket mask =
       libfilter_block_scalar_make_mask(hash);
   libfilter_block_scalar_bucket *bucket =
@@ -137,9 +319,14 @@ __attribute__((always_inline)) inline void libfilter_block_scalar_add_hash(
   }
 }
 
-__attribute__((always_inline)) inline bool libfilter_block_scalar_find_hash(
-    uint64_t hash, const libfilter_block *here) {
+__attribute__((always_inline)) inline void libfilter_block_scalar_add_hash(
+    uint64_t hash, libfilter_block *here) {
   const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  libfilter_block_scalar_add_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_scalar_find_hash_at(
+    uint64_t hash, uint64_t bucket_idx, const libfilter_block *here) {
   const libfilter_block_scalar_bucket mask =
       libfilter_block_scalar_make_mask(hash);
   const libfilter_block_scalar_bucket *bucket =
@@ -151,6 +338,65 @@ __attribute__((always_inline)) inline bool libfilter_block_scalar_find_hash(
   return true;
 }
 
+__attribute__((always_inline)) inline bool libfilter_block_scalar_find_hash(
+    uint64_t hash, const libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  return libfilter_block_scalar_find_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_scalar_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, false);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, false);
+    out[i] = libfilter_block_scalar_find_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_scalar_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, true);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    libfilter_block_scalar_add_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_atomic_at(
+    uint64_t hash, uint64_t bucket_idx, libfilter_block *here) {
+  const libfilter_block_scalar_bucket mask = libfilter_block_scalar_make_mask(hash);
+  uint32_t *bucket = &here->block_.block[8 * bucket_idx];
+  for (unsigned i = 0; i < 8; ++i) {
+    // Skipping words that already have the bit set avoids taking the cache line
+    // exclusively, which matters when most bits are already set or many threads share a
+    // bucket.
+    if (0 == (__atomic_load_n(&bucket[i], __ATOMIC_RELAXED) & mask.payload[i])) {
+      __atomic_fetch_or(&bucket[i], mask.payload[i], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_atomic(
+    uint64_t hash, libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  libfilter_block_add_hash_atomic_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_batch_atomic(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, true);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    libfilter_block_add_hash_atomic_at(hashes[i], bucket_idx, here);
+  }
+}
+
 __attribute__((always_inline)) inline uint64_t libfilter_block_size_in_bytes(
     const libfilter_block *here) {
   return (here->num_buckets_) * ((8 * 32 / CHAR_BIT));
@@ -173,24 +419,56 @@ __attribute__((always_inline)) inline __m256i libfilter_block_simd_make_mask(
   return _mm256_sllv_epi32(ones, hash_data);
 }
 
-__attribute__((always_inline)) inline void libfilter_block_simd_add_hash(
-    uint64_t hash, libfilter_block *here) {
-  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash_at(
+    uint64_t hash, uint64_t bucket_idx, libfilter_block *here) {
   const __m256i mask = libfilter_block_simd_make_mask(hash);
   __m256i * bucket = (__m256i*)here->block_.block;
   bucket += bucket_idx;
   _mm256_store_si256(bucket, _mm256_or_si256(*bucket, mask));
 }
 
-__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash(
-    uint64_t hash, const libfilter_block *here) {
-  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash_at(
+    uint64_t hash, uint64_t bucket_idx, const libfilter_block *here) {
   const __m256i mask = libfilter_block_simd_make_mask(hash);
   const __m256i *bucket = (const __m256i *)here->block_.block;
   bucket += bucket_idx;
   return _mm256_testc_si256(*bucket, mask);
 }
 
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash(
+    uint64_t hash, libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  libfilter_block_simd_add_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash(
+    uint64_t hash, const libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  return libfilter_block_simd_find_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_simd_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, false);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, false);
+    out[i] = libfilter_block_simd_find_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, true);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    libfilter_block_simd_add_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
 __attribute__((always_inline)) inline void libfilter_block_add_hash(
     uint64_t hash, libfilter_block *here) {
   return libfilter_block_simd_add_hash(hash, here);
@@ -201,6 +479,16 @@ __attribute__((always_inline)) inline bool libfilter_block_find_hash(
   return libfilter_block_simd_find_hash(hash, here);
 }
 
+__attribute__((always_inline)) inline void libfilter_block_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  libfilter_block_simd_find_hash_batch(hashes, n, out, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_simd_add_hash_batch(hashes, n, here);
+}
+
 #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
 #define LIBFILTER_BLOCK_SIMD
 
@@ -231,9 +519,8 @@ __attribute__((always_inline)) inline uint32x8_t libfilter_block_simd_make_mask(
   return hash_data;
 }
 
-__attribute__((always_inline)) inline void libfilter_block_simd_add_hash(
-    uint64_t hash, libfilter_block *here) {
-  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash_at(
+    uint64_t hash, uint64_t bucket_idx, libfilter_block *here) {
   const uint32x8_t mask = libfilter_block_simd_make_mask(hash);
   uint32_t *bucket = here->block_.block;
   bucket += bucket_idx * 8;
@@ -247,9 +534,8 @@ __attribute__((always_inline)) inline void libfilter_block_simd_add_hash(
   vst1q_u32(&bucket[4], tmp.payload[1]);
 }
 
-__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash(
-    uint64_t hash, const libfilter_block *here) {
-  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash_at(
+    uint64_t hash, uint64_t bucket_idx, const libfilter_block *here) {
   const uint32x8_t mask = libfilter_block_simd_make_mask(hash);
   uint32_t *bucket = here->block_.block;
   bucket += bucket_idx * 8;
@@ -262,6 +548,40 @@ __attribute__((always_inline)) inline bool libfilter_block_simd_find_hash(
   return vminvq_u32(out0) && vminvq_u32(out1);
 }
 
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash(
+    uint64_t hash, libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  libfilter_block_simd_add_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_simd_find_hash(
+    uint64_t hash, const libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  return libfilter_block_simd_find_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_simd_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, false);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, false);
+    out[i] = libfilter_block_simd_find_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_simd_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, true);
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    libfilter_block_simd_add_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
 __attribute__((always_inline)) inline void libfilter_block_add_hash(
     uint64_t hash, libfilter_block *here) {
   return libfilter_block_simd_add_hash(hash, here);
@@ -271,6 +591,36 @@ __attribute__((always_inline)) inline bool libfilter_block_find_hash(
     uint64_t hash, const libfilter_block *here) {
   return libfilter_block_simd_find_hash(hash, here);
 }
+
+__attribute__((always_inline)) inline void libfilter_block_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  libfilter_block_simd_find_hash_batch(hashes, n, out, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_simd_add_hash_batch(hashes, n, here);
+}
+#elif defined(__x86_64)
+__attribute__((always_inline)) inline void libfilter_block_add_hash(
+    uint64_t hash, libfilter_block *here) {
+  libfilter_block_runtime_add_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_find_hash(
+    uint64_t hash, const libfilter_block *here) {
+  return libfilter_block_runtime_find_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  libfilter_block_runtime_find_hash_batch(hashes, n, out, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_runtime_add_hash_batch(hashes, n, here);
+}
 #else
 __attribute__((always_inline)) inline void libfilter_block_add_hash(
     uint64_t hash, libfilter_block *here) {
@@ -282,6 +632,142 @@ __attribute__((always_inline)) inline bool libfilter_block_find_hash(
   return libfilter_block_scalar_find_hash(hash, here);
 }
 
+__attribute__((always_inline)) inline void libfilter_block_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  libfilter_block_scalar_find_hash_batch(hashes, n, out, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_scalar_add_hash_batch(hashes, n, here);
+}
+
+#endif
+
+#if defined(__AVX512F__) && defined(__AVX512VL__)
+#define LIBFILTER_BLOCK_AVX512
+// Returns the masks of hash0 and hash1 in the low and high halves, respectively.
+__attribute__((always_inline)) inline __m512i libfilter_block_avx512_make_mask_pair(
+    uint64_t hash0, uint64_t hash1) {
+  const __m512i ones = _mm512_set1_epi32(1);
+  const __m512i rehash = {LIBFILTER_INTERNAL_HASH_SEEDS, LIBFILTER_INTERNAL_HASH_SEEDS};
+  __m512i hash_data = _mm512_mask_set1_epi32(_mm512_set1_epi32(hash0), 0xff00, hash1);
+  hash_data = _mm512_mullo_epi32(rehash, hash_data);
+  // The unmasked forms of these shifts, and of the cast and extract that split the
+  // result, pass an uninitialized vector through, which GCC 12 warns about when they are
+  // inlined. With every lane selected, the zero-masked forms compute the same vectors
+  // without one.
+  hash_data = _mm512_maskz_srli_epi32(0xffff, hash_data, 32 - 5);
+  return _mm512_maskz_sllv_epi32(0xffff, ones, hash_data);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_add_hash_at(
+    uint64_t hash, uint64_t bucket_idx, libfilter_block *here) {
+  libfilter_block_simd_add_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_avx512_find_hash_at(
+    uint64_t hash, uint64_t bucket_idx, const libfilter_block *here) {
+  const __m256i mask = libfilter_block_simd_make_mask(hash);
+  const __m256i *bucket = (const __m256i *)here->block_.block;
+  bucket += bucket_idx;
+  // Each 32-bit lane of the mask has exactly one bit set, so the hash is present exactly
+  // when every lane of the bucket intersects the mask.
+  return 0xff == _mm256_test_epi32_mask(*bucket, mask);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_add_hash_pair_at(
+    uint64_t hash0, uint64_t hash1, uint64_t bucket_idx0, uint64_t bucket_idx1,
+    libfilter_block *here) {
+  const __m512i mask = libfilter_block_avx512_make_mask_pair(hash0, hash1);
+  // Zero-masked for the reason given in libfilter_block_avx512_make_mask_pair
+  const __m256i mask0 = _mm512_maskz_extracti64x4_epi64(0xf, mask, 0);
+  const __m256i mask1 = _mm512_maskz_extracti64x4_epi64(0xf, mask, 1);
+  __m256i *bucket = (__m256i *)here->block_.block;
+  // The two buckets might be the same one, so the second is loaded only after the first
+  // is stored.
+  _mm256_store_si256(&bucket[bucket_idx0], _mm256_or_si256(bucket[bucket_idx0], mask0));
+  _mm256_store_si256(&bucket[bucket_idx1], _mm256_or_si256(bucket[bucket_idx1], mask1));
+}
+
+__attribute__((always_inline)) inline unsigned libfilter_block_avx512_find_hash_pair_at(
+    uint64_t hash0, uint64_t hash1, uint64_t bucket_idx0, uint64_t bucket_idx1,
+    const libfilter_block *here) {
+  const __m512i mask = libfilter_block_avx512_make_mask_pair(hash0, hash1);
+  const __m256i *bucket = (const __m256i *)here->block_.block;
+  const __m512i buckets = _mm512_mask_broadcast_i64x4(
+      _mm512_castsi256_si512(bucket[bucket_idx0]), 0xf0, bucket[bucket_idx1]);
+  const __mmask16 hits = _mm512_test_epi32_mask(buckets, mask);
+  return (0xff == (hits & 0xff)) | ((0xff00 == (hits & 0xff00)) << 1);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_add_hash(
+    uint64_t hash, libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  libfilter_block_avx512_add_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_block_avx512_find_hash(
+    uint64_t hash, const libfilter_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  return libfilter_block_avx512_find_hash_at(hash, bucket_idx, here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_add_hash_pair(
+    uint64_t hash0, uint64_t hash1, libfilter_block *here) {
+  libfilter_block_avx512_add_hash_pair_at(
+      hash0, hash1, libfilter_block_index(hash0, here->num_buckets_),
+      libfilter_block_index(hash1, here->num_buckets_), here);
+}
+
+__attribute__((always_inline)) inline unsigned libfilter_block_avx512_find_hash_pair(
+    uint64_t hash0, uint64_t hash1, const libfilter_block *here) {
+  return libfilter_block_avx512_find_hash_pair_at(
+      hash0, hash1, libfilter_block_index(hash0, here->num_buckets_),
+      libfilter_block_index(hash1, here->num_buckets_), here);
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_find_hash_batch(
+    const uint64_t *hashes, size_t n, uint8_t *out, const libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, false);
+  size_t i = 0;
+  for (; i + 1 < n; i += 2) {
+    const uint64_t bucket_idx0 =
+        libfilter_block_batch_next(hashes, n, i, window, here, false);
+    const uint64_t bucket_idx1 =
+        libfilter_block_batch_next(hashes, n, i + 1, window, here, false);
+    const unsigned found = libfilter_block_avx512_find_hash_pair_at(
+        hashes[i], hashes[i + 1], bucket_idx0, bucket_idx1, here);
+    out[i] = found & 1;
+    out[i + 1] = found >> 1;
+  }
+  if (i < n) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, false);
+    out[i] = libfilter_block_avx512_find_hash_at(hashes[i], bucket_idx, here);
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_block_avx512_add_hash_batch(
+    const uint64_t *hashes, size_t n, libfilter_block *here) {
+  uint64_t window[LIBFILTER_BLOCK_BATCH_WINDOW];
+  libfilter_block_batch_start(hashes, n, window, here, true);
+  size_t i = 0;
+  for (; i + 1 < n; i += 2) {
+    const uint64_t bucket_idx0 =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    const uint64_t bucket_idx1 =
+        libfilter_block_batch_next(hashes, n, i + 1, window, here, true);
+    libfilter_block_avx512_add_hash_pair_at(hashes[i], hashes[i + 1], bucket_idx0,
+                                            bucket_idx1, here);
+  }
+  if (i < n) {
+    const uint64_t bucket_idx =
+        libfilter_block_batch_next(hashes, n, i, window, here, true);
+    libfilter_block_avx512_add_hash_at(hashes[i], bucket_idx, here);
+  }
+}
 #endif
 
 #undef LIBFILTER_INTERNAL_HASH_SEEDS
@@ -0,0 +1,298 @@
+// A counting block Bloom filter: a filter that supports removing hash values as well as
+// adding them.
+//
+// The layout follows block.h: each hash value picks one bucket and one of 32 positions in
+// each of the 8 words of that bucket, using the same seeds as block.h. Here, though, each
+// position is a 4-bit counter rather than a bit, so each word is 128 bits and each bucket
+// is 128 bytes - two cache lines on most CPUs. A position is set when its counter is
+// nonzero, so the false positive probability is that of a block filter with the same
+// number of buckets, a quarter of the size.
+//
+// Counters saturate at 15. A saturated counter is never decremented, since the number of
+// hash values that share it is no longer known; this can only cause false positives, not
+// false negatives. With 4-bit counters, saturation is very unlikely unless the filter is
+// far over capacity.
+
+#pragma once
+
+#include <limits.h>             // for CHAR_BIT
+#include <stdalign.h>           // for alignas
+#include <stdbool.h>            // for bool, false, true
+#include <stdint.h>             // for uint64_t, uint8_t
+
+#include "block.h"              // for libfilter_block_index
+#include "memory.h"             // for libfilter_region
+
+// An opaque structure type. API users do not need to delve.
+typedef struct libfilter_counting_block_struct libfilter_counting_block;
+
+// Given a number of distinct values and a goal false-positive probability, returns the
+// size of the filter needed to achieve them.
+uint64_t libfilter_counting_block_bytes_needed(double ndv, double fpp);
+
+// Initializes a filter. Returns 0 on success and < 0 on error
+int libfilter_counting_block_init(uint64_t heap_space, libfilter_counting_block *);
+// Destroys a filter. Returns 0 on success and < 0 on error
+int libfilter_counting_block_destruct(libfilter_counting_block *);
+// Adds a hash value to the filter. As with libfilter_block_add_hash, the hash value is
+// expected to be pseudorandom.
+inline void libfilter_counting_block_add_hash(uint64_t hash, libfilter_counting_block *);
+// Removes a hash value that was added earlier. If the hash value is not found, returns
+// false and leaves the filter unchanged. Removing a hash value that was not added, but
+// that is found because of a false positive, can cause false negatives for the hash
+// values that were added.
+inline bool libfilter_counting_block_remove_hash(uint64_t hash,
+                                                 libfilter_counting_block *);
+// Find a hash value in the filter, returning true if the value was added earlier (and not
+// removed since), and, otherwise, false with a probability dictated by the heap space
+// usage and the number of distinct hash values in the filter.
+inline bool libfilter_counting_block_find_hash(uint64_t hash,
+                                               const libfilter_counting_block *);
+// Returns 0 on success and < 0 on error
+int libfilter_counting_block_clone(const libfilter_counting_block *,
+                                   libfilter_counting_block *);
+
+// Lower-level operations:
+double libfilter_counting_block_fpp(double ndv, double bytes);
+uint64_t libfilter_counting_block_capacity(uint64_t bytes, double fpp);
+void libfilter_counting_block_zero_out(libfilter_counting_block *);
+bool libfilter_counting_block_equals(const libfilter_counting_block *,
+                                     const libfilter_counting_block *);
+inline uint64_t libfilter_counting_block_size_in_bytes(const libfilter_counting_block *);
+
+inline void libfilter_counting_block_scalar_add_hash(uint64_t hash,
+                                                     libfilter_counting_block *);
+inline bool libfilter_counting_block_scalar_remove_hash(uint64_t hash,
+                                                        libfilter_counting_block *);
+inline bool libfilter_counting_block_scalar_find_hash(uint64_t hash,
+                                                      const libfilter_counting_block *);
+#if defined(__AVX2__)
+inline void libfilter_counting_block_simd_add_hash(uint64_t hash,
+                                                   libfilter_counting_block *);
+inline bool libfilter_counting_block_simd_remove_hash(uint64_t hash,
+                                                      libfilter_counting_block *);
+inline bool libfilter_counting_block_simd_find_hash(uint64_t hash,
+                                                    const libfilter_counting_block *);
+#endif
+
+#if defined(LIBFILTER_COUNTING_BLOCK_SIMD)
+#error "An exported feature macro cannot be defined"
+#endif
+
+#if defined(LIBFILTER_INTERNAL_COUNTING_HASH_SEEDS)
+#error "An internal macro cannot be defined"
+#endif
+
+// The same as the seeds in block.h
+#define LIBFILTER_INTERNAL_COUNTING_HASH_SEEDS                  \
+  (long long)0x47b6137b44974d91, (long long)0x8824ad5ba2b7289d, \
+      (long long)0x705495c72df1424b, (long long)0x9efc49475c6bfb31
+
+struct libfilter_counting_block_struct {
+  uint64_t num_buckets_;
+  libfilter_region block_;
+};
+
+// payload[i] holds the 32 counters of word i, two to a byte, with the counter for
+// position p in the low nibble of byte p / 2 if p is even and in the high nibble if p is
+// odd.
+typedef struct {
+  alignas(128) uint8_t payload[8][16];
+} libfilter_counting_block_scalar_bucket;
+
+// Sets positions[i] to the position, in [0, 32), of the counter in word i of the bucket.
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline void libfilter_counting_block_scalar_positions(
+    uint64_t hash, uint8_t positions[8]) {
+  const long long seeds[] = {LIBFILTER_INTERNAL_COUNTING_HASH_SEEDS};
+  for (unsigned i = 0; i < 4; ++i) {
+    for (unsigned j = 0; j < 2; ++j) {
+      positions[2 * i + j] =
+          (((uint32_t)hash) * ((uint32_t)(seeds[i] >> (32 * j)))) >> (32 - 5);
+    }
+  }
+}
+
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline libfilter_counting_block_scalar_bucket *
+libfilter_counting_block_scalar_bucket_of(uint64_t hash,
+                                          const libfilter_counting_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  return (libfilter_counting_block_scalar_bucket *)here->block_.block + bucket_idx;
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_scalar_find_hash(
+    uint64_t hash, const libfilter_counting_block *here) {
+  const libfilter_counting_block_scalar_bucket *bucket =
+      libfilter_counting_block_scalar_bucket_of(hash, here);
+  uint8_t positions[8];
+  libfilter_counting_block_scalar_positions(hash, positions);
+  for (unsigned i = 0; i < 8; ++i) {
+    const uint8_t nibble = 0x0f << (4 * (positions[i] & 1));
+    if (0 == (bucket->payload[i][positions[i] / 2] & nibble)) return false;
+  }
+  return true;
+}
+
+__attribute__((always_inline)) inline void libfilter_counting_block_scalar_add_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  libfilter_counting_block_scalar_bucket *bucket =
+      libfilter_counting_block_scalar_bucket_of(hash, here);
+  uint8_t positions[8];
+  libfilter_counting_block_scalar_positions(hash, positions);
+  for (unsigned i = 0; i < 8; ++i) {
+    const uint8_t nibble = 0x0f << (4 * (positions[i] & 1));
+    uint8_t *counters = &bucket->payload[i][positions[i] / 2];
+    if (nibble != (*counters & nibble)) *counters += 1 << (4 * (positions[i] & 1));
+  }
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_scalar_remove_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  if (!libfilter_counting_block_scalar_find_hash(hash, here)) return false;
+  libfilter_counting_block_scalar_bucket *bucket =
+      libfilter_counting_block_scalar_bucket_of(hash, here);
+  uint8_t positions[8];
+  libfilter_counting_block_scalar_positions(hash, positions);
+  for (unsigned i = 0; i < 8; ++i) {
+    const uint8_t nibble = 0x0f << (4 * (positions[i] & 1));
+    uint8_t *counters = &bucket->payload[i][positions[i] / 2];
+    if (nibble != (*counters & nibble)) *counters -= 1 << (4 * (positions[i] & 1));
+  }
+  return true;
+}
+
+__attribute__((always_inline)) inline uint64_t libfilter_counting_block_size_in_bytes(
+    const libfilter_counting_block *here) {
+  return here->num_buckets_ * sizeof(libfilter_counting_block_scalar_bucket);
+}
+
+#if defined(__AVX2__)
+#define LIBFILTER_COUNTING_BLOCK_SIMD
+
+// A bucket is four ymm registers, each holding the counters of two words. For each
+// register, nibble has 0xf in the nibble of the counter of each of its two words and 0
+// elsewhere, and unit has 1 in that nibble and 0 elsewhere.
+typedef struct {
+  __m256i nibble[4];
+  __m256i unit[4];
+} libfilter_counting_block_simd_mask;
+
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline libfilter_counting_block_simd_mask
+libfilter_counting_block_simd_make_mask(uint64_t hash) {
+  const __m256i rehash = {LIBFILTER_INTERNAL_COUNTING_HASH_SEEDS};
+  __m256i positions = _mm256_mullo_epi32(rehash, _mm256_set1_epi32(hash));
+  positions = _mm256_srli_epi32(positions, 32 - 5);
+  // For each word, byte 0 is the index of the byte holding its counter, byte 1 is the
+  // nibble mask within that byte, and byte 2 is the unit within that byte.
+  const __m256i shift =
+      _mm256_slli_epi32(_mm256_and_si256(positions, _mm256_set1_epi32(1)), 2);
+  const __m256i packed = _mm256_or_si256(
+      _mm256_srli_epi32(positions, 1),
+      _mm256_or_si256(_mm256_sllv_epi32(_mm256_set1_epi32(0x0f00), shift),
+                      _mm256_sllv_epi32(_mm256_set1_epi32(0x010000), shift)));
+  const __m256i byte_index = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+                                              14, 15, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+                                              12, 13, 14, 15);
+  libfilter_counting_block_simd_mask result;
+  for (int i = 0; i < 4; ++i) {
+    // Word 2 * i in the low 128-bit lane, word 2 * i + 1 in the high one
+    const __m256i words = _mm256_permutevar8x32_epi32(
+        packed, _mm256_setr_epi32(2 * i, 0, 0, 0, 2 * i + 1, 0, 0, 0));
+    const __m256i at =
+        _mm256_cmpeq_epi8(byte_index, _mm256_shuffle_epi8(words, _mm256_set1_epi8(0)));
+    result.nibble[i] =
+        _mm256_and_si256(at, _mm256_shuffle_epi8(words, _mm256_set1_epi8(1)));
+    result.unit[i] =
+        _mm256_and_si256(at, _mm256_shuffle_epi8(words, _mm256_set1_epi8(2)));
+  }
+  return result;
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_simd_find_hash(
+    uint64_t hash, const libfilter_counting_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  const libfilter_counting_block_simd_mask mask =
+      libfilter_counting_block_simd_make_mask(hash);
+  const __m256i *bucket = (const __m256i *)here->block_.block + 4 * bucket_idx;
+  __m256i empty = _mm256_setzero_si256();
+  for (int i = 0; i < 4; ++i) {
+    // Nonzero exactly in the bytes that hold a counter of the hash value that is 0
+    const __m256i counters = _mm256_and_si256(bucket[i], mask.nibble[i]);
+    empty = _mm256_or_si256(
+        empty, _mm256_and_si256(_mm256_cmpeq_epi8(counters, _mm256_setzero_si256()),
+                                mask.nibble[i]));
+  }
+  return _mm256_testz_si256(empty, empty);
+}
+
+// Adds or subtracts the unit at each counter of the hash value that is not saturated.
+// Saturated counters are 0xf in their nibble, so adding never carries out of a nibble;
+// subtracting is only done when every counter is nonzero, so it never borrows.
+__attribute__((visibility("hidden")))
+__attribute__((always_inline)) inline void libfilter_counting_block_simd_step(
+    const libfilter_counting_block_simd_mask *mask, bool increment, __m256i *bucket) {
+  for (int i = 0; i < 4; ++i) {
+    const __m256i saturated =
+        _mm256_cmpeq_epi8(_mm256_and_si256(bucket[i], mask->nibble[i]), mask->nibble[i]);
+    const __m256i step = _mm256_andnot_si256(saturated, mask->unit[i]);
+    _mm256_store_si256(&bucket[i], increment ? _mm256_add_epi8(bucket[i], step)
+                                             : _mm256_sub_epi8(bucket[i], step));
+  }
+}
+
+__attribute__((always_inline)) inline void libfilter_counting_block_simd_add_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  const libfilter_counting_block_simd_mask mask =
+      libfilter_counting_block_simd_make_mask(hash);
+  __m256i *bucket = (__m256i *)here->block_.block + 4 * bucket_idx;
+  libfilter_counting_block_simd_step(&mask, true, bucket);
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_simd_remove_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  if (!libfilter_counting_block_simd_find_hash(hash, here)) return false;
+  const uint64_t bucket_idx = libfilter_block_index(hash, here->num_buckets_);
+  const libfilter_counting_block_simd_mask mask =
+      libfilter_counting_block_simd_make_mask(hash);
+  __m256i *bucket = (__m256i *)here->block_.block + 4 * bucket_idx;
+  libfilter_counting_block_simd_step(&mask, false, bucket);
+  return true;
+}
+#endif
+
+#if defined(LIBFILTER_COUNTING_BLOCK_SIMD)
+__attribute__((always_inline)) inline void libfilter_counting_block_add_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  libfilter_counting_block_simd_add_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_remove_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  return libfilter_counting_block_simd_remove_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_find_hash(
+    uint64_t hash, const libfilter_counting_block *here) {
+  return libfilter_counting_block_simd_find_hash(hash, here);
+}
+#else
+__attribute__((always_inline)) inline void libfilter_counting_block_add_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  libfilter_counting_block_scalar_add_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_remove_hash(
+    uint64_t hash, libfilter_counting_block *here) {
+  return libfilter_counting_block_scalar_remove_hash(hash, here);
+}
+
+__attribute__((always_inline)) inline bool libfilter_counting_block_find_hash(
+    uint64_t hash, const libfilter_counting_block *here) {
+  return libfilter_counting_block_scalar_find_hash(hash, here);
+}
+#endif
+
+#undef LIBFILTER_INTERNAL_COUNTING_HASH_SEEDS
@@ -13,11 +13,27 @@ typedef struct {
   libfilter_region region_;
 } libfilter_static;
 
+// On allocation failure, returns a filter whose region_.block is NULL, which may be
+// destructed but not probed
 libfilter_static libfilter_static_construct(size_t n, const uint64_t* hashes);
 void libfilter_static_destruct(libfilter_static);
 libfilter_static libfilter_static_clone(libfilter_static);
 static inline bool libfilter_static_find_hash(const libfilter_static filter, uint64_t hash);
 
+#if defined(LIBFILTER_STATIC_VERSION)
+#error "An exported macro cannot be defined"
+#endif
+
+// The version of how static filters are built. A filter is just its length_ bytes, and
+// libfilter_static_find_hash reads the bytes built by every version the same way, so a
+// filter saved by any version can still be loaded and probed. What changes between
+// versions is which bytes a given set of hash values is built into. Version 1 peeled one
+// vertex at a time; version 2 peels in rounds, as libfilter_static_builder describes. So
+// rebuilding a version 1 filter from the same hash values gives a filter of the same
+// length that finds the same hash values, but with different bytes. Callers that compare
+// saved filters by their bytes should save this version with them.
+#define LIBFILTER_STATIC_VERSION 2
+
 #define LIBFILTER_EDGE_ARITY 3
 
 typedef struct {
@@ -25,6 +41,18 @@ typedef struct {
   uint8_t fingerprint_;
 } libfilter_edge;
 
+// structure temporarily used for peeling a hypergraph
+typedef struct {
+  size_t count_;   // number of hyperedges incident to this node
+  uint64_t edges_; // xor of the remaining hyperedges incident to this node
+} libfilter_peel_node;
+
+// strcture temporarily used for tracking the order of peeling
+typedef struct {
+  size_t edge_number_;
+  size_t peeled_vertex_; // the vertex this edge was peeled at
+} libfilter_edge_peel;
+
 // return if v is among the first seen vertexes in vertex
 static inline bool libfilter_in_edge(size_t v, int seen,
                               const size_t vertex[LIBFILTER_EDGE_ARITY]) {
@@ -34,12 +62,23 @@ static inline bool libfilter_in_edge(size_t v, int seen,
   return false;
 }
 
-// makes a hyperedge from hash where each vertex is less than m
-static inline void libfilter_make_edge(uint64_t hash, size_t m, libfilter_edge* result) {
+// The number of consecutive vertices, out of m, that each hyperedge's vertices are in
+static inline uint64_t libfilter_edge_window(size_t m) {
   uint64_t window = LIBFILTER_EDGE_ARITY + pow(m, 2.0 / 3.0);
-  window = (window > m) ? m : window;
+  return (window > m) ? m : window;
+}
+
+// The first vertex of the window of the hyperedge of hash. This grows with hash.
+static inline uint64_t libfilter_edge_start(uint64_t hash, size_t m, uint64_t window) {
   const unsigned __int128 tmp = (unsigned __int128)hash * (unsigned __int128)(m - window);
-  const uint64_t start = tmp >> 64;
+  return tmp >> 64;
+}
+
+// makes a hyperedge from hash where each vertex is less than m, given
+// libfilter_edge_window(m)
+static inline void libfilter_make_edge_in_window(uint64_t hash, size_t m, uint64_t window,
+                                                 libfilter_edge* result) {
+  const uint64_t start = libfilter_edge_start(hash, m, window);
   hash *= (m - window);
   for (int j = 0; j < LIBFILTER_EDGE_ARITY; ++j) {
     const unsigned __int128 tmp = (unsigned __int128)hash * (unsigned __int128)window;
@@ -58,6 +97,11 @@ static inline void libfilter_make_edge(uint64_t hash, size_t m, libfilter_edge*
   //printf("\n");
 }
 
+// makes a hyperedge from hash where each vertex is less than m
+static inline void libfilter_make_edge(uint64_t hash, size_t m, libfilter_edge* result) {
+  libfilter_make_edge_in_window(hash, m, libfilter_edge_window(m), result);
+}
+
 // return true if the fingerprint of edge matches the expected fingerprint in xors
 static inline bool libfilter_find_edge(const libfilter_edge* edge, const uint8_t* xors) {
   uint8_t fingerprint = edge->fingerprint_;
@@ -73,3 +117,72 @@ static inline bool libfilter_static_find_hash(const libfilter_static filter,
   libfilter_make_edge(hash, filter.length_, &e);
   return libfilter_find_edge(&e, (const uint8_t*)filter.region_.block);
 }
+
+// Building a static filter can be split across threads. As with
+// libfilter_taffy_cuckoo_merge_init, the library does not start any threads itself.
+// Instead, the work is divided into shards and done in phases. The caller calls
+// libfilter_static_builder_next, which returns false once the filter is built, and
+// otherwise runs libfilter_static_builder_step for every shard, on as many threads as it
+// likes, waiting for all of them before calling libfilter_static_builder_next again.
+//
+// The hypergraph is peeled in rounds, as described in peel.h, so which vertex each edge
+// is peeled at, and thus the filter, does not depend on the number of shards.
+// libfilter_static_construct is the same as building with one partitioned shard.
+
+// A growable array of vertex numbers, or of counts of peeled edges
+typedef struct {
+  uint64_t* data_;
+  size_t size_;
+  size_t capacity_;
+} libfilter_vertex_list;
+
+typedef struct {
+  size_t n_;
+  const uint64_t* hashes_;
+  int shards_;
+  int phase_;
+  libfilter_static result_;
+  bool result_zero_filled_;
+  libfilter_region edges_region_;
+  libfilter_edge* edges_;
+  libfilter_region nodes_region_;
+  bool nodes_zero_filled_;
+  libfilter_peel_node* nodes_;
+  // The edges peeled so far, round by round
+  libfilter_region peels_region_;
+  libfilter_edge_peel* peels_;
+  size_t peeled_;
+  // rounds_.data_[i] is the number of edges peeled before round i
+  libfilter_vertex_list rounds_;
+  // The round being unpeeled
+  size_t unpeel_round_;
+  // Each shard's part of the frontier of the current round, and of the next one
+  libfilter_vertex_list* frontier_;
+  libfilter_vertex_list* next_;
+  // If true, the edges are sorted by segment; see libfilter_static_builder_set_partitioned
+  bool partitioned_;
+  size_t segments_;
+  // segment_offsets_[shard * segments_ + s] is where the next edge of that shard in
+  // segment s goes
+  size_t* segment_offsets_;
+} libfilter_static_builder;
+
+// shards must be at least 1. Returns 0 on success and < 0 on error.
+int libfilter_static_builder_init(size_t n, const uint64_t* hashes, int shards,
+                                  libfilter_static_builder* here);
+// Each edge's nodes are in a window of consecutive nodes, and the windows of edges made
+// one after another start all over the nodes, so adding edges to nodes and peeling them
+// misses the cache on nearly every node. If partitioned, the builder first counts the
+// edges in each segment of nodes, as long as a window, and then makes them in order of
+// segment, with one more phase. Nodes are then visited roughly in order, and those in use
+// at any time are in about two windows. Edges are numbered differently, but the filter is
+// the same. Must be called before the first call to libfilter_static_builder_next.
+void libfilter_static_builder_set_partitioned(libfilter_static_builder* here,
+                                              bool partitioned);
+// Starts the next phase. Returns false when there are no more, after which the filter
+// may be taken with libfilter_static_builder_finish.
+bool libfilter_static_builder_next(libfilter_static_builder* here);
+// Does shard's part of the current phase. shard must be less than shards.
+void libfilter_static_builder_step(libfilter_static_builder* here, int shard);
+// Frees the builder and returns the filter it built
+libfilter_static libfilter_static_builder_finish(libfilter_static_builder* here);
@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "filter/block.h"
@@ -13,6 +14,18 @@ typedef struct {
   int cursor;
   uint64_t last_ndv;
   int64_t ttl;
+  // Address space reserved for levels before they are added, a few levels at a time.
+  // Growing into a reserved level needs no allocation and no zeroing; its pages are
+  // zero-filled as they are first touched. Arena i is arena_bytes[i] bytes at arenas[i]
+  // and holds levels arena_first[i] up to at most arena_first[i + 1], each starting on a
+  // page boundary after the one before it. No level at or past arena_levels is reserved.
+  // The next arena is reserved as the filter grows into the last level of the current
+  // one, so that the filter never reserves much more than it will use.
+  void* arenas[48];
+  uint64_t arena_bytes[48];
+  int arena_first[48];
+  int num_arenas;
+  int arena_levels;
 } libfilter_taffy_block;
 
 int libfilter_taffy_block_clone(const libfilter_taffy_block* from,
@@ -20,6 +33,8 @@ int libfilter_taffy_block_clone(const libfilter_taffy_block* from,
 
 void libfilter_taffy_block_destruct(libfilter_taffy_block* here);
 
+// Returns 0 on success and < 0 on allocation failure, in which case nothing is left to
+// destruct
 int libfilter_taffy_block_init(uint64_t ndv, double fpp, libfilter_taffy_block*);
 
 INLINE uint64_t libfilter_taffy_block_size_in_bytes(const libfilter_taffy_block* here) {
@@ -32,6 +47,69 @@ INLINE uint64_t libfilter_taffy_block_size_in_bytes(const libfilter_taffy_block*
 
 void libfilter_taffy_block_upsize(libfilter_taffy_block* here);
 
+// Serialization. The format is a header holding sizes, cursor, last_ndv and ttl and the
+// number of buckets in each level, followed by the buckets of each level in order, each
+// level starting on a 32-byte boundary. Everything is in the byte order of the machine
+// that wrote it, which is recorded in the header; images can only be read on machines
+// with the same byte order.
+
+// The number of bytes libfilter_taffy_block_serialize writes
+uint64_t libfilter_taffy_block_serialized_bytes(const libfilter_taffy_block* here);
+void libfilter_taffy_block_serialize(const libfilter_taffy_block* here, char* to);
+// Initializes `to` as a copy of the serialized filter, which can continue to grow.
+// Returns 0 on success and < 0 if the image is invalid or on allocation failure, in
+// which case `to` may still be passed to libfilter_taffy_block_destruct.
+int libfilter_taffy_block_deserialize(const char* from, uint64_t bytes,
+                                      libfilter_taffy_block* to);
+
+// A read-only view of a serialized filter, in a buffer the caller owns or in a file
+// mapped into memory, with no copy. filter may be passed to the find functions, but not
+// to any function that adds to it, clones it, or destroys it.
+typedef struct {
+  libfilter_taffy_block filter;
+  // If the view was created by libfilter_taffy_block_view_map, the mapping to unmap,
+  // otherwise NULL
+  void* mapping;
+  uint64_t mapping_bytes;
+} libfilter_taffy_block_view;
+
+// from must be 32-byte aligned and must outlive the view. Returns 0 on success and < 0 if
+// the image is invalid.
+int libfilter_taffy_block_view_init(const void* from, uint64_t bytes,
+                                    libfilter_taffy_block_view* here);
+// Maps the file at path read-only. Returns 0 on success and < 0 on error.
+int libfilter_taffy_block_view_map(const char* path, libfilter_taffy_block_view* here);
+// Returns 0 on success and < 0 on error. A view that failed to open may also be destructed.
+int libfilter_taffy_block_view_destruct(libfilter_taffy_block_view* here);
+
+// Returns the number of hash values added to the filter, counting repeats.
+INLINE uint64_t libfilter_taffy_block_ndv(const libfilter_taffy_block* here) {
+  // Level i was sized for (last_ndv >> (cursor - 1)) << i hash values, and the newest
+  // level has room for ttl more.
+  return 2 * here->last_ndv - (here->last_ndv >> (here->cursor - 1)) - here->ttl;
+}
+
+// Initializes `to` as a single block filter that finds every hash value found by `from`,
+// with false positive probability about fpp, so that lookups probe one level rather than
+// all of them.
+//
+// If hashes is not NULL, `to` is sized for n hash values and they are added to it; they
+// should be all of the hash values added to `from`.
+//
+// If hashes is NULL, `to` is sized for libfilter_taffy_block_ndv(from) hash values and
+// the levels of `from` are ORed into it: each bucket of each level is ORed into every
+// bucket of `to` that some hash value in it maps to. That is only possible when every
+// level is at least as large as `to`. A filter that has grown holds more hash values
+// than its first level was sized for, so folding it usually is not possible; then this
+// returns < 0 without touching `to`, and the caller must pass the hash values instead.
+// Unless the number of buckets in each level is a multiple of the number in `to`, some
+// buckets are ORed into two buckets of `to`, so the false positive probability is
+// somewhat higher than fpp when the levels are not much larger than `to`.
+//
+// Returns 0 on success and < 0 on error.
+int libfilter_taffy_block_compact(const libfilter_taffy_block* from, double fpp,
+                                  const uint64_t* hashes, size_t n, libfilter_block* to);
+
 INLINE bool libfilter_taffy_block_add_hash(libfilter_taffy_block* here, uint64_t h) {
   if (here->ttl <= 0) libfilter_taffy_block_upsize(here);
   libfilter_block_add_hash(h, &here->levels[here->cursor - 1]);
@@ -39,10 +117,117 @@ INLINE bool libfilter_taffy_block_add_hash(libfilter_taffy_block* here, uint64_t
   return true;
 }
 
+// The number of levels that are ready to be probed. libfilter_taffy_block_upsize builds
+// a level before publishing it by advancing the cursor, so a find running concurrently
+// with libfilter_taffy_block_add_hash_atomic never probes a level that is half-built.
+INLINE int libfilter_taffy_block_cursor(const libfilter_taffy_block* here) {
+  return __atomic_load_n(&here->cursor, __ATOMIC_ACQUIRE);
+}
+
+// Like libfilter_taffy_block_add_hash, but safe to call from many threads at once on the
+// same filter, and concurrently with the find functions. ttl is decremented atomically;
+// the one thread that takes it from 0 to -1 grows the filter, while the other threads
+// wait for the new level. Bits are set with libfilter_block_add_hash_atomic, so inserts
+// are visible to other threads once the inserting threads are joined or otherwise
+// synchronized with.
+INLINE bool libfilter_taffy_block_add_hash_atomic(libfilter_taffy_block* here,
+                                                  uint64_t h) {
+  for (;;) {
+    const int64_t ttl = __atomic_fetch_sub(&here->ttl, 1, __ATOMIC_ACQUIRE);
+    if (ttl > 0) {
+      // The acquire makes the level published before ttl was last reset visible.
+      const int cursor = libfilter_taffy_block_cursor(here);
+      libfilter_block_add_hash_atomic(h, &here->levels[cursor - 1]);
+      return true;
+    }
+    if (ttl == 0) {
+      libfilter_taffy_block_upsize(here);
+      continue;
+    }
+    while (__atomic_load_n(&here->ttl, __ATOMIC_RELAXED) <= 0) {
+#if defined(__x86_64)
+      __builtin_ia32_pause();
+#endif
+    }
+  }
+}
+
+// Levels are probed newest-first: the newest level is the largest and holds about half of
+// the hash values, so finds of present values stop earliest that way.
 INLINE bool libfilter_taffy_block_find_hash(const libfilter_taffy_block* here,
                                             uint64_t h) {
-  for (int i = 0; i < here->cursor; ++i) {
+  for (int i = libfilter_taffy_block_cursor(here) - 1; i >= 0; --i) {
     if (libfilter_block_find_hash(h, &here->levels[i])) return true;
   }
   return false;
 }
+
+// Sets idx[i] to the bucket of h in level i, for each of the first `levels` levels, and
+// prefetches all of those buckets. levels is normally libfilter_taffy_block_cursor(here).
+INLINE void libfilter_taffy_block_prefetch(const libfilter_taffy_block* here, int levels,
+                                           uint64_t h, uint64_t idx[48]) {
+  for (int i = 0; i < levels; ++i) {
+    idx[i] = libfilter_block_index(h, here->levels[i].num_buckets_);
+    libfilter_block_prefetch(idx[i], &here->levels[i], false);
+  }
+}
+
+// Tests h against each of the first `levels` levels i at bucket idx[i]. The mask of h is
+// the same in every level, so it is computed once, and the levels are tested without
+// branching.
+INLINE bool libfilter_taffy_block_find_hash_at(const libfilter_taffy_block* here,
+                                               int levels, uint64_t h,
+                                               const uint64_t idx[48]) {
+#if defined(__AVX2__)
+  const __m256i mask = libfilter_block_simd_make_mask(h);
+  int found = 0;
+  for (int i = 0; i < levels; ++i) {
+    const __m256i* bucket = (const __m256i*)here->levels[i].block_.block;
+    found |= _mm256_testc_si256(bucket[idx[i]], mask);
+  }
+  return found;
+#else
+  const libfilter_block_scalar_bucket mask = libfilter_block_scalar_make_mask(h);
+  bool found = false;
+  for (int i = 0; i < levels; ++i) {
+    const uint32_t* bucket = &here->levels[i].block_.block[8 * idx[i]];
+    bool in_level = true;
+    for (int j = 0; j < 8; ++j) in_level &= (0 != (bucket[j] & mask.payload[j]));
+    found |= in_level;
+  }
+  return found;
+#endif
+}
+
+#if defined(LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW)
+#error "An exported feature macro cannot be defined"
+#endif
+
+// How many hash values ahead libfilter_taffy_block_find_hash_batch prefetches. Each hash
+// value prefetches one bucket per level, so this is smaller than
+// LIBFILTER_BLOCK_BATCH_WINDOW.
+#define LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW 4
+
+// Sets out[i] to libfilter_taffy_block_find_hash(here, hashes[i]) for each i < n. The
+// buckets of the hash values LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW places ahead are
+// prefetched in every level, so the misses of a lookup overlap with those of the lookups
+// after it, not just with each other.
+INLINE void libfilter_taffy_block_find_hash_batch(const libfilter_taffy_block* here,
+                                                  const uint64_t* hashes, size_t n,
+                                                  uint8_t* out) {
+  // Levels added during the batch are not probed, so that every idx is filled in for the
+  // same levels.
+  const int levels = libfilter_taffy_block_cursor(here);
+  uint64_t idx[LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW][48];
+  for (size_t i = 0; i < n && i < LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW; ++i) {
+    libfilter_taffy_block_prefetch(here, levels, hashes[i], idx[i]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t* slot = idx[i % LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW];
+    out[i] = libfilter_taffy_block_find_hash_at(here, levels, hashes[i], slot);
+    if (i + LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW < n) {
+      libfilter_taffy_block_prefetch(
+          here, levels, hashes[i + LIBFILTER_TAFFY_BLOCK_BATCH_WINDOW], slot);
+    }
+  }
+}
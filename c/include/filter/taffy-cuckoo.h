@@ -8,7 +8,7 @@
 // See "How to Approximate A Set Without Knowing Its Size In Advance", by
 // Rasmus Pagh, Gil Segev, and Udi Wieder
 //
-// TODO: Intersection, iteration, Freeze/Thaw, serialize/deserialize
+// TODO: Intersection, iteration, serialize/deserialize of unfrozen filters
 
 #pragma once
 
@@ -103,12 +103,18 @@ INLINE bool libfilter_taffy_cuckoo_path_equal(libfilter_taffy_cuckoo_path here,
 //
 // Operates on the high bits, since bits must be moved from the tail into the fingerprint
 // and then bucket.
-INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_to_path(
-    uint64_t raw, const libfilter_feistel* f, uint64_t log_side_size) {
-  uint64_t pre_hash_index_and_fp =
-      raw >> (64 - log_side_size - libfilter_taffy_cuckoo_head_size);
-  uint64_t hashed_index_and_fp = libfilter_feistel_permute_forward(
-      f, log_side_size + libfilter_taffy_cuckoo_head_size, pre_hash_index_and_fp);
+//
+// libfilter_taffy_cuckoo_to_path_permuted does everything but the hashing, given the
+// permuted bits: libfilter_taffy_cuckoo_to_path(raw, f, log_side_size) is
+// libfilter_taffy_cuckoo_to_path_permuted(raw, libfilter_feistel_permute_forward(f,
+// log_side_size + libfilter_taffy_cuckoo_head_size,
+// libfilter_taffy_cuckoo_pre_hash(raw, log_side_size)), log_side_size).
+INLINE uint64_t libfilter_taffy_cuckoo_pre_hash(uint64_t raw, uint64_t log_side_size) {
+  return raw >> (64 - log_side_size - libfilter_taffy_cuckoo_head_size);
+}
+
+INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_to_path_permuted(
+    uint64_t raw, uint64_t hashed_index_and_fp, uint64_t log_side_size) {
   uint64_t index = hashed_index_and_fp >> libfilter_taffy_cuckoo_head_size;
   libfilter_taffy_cuckoo_path p;
   p.bucket = index;
@@ -126,6 +132,14 @@ INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_to_path(
   return p;
 }
 
+INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_to_path(
+    uint64_t raw, const libfilter_feistel* f, uint64_t log_side_size) {
+  uint64_t hashed_index_and_fp = libfilter_feistel_permute_forward(
+      f, log_side_size + libfilter_taffy_cuckoo_head_size,
+      libfilter_taffy_cuckoo_pre_hash(raw, log_side_size));
+  return libfilter_taffy_cuckoo_to_path_permuted(raw, hashed_index_and_fp, log_side_size);
+}
+
 // Uses reverse permuting to get back the high bits of the original hashed value. Elides
 // the tail, since the tail may have a limited length, and once that's appended to a raw
 // value, one can't tell a short tail from one that just has a lot of zeros at the end.
@@ -151,6 +165,9 @@ typedef struct {
 // buckets from one array. Each side has a stash that holds any paths that couldn't fit.
 // This is useful for random-walk cuckoo hashing, in which the leftover path needs  place
 // to be stored so it doesn't invalidate old inserts.
+//
+// The stash is sorted by bucket, so that a find only looks at the stashed paths in its
+// own bucket, which it finds by binary search.
 typedef struct {
   libfilter_feistel f;
   libfilter_taffy_cuckoo_bucket* data;
@@ -163,6 +180,89 @@ typedef struct {
 libfilter_taffy_cuckoo_side libfilter_taffy_cuckoo_side_create(int log_side_size,
                                                                const uint64_t* keys);
 
+// Adds p to the stash, keeping it sorted
+void libfilter_taffy_cuckoo_stash_add(libfilter_taffy_cuckoo_side* here,
+                                      libfilter_taffy_cuckoo_path p);
+
+// Returns the index of the first stashed path with bucket at least `bucket`
+INLINE size_t libfilter_taffy_cuckoo_stash_lower_bound(
+    const libfilter_taffy_cuckoo_side* here, uint64_t bucket) {
+  size_t lo = 0, hi = here->stash_size;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (here->stash[mid].bucket < bucket) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// A bucket is four 16-bit slots, each a 10-bit fingerprint below a 6-bit tail. The
+// functions below treat it as one uint64_t and test all four slots at once (SWAR), setting
+// bit 15 of each 16-bit lane for which the test passes. Each lane holds at most 15
+// significant bits, so setting bit 15 before subtracting 1 keeps borrows from crossing
+// lanes.
+
+#if defined(LIBFILTER_TAFFY_CUCKOO_LANES)
+#error "An exported feature macro cannot be defined"
+#endif
+
+#define LIBFILTER_TAFFY_CUCKOO_LANES(x) (0x0001000100010001ULL * (x))
+
+INLINE uint64_t libfilter_taffy_cuckoo_bucket_load(const libfilter_taffy_cuckoo_bucket* b) {
+  uint64_t result;
+  memcpy(&result, b, sizeof(result));
+  return result;
+}
+
+// Sets bit 15 of each lane of x that is not zero
+INLINE uint64_t libfilter_taffy_cuckoo_lanes_nonzero(uint64_t x) {
+  return ((x | LIBFILTER_TAFFY_CUCKOO_LANES(0x8000)) - LIBFILTER_TAFFY_CUCKOO_LANES(1)) &
+         LIBFILTER_TAFFY_CUCKOO_LANES(0x8000);
+}
+
+// Marks the slots of the bucket that are empty
+INLINE uint64_t libfilter_taffy_cuckoo_bucket_empty(uint64_t bucket) {
+  const uint64_t tails =
+      (bucket >> libfilter_taffy_cuckoo_head_size) &
+      LIBFILTER_TAFFY_CUCKOO_LANES((1 << (libfilter_taffy_cuckoo_tail_size + 1)) - 1);
+  return ~libfilter_taffy_cuckoo_lanes_nonzero(tails) &
+         LIBFILTER_TAFFY_CUCKOO_LANES(0x8000);
+}
+
+// Marks the slots of the bucket that are not empty, hold the fingerprint of s, and hold a
+// tail that is a prefix of the tail of s; that is, the slots for which
+// libfilter_taffy_is_prefix_of(tail, s.tail) is true.
+INLINE uint64_t libfilter_taffy_cuckoo_bucket_match(uint64_t bucket,
+                                                    libfilter_taffy_cuckoo_slot s) {
+  const uint64_t fp_mask =
+      LIBFILTER_TAFFY_CUCKOO_LANES((1 << libfilter_taffy_cuckoo_head_size) - 1);
+  const uint64_t tail_mask =
+      LIBFILTER_TAFFY_CUCKOO_LANES((1 << (libfilter_taffy_cuckoo_tail_size + 1)) - 1);
+  const uint64_t fp_differs = libfilter_taffy_cuckoo_lanes_nonzero(
+      (bucket & fp_mask) ^ LIBFILTER_TAFFY_CUCKOO_LANES(s.fingerprint));
+  const uint64_t x = (bucket >> libfilter_taffy_cuckoo_head_size) & tail_mask;
+  const uint64_t y = LIBFILTER_TAFFY_CUCKOO_LANES(s.tail);
+  // The lowest set bit of x, which marks the end of its sequence. x is at most 6 bits, so
+  // 0x100 - x is -x in the low 8 bits of each lane.
+  const uint64_t x_low = x & (LIBFILTER_TAFFY_CUCKOO_LANES(0x100) - x);
+  // The bits at or below the lowest set bit of x. Lanes in which x is zero get garbage,
+  // but they are empty slots.
+  const uint64_t below = (((x_low << 1) | LIBFILTER_TAFFY_CUCKOO_LANES(0x8000)) -
+                          LIBFILTER_TAFFY_CUCKOO_LANES(1)) &
+                         tail_mask;
+  // x is a prefix of y when they agree above the lowest set bit of x, and y has a set bit
+  // at or below it, so y's sequence is at least as long.
+  const uint64_t sequence_differs = libfilter_taffy_cuckoo_lanes_nonzero((x ^ y) & ~below);
+  const uint64_t y_longer = libfilter_taffy_cuckoo_lanes_nonzero(y & below);
+  return libfilter_taffy_cuckoo_lanes_nonzero(x) & ~fp_differs & ~sequence_differs &
+         y_longer;
+}
+
+#undef LIBFILTER_TAFFY_CUCKOO_LANES
+
 // Returns an empty path (tail = 0) if insert added a new element. Returns p if insert
 // succeded without anning anything new. Returns something else if that something else
 // was displaced by the insert. That item must be inserted then
@@ -171,28 +271,30 @@ INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_side_insert(
     libfilter_pcg_random* rng) {
   assert(p.slot.tail != 0);
   libfilter_taffy_cuckoo_bucket* b = &here->data[p.bucket];
-  for (int i = 0; i < libfilter_slots; ++i) {
-    if (b->data[i].tail == 0) {
-      // empty slot
-      b->data[i] = p.slot;
-      p.slot.tail = 0;
-      return p;
-    }
-    if (b->data[i].fingerprint == p.slot.fingerprint) {
-      // already present in the table
-      if (libfilter_taffy_is_prefix_of(b->data[i].tail, p.slot.tail)) {
-        return p;
-      }
-      /*
-      // This has a negligible effect on fpp
-      auto c = Combinable(b[i].tail, p.tail);
-      if (c > 0) {
-        b[i].tail = c;
-        return p;
-      }
-      */
-    }
+  const uint64_t bucket = libfilter_taffy_cuckoo_bucket_load(b);
+  const uint64_t empty = libfilter_taffy_cuckoo_bucket_empty(bucket);
+  const uint64_t match = libfilter_taffy_cuckoo_bucket_match(bucket, p.slot);
+  // Slots are tested in order, so whichever of an empty slot and a match comes first
+  // wins. Lane i's flag is bit 16 * i + 15, so the lowest flag is the first slot.
+  const uint64_t first = (empty | match) & -(empty | match);
+  if (first & match) {
+    // already present in the table
+    return p;
+  }
+  if (first) {
+    // empty slot
+    b->data[__builtin_ctzll(first) / 16] = p.slot;
+    p.slot.tail = 0;
+    return p;
   }
+  /*
+  // Combining tails has a negligible effect on fpp
+  auto c = Combinable(b[i].tail, p.tail);
+  if (c > 0) {
+    b[i].tail = c;
+    return p;
+  }
+  */
   // Kick something random and return it
   int i = libfilter_pcg_random_get(rng);
   libfilter_taffy_cuckoo_path result = p;
@@ -204,22 +306,16 @@ INLINE libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_side_insert(
 INLINE bool libfilter_taffy_cuckoo_side_find(const libfilter_taffy_cuckoo_side* here,
                                              libfilter_taffy_cuckoo_path p) {
   assert(p.slot.tail != 0);
-  for (unsigned i = 0; i < here->stash_size; ++i) {
-    if (here->stash[i].slot.tail != 0 && p.bucket == here->stash[i].bucket &&
+  for (size_t i = libfilter_taffy_cuckoo_stash_lower_bound(here, p.bucket);
+       i < here->stash_size && here->stash[i].bucket == p.bucket; ++i) {
+    if (here->stash[i].slot.tail != 0 &&
         p.slot.fingerprint == here->stash[i].slot.fingerprint &&
         libfilter_taffy_is_prefix_of(here->stash[i].slot.tail, p.slot.tail)) {
       return true;
     }
   }
-  libfilter_taffy_cuckoo_bucket* b = &here->data[p.bucket];
-  for (int i = 0; i < libfilter_slots; ++i) {
-    if (b->data[i].tail == 0) continue;
-    if (b->data[i].fingerprint == p.slot.fingerprint &&
-        libfilter_taffy_is_prefix_of(b->data[i].tail, p.slot.tail)) {
-      return true;
-    }
-  }
-  return false;
+  return 0 != libfilter_taffy_cuckoo_bucket_match(
+                   libfilter_taffy_cuckoo_bucket_load(&here->data[p.bucket]), p.slot);
 }
 
 typedef struct {
@@ -237,6 +333,7 @@ typedef struct libfilter_frozen_taffy_cuckoo_struct {
   libfilter_feistel hash_[2];
   int log_side_size_;
   libfilter_frozen_taffy_cuckoo_bucket* data_[2];
+  // Sorted, for binary search
   uint64_t* stash_[2];
   size_t stash_capacity_[2];
   size_t stash_size_[2];
@@ -244,6 +341,21 @@ typedef struct libfilter_frozen_taffy_cuckoo_struct {
 
 size_t libfilter_frozen_taffy_cuckoo_size_in_bytes(const libfilter_frozen_taffy_cuckoo*);
 
+// Returns true if x is in the sorted stash of n permuted values
+INLINE bool libfilter_frozen_taffy_cuckoo_stash_find(const uint64_t* stash, size_t n,
+                                                     uint64_t x) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    if (stash[mid] < x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < n && stash[lo] == x;
+}
+
 INLINE uint64_t libfilter_cuckoo_has_zero_10(uint64_t x) {
   return ((x)-0x40100401ULL) & (~(x)) & 0x8020080200ULL;
 }
@@ -251,40 +363,110 @@ INLINE uint64_t libfilter_cuckoo_has_value_10(uint64_t x, uint64_t n) {
   return libfilter_cuckoo_has_zero_10((x) ^ (0x40100401ULL * (n)));
 }
 
+// Returns non-zero if a fingerprint, the low bits of permuted[i], is in bucket z[i] of
+// side i, for either i. Frozen finds match a fingerprint of zero, which a frozen bucket
+// cannot tell from an empty slot, unconditionally.
+INLINE uint64_t libfilter_frozen_taffy_cuckoo_buckets_match(const uint64_t z[2],
+                                                            const uint64_t permuted[2]) {
+  const uint64_t f0 = permuted[0] & ((1 << libfilter_taffy_cuckoo_head_size) - 1);
+  const uint64_t f1 = permuted[1] & ((1 << libfilter_taffy_cuckoo_head_size) - 1);
+  return libfilter_cuckoo_has_value_10(z[0], f0) | libfilter_cuckoo_has_value_10(z[1], f1) |
+         (f0 == 0) | (f1 == 0);
+}
+
+// Returns true if permuted[i] is in the stash of side i, for either i. The stashes are
+// usually empty, so this is usually one well-predicted branch.
+INLINE bool libfilter_frozen_taffy_cuckoo_stashes_find(
+    const libfilter_frozen_taffy_cuckoo* here, const uint64_t permuted[2]) {
+  return (here->stash_size_[0] | here->stash_size_[1]) != 0 &&
+         (libfilter_frozen_taffy_cuckoo_stash_find(here->stash_[0], here->stash_size_[0],
+                                                   permuted[0]) ||
+          libfilter_frozen_taffy_cuckoo_stash_find(here->stash_[1], here->stash_size_[1],
+                                                   permuted[1]));
+}
+
+// Both permutations are computed and both buckets are loaded before either is looked at,
+// so the two cache misses overlap rather than one waiting on the other.
 INLINE bool libfilter_frozen_taffy_cuckoo_find_hash(
     const libfilter_frozen_taffy_cuckoo* here, uint64_t x) {
+  const int w = here->log_side_size_ + libfilter_taffy_cuckoo_head_size;
+  const uint64_t y = x >> (64 - w);
+  uint64_t permuted[2], z[2] = {0, 0};
   for (int i = 0; i < 2; ++i) {
-    uint64_t y = x >> (64 - here->log_side_size_ - libfilter_taffy_cuckoo_head_size);
-    uint64_t permuted = libfilter_feistel_permute_forward(
-        &here->hash_[i], here->log_side_size_ + libfilter_taffy_cuckoo_head_size, y);
-    for (size_t j = 0; j < here->stash_size_[i]; ++j) {
-      if (here->stash_[i][j] == permuted) return true;
-    }
-    libfilter_frozen_taffy_cuckoo_bucket* b =
-        &here->data_[i][permuted >> libfilter_taffy_cuckoo_head_size];
-    uint64_t fingerprint = permuted & ((1 << libfilter_taffy_cuckoo_head_size) - 1);
-    if (0 == fingerprint) return true;
-    // TODO: SWAR
-    uint64_t z = 0;
-    memcpy(&z, b, sizeof(*b));
-    if (libfilter_cuckoo_has_value_10(z, fingerprint)) return true;
+    permuted[i] = libfilter_feistel_permute_forward(&here->hash_[i], w, y);
   }
-  return false;
+  for (int i = 0; i < 2; ++i) {
+    memcpy(&z[i], &here->data_[i][permuted[i] >> libfilter_taffy_cuckoo_head_size],
+           sizeof(libfilter_frozen_taffy_cuckoo_bucket));
+  }
+  return (0 != libfilter_frozen_taffy_cuckoo_buckets_match(z, permuted)) |
+         libfilter_frozen_taffy_cuckoo_stashes_find(here, permuted);
 }
 
 void libfilter_frozen_taffy_cuckoo_destruct(libfilter_frozen_taffy_cuckoo* here);
 
+// Serialization of frozen filters. The format is a 96-byte header holding the magic
+// string "libftcf", a version, log_side_size_, the size of each side's stash and each
+// side's four Feistel keys, followed by the two sorted stashes as 64-bit integers and
+// then the buckets of side 0 and of side 1, five bytes each. Everything is little-endian
+// and the layout does not depend on the machine, so the Java FrozenTaffyCuckooFilter
+// reads and writes the same images; its tests read one written by this library. Only
+// little-endian machines can use the functions below, which fail on others.
+
+// The number of bytes libfilter_frozen_taffy_cuckoo_serialize writes
+uint64_t libfilter_frozen_taffy_cuckoo_serialized_bytes(
+    const libfilter_frozen_taffy_cuckoo* here);
+// Returns 0 on success and < 0 on error
+int libfilter_frozen_taffy_cuckoo_serialize(const libfilter_frozen_taffy_cuckoo* here,
+                                            char* to);
+// Initializes `to` as a copy of the serialized filter. Returns 0 on success and < 0 if
+// the image is invalid or on allocation failure.
+int libfilter_frozen_taffy_cuckoo_deserialize(const char* from, uint64_t bytes,
+                                              libfilter_frozen_taffy_cuckoo* to);
+
+// A frozen filter whose buckets and stashes are read in place from a serialized image,
+// in a buffer the caller owns or in a file mapped into memory. filter may be passed to
+// the find functions, but not to libfilter_frozen_taffy_cuckoo_destruct.
+typedef struct {
+  libfilter_frozen_taffy_cuckoo filter;
+  // If the view was created by libfilter_frozen_taffy_cuckoo_view_map, the mapping to
+  // unmap, otherwise NULL
+  void* mapping;
+  uint64_t mapping_bytes;
+} libfilter_frozen_taffy_cuckoo_view;
+
+// from must be 8-byte aligned and must outlive the view. Returns 0 on success and < 0 if
+// the image is invalid.
+int libfilter_frozen_taffy_cuckoo_view_init(const void* from, uint64_t bytes,
+                                            libfilter_frozen_taffy_cuckoo_view* here);
+// Maps the file at path read-only. Returns 0 on success and < 0 on error.
+int libfilter_frozen_taffy_cuckoo_view_map(const char* path,
+                                           libfilter_frozen_taffy_cuckoo_view* here);
+// Returns 0 on success and < 0 on error. A view that failed to open may also be destructed.
+int libfilter_frozen_taffy_cuckoo_view_destruct(libfilter_frozen_taffy_cuckoo_view* here);
+
 typedef struct libfilter_taffy_cuckoo_struct {
   libfilter_taffy_cuckoo_side sides[2];
   int log_side_size;
   libfilter_pcg_random rng;
   const uint64_t* entropy;
   uint64_t occupied;
+  // If true, libfilter_taffy_cuckoo_upsize does not move the contents of the filter into
+  // the new, larger table all at once. Instead, the old table is kept in migrating, and
+  // each insert moves a few more of its buckets, while finds check both tables. When
+  // every bucket has been moved, the old table is freed and migrating is reset to NULL.
+  bool incremental;
+  struct libfilter_taffy_cuckoo_struct* migrating;
+  // The number of buckets of migrating, counting both sides, that have been moved
+  uint64_t migrated;
 } libfilter_taffy_cuckoo;
 
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y);
 int libfilter_taffy_cuckoo_clone(const libfilter_taffy_cuckoo* that,
                                  libfilter_taffy_cuckoo*);
+// entropy must hold 8 values and outlive the filter and any filter upsized from it
+libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create(int log_side_size,
+                                                     const uint64_t* entropy);
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create_with_bytes(uint64_t bytes);
 void libfilter_taffy_cuckoo_init(uint64_t bytes, libfilter_taffy_cuckoo* here);
 libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
@@ -292,10 +474,45 @@ libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
 void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo* here,
                                         libfilter_frozen_taffy_cuckoo* result);
 
+// Initializes `to` as a filter holding every fingerprint in here, so that it can grow
+// again. Freezing drops the tails, so each fingerprint comes back with an empty tail,
+// which matches any tail: the thawed filter finds everything the frozen one held, and
+// doubles its entries the next time it is upsized. A frozen bucket cannot tell an empty
+// slot from a fingerprint of zero, so each bucket with a zero slot gets an entry with
+// fingerprint zero.
+//
+// entropy must be the entropy here was created with, or NULL for the entropy used by
+// libfilter_taffy_cuckoo_init. It must outlive `to` as in libfilter_taffy_cuckoo_create.
+// Returns 0 on success and < 0 if entropy does not match here's keys.
+int libfilter_frozen_taffy_cuckoo_thaw(const libfilter_frozen_taffy_cuckoo* here,
+                                       const uint64_t* entropy, libfilter_taffy_cuckoo* to);
+
 uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here);
 
-INLINE bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here,
-                                             uint64_t k) {
+// Turns incremental upsizing on or off; see libfilter_taffy_cuckoo::incremental. Turning
+// it off finishes any upsize in progress.
+void libfilter_taffy_cuckoo_set_incremental(libfilter_taffy_cuckoo* here,
+                                            bool incremental);
+
+#if defined(LIBFILTER_TAFFY_CUCKOO_MIGRATE_BUCKETS)
+#error "An exported feature macro cannot be defined"
+#endif
+
+// The number of buckets of the old table each insert moves during an incremental upsize.
+// The new table has room for more than three times as many inserts as the old one has
+// buckets before it must upsize again, so this is enough to finish in time.
+#define LIBFILTER_TAFFY_CUCKOO_MIGRATE_BUCKETS 2
+
+// Moves up to n more buckets of here->migrating into here, freeing it if that was the
+// last of them.
+void libfilter_taffy_cuckoo_migrate(libfilter_taffy_cuckoo* here, uint64_t n);
+
+// Finishes any incremental upsize in progress
+void libfilter_taffy_cuckoo_finish_upsize(libfilter_taffy_cuckoo* here);
+
+// Looks for k in the table of here, not in here->migrating
+INLINE bool libfilter_taffy_cuckoo_find_hash_in_table(const libfilter_taffy_cuckoo* here,
+                                                      uint64_t k) {
 #if defined(__clang) || defined(__clang__)
 #pragma unroll
 #else
@@ -310,10 +527,82 @@ INLINE bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here,
   return false;
 }
 
+INLINE bool libfilter_taffy_cuckoo_find_hash(const libfilter_taffy_cuckoo* here,
+                                             uint64_t k) {
+  return libfilter_taffy_cuckoo_find_hash_in_table(here, k) ||
+         (here->migrating != NULL &&
+          libfilter_taffy_cuckoo_find_hash_in_table(here->migrating, k));
+}
+
 INLINE uint64_t libfilter_taffy_cuckoo_capacity(const libfilter_taffy_cuckoo* here) {
   return 2 * libfilter_slots * (1ul << here->log_side_size);
 }
 
+#if defined(LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH)
+#error "An exported feature macro cannot be defined"
+#endif
+
+// The number of hash values whose paths the batch functions compute at once. See
+// libfilter_feistel_permute_forward4.
+#define LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH 4
+
+// Sets paths[s][j] to the path of hashes[j] in side s, for each j < n <= 4 and s < sides,
+// and prefetches the buckets they point to.
+INLINE void libfilter_taffy_cuckoo_batch_paths(
+    const libfilter_taffy_cuckoo* here, int sides, const uint64_t* hashes, size_t n,
+    libfilter_taffy_cuckoo_path paths[2][LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH],
+    bool for_write) {
+  uint64_t pre_hash[LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH] = {0};
+  for (size_t j = 0; j < n; ++j) {
+    pre_hash[j] = libfilter_taffy_cuckoo_pre_hash(hashes[j], here->log_side_size);
+  }
+  for (int s = 0; s < sides; ++s) {
+    uint64_t permuted[LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH];
+    libfilter_feistel_permute_forward4(
+        &here->sides[s].f, here->log_side_size + libfilter_taffy_cuckoo_head_size,
+        pre_hash, permuted);
+    for (size_t j = 0; j < n; ++j) {
+      paths[s][j] = libfilter_taffy_cuckoo_to_path_permuted(hashes[j], permuted[j],
+                                                            here->log_side_size);
+      const libfilter_taffy_cuckoo_bucket* b = &here->sides[s].data[paths[s][j].bucket];
+      if (for_write) {
+        __builtin_prefetch(b, 1, 3);
+      } else {
+        __builtin_prefetch(b, 0, 3);
+      }
+    }
+  }
+}
+
+// Sets out[i] to libfilter_taffy_cuckoo_find_hash(here, hashes[i]) for each i < n. The
+// paths of each group of LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH hash values are computed
+// together, and their buckets in both sides are prefetched while the group before them
+// is looked up.
+INLINE void libfilter_taffy_cuckoo_find_hash_batch(const libfilter_taffy_cuckoo* here,
+                                                   const uint64_t* hashes, size_t n,
+                                                   uint8_t* out) {
+  const size_t w = LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH;
+  libfilter_taffy_cuckoo_path paths[2][2][LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH];
+  if (n > 0) {
+    libfilter_taffy_cuckoo_batch_paths(here, 2, hashes, (n < w) ? n : w, paths[0], false);
+  }
+  for (size_t i = 0; i < n; i += w) {
+    const size_t m = (n - i < w) ? (n - i) : w;
+    const int current = (i / w) & 1;
+    if (i + w < n) {
+      const size_t next = (n - i - w < w) ? (n - i - w) : w;
+      libfilter_taffy_cuckoo_batch_paths(here, 2, &hashes[i + w], next,
+                                         paths[1 - current], false);
+    }
+    for (size_t j = 0; j < m; ++j) {
+      out[i + j] = libfilter_taffy_cuckoo_side_find(&here->sides[0], paths[current][0][j]) ||
+                   libfilter_taffy_cuckoo_side_find(&here->sides[1], paths[current][1][j]) ||
+                   (here->migrating != NULL && libfilter_taffy_cuckoo_find_hash_in_table(
+                                                   here->migrating, hashes[i + j]));
+    }
+  }
+}
+
 // After Stashed result, HT is close to full and should be upsized
 // After ttl, stash the input and return Stashed. Pre-condition: at least one stash is
 // empty. Also, p is a left path, not a right one.
@@ -348,17 +637,7 @@ INLINE bool libfilter_taffy_cuckoo_insert_side_path_ttl(libfilter_taffy_cuckoo*
         // we've run out of room. If there's room in this stash, stash it here. If there
         // is not room in this stash, there must be room in the other, based on the
         // pre-condition for this method.
-        if (both[i]->stash_size == both[i]->stash_capacity) {
-          both[i]->stash_capacity *= 2;
-          // std::cerr << both[i]->stash_capacity << std::endl;
-          libfilter_taffy_cuckoo_path* new_stash = (libfilter_taffy_cuckoo_path*)calloc(
-              both[i]->stash_capacity, sizeof(libfilter_taffy_cuckoo_path));
-          memcpy(new_stash, both[i]->stash,
-                 both[i]->stash_size * sizeof(libfilter_taffy_cuckoo_path));
-          free(both[i]->stash);
-          both[i]->stash = new_stash;
-        }
-        both[i]->stash[both[i]->stash_size++] = p;
+        libfilter_taffy_cuckoo_stash_add(both[i], p);
         ++here->occupied;
         return false;
       }
@@ -384,20 +663,169 @@ INLINE bool libfilter_taffy_cuckoo_insert_side_path(libfilter_taffy_cuckoo* here
 
 void libfilter_taffy_cuckoo_destruct(libfilter_taffy_cuckoo* t);
 
-// Double the size of the filter
+// Double the size of the filter. If here->incremental, this only starts moving the
+// contents of the filter to the new table, after finishing any earlier upsize.
 void libfilter_taffy_cuckoo_upsize(libfilter_taffy_cuckoo* here);
 
-INLINE bool libfilter_taffy_cuckoo_add_hash(libfilter_taffy_cuckoo* here, uint64_t k) {
+// Upsizes until there is room for one more insert, and advances any incremental upsize
+// in progress
+INLINE void libfilter_taffy_cuckoo_make_room(libfilter_taffy_cuckoo* here) {
+  if (here->migrating != NULL) {
+    libfilter_taffy_cuckoo_migrate(here, LIBFILTER_TAFFY_CUCKOO_MIGRATE_BUCKETS);
+  }
   // 95% is achievable, generally,but give it some room
   while (here->occupied > 0.90 * libfilter_taffy_cuckoo_capacity(here) ||
          here->occupied + 4 >= libfilter_taffy_cuckoo_capacity(here) ||
          here->sides[0].stash_size + here->sides[1].stash_size > 8) {
     libfilter_taffy_cuckoo_upsize(here);
   }
+}
+
+INLINE bool libfilter_taffy_cuckoo_add_hash(libfilter_taffy_cuckoo* here, uint64_t k) {
+  libfilter_taffy_cuckoo_make_room(here);
   libfilter_taffy_cuckoo_insert_side_path(
       here, 0, libfilter_taffy_cuckoo_to_path(k, &here->sides[0].f, here->log_side_size));
   return true;
 }
 
+// Adds hashes[i] for each i < n, as libfilter_taffy_cuckoo_add_hash would. Paths in side
+// 0, where inserts start, are computed and prefetched a group ahead as in
+// libfilter_taffy_cuckoo_find_hash_batch. A path computed before an upsize is stale and
+// is computed again.
+INLINE void libfilter_taffy_cuckoo_add_hash_batch(libfilter_taffy_cuckoo* here,
+                                                  const uint64_t* hashes, size_t n) {
+  const size_t w = LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH;
+  libfilter_taffy_cuckoo_path paths[2][2][LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH];
+  int log_side_size[2];
+  if (n > 0) {
+    log_side_size[0] = here->log_side_size;
+    libfilter_taffy_cuckoo_batch_paths(here, 1, hashes, (n < w) ? n : w, paths[0], true);
+  }
+  for (size_t i = 0; i < n; i += w) {
+    const size_t m = (n - i < w) ? (n - i) : w;
+    const int current = (i / w) & 1;
+    if (i + w < n) {
+      const size_t next = (n - i - w < w) ? (n - i - w) : w;
+      log_side_size[1 - current] = here->log_side_size;
+      libfilter_taffy_cuckoo_batch_paths(here, 1, &hashes[i + w], next,
+                                         paths[1 - current], true);
+    }
+    for (size_t j = 0; j < m; ++j) {
+      libfilter_taffy_cuckoo_make_room(here);
+      libfilter_taffy_cuckoo_path p = paths[current][0][j];
+      if (here->log_side_size != log_side_size[current]) {
+        p = libfilter_taffy_cuckoo_to_path(hashes[i + j], &here->sides[0].f,
+                                           here->log_side_size);
+      }
+      libfilter_taffy_cuckoo_insert_side_path(here, 0, p);
+    }
+  }
+}
+
+// Sets permuted[s][j] to the permuted value of hashes[j] in side s of a frozen filter,
+// for each j < n <= 4, and prefetches the buckets they point to.
+INLINE void libfilter_frozen_taffy_cuckoo_batch_permute(
+    const libfilter_frozen_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    uint64_t permuted[2][LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH]) {
+  const int w = here->log_side_size_ + libfilter_taffy_cuckoo_head_size;
+  uint64_t y[LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH] = {0};
+  for (size_t j = 0; j < n; ++j) y[j] = hashes[j] >> (64 - w);
+  for (int s = 0; s < 2; ++s) {
+    libfilter_feistel_permute_forward4(&here->hash_[s], w, y, permuted[s]);
+    for (size_t j = 0; j < n; ++j) {
+      __builtin_prefetch(
+          &here->data_[s][permuted[s][j] >> libfilter_taffy_cuckoo_head_size], 0, 3);
+    }
+  }
+}
+
+// Sets out[i] to libfilter_frozen_taffy_cuckoo_find_hash(here, hashes[i]) for each
+// i < n. As in libfilter_taffy_cuckoo_find_hash_batch, both sides' buckets for the next
+// group of hash values are prefetched while the current group is checked.
+INLINE void libfilter_frozen_taffy_cuckoo_find_hash_batch(
+    const libfilter_frozen_taffy_cuckoo* here, const uint64_t* hashes, size_t n,
+    uint8_t* out) {
+  const size_t w = LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH;
+  uint64_t permuted[2][2][LIBFILTER_TAFFY_CUCKOO_BATCH_WIDTH];
+  if (n > 0) {
+    libfilter_frozen_taffy_cuckoo_batch_permute(here, hashes, (n < w) ? n : w,
+                                                permuted[0]);
+  }
+  for (size_t i = 0; i < n; i += w) {
+    const size_t m = (n - i < w) ? (n - i) : w;
+    const int current = (i / w) & 1;
+    if (i + w < n) {
+      const size_t next = (n - i - w < w) ? (n - i - w) : w;
+      libfilter_frozen_taffy_cuckoo_batch_permute(here, &hashes[i + w], next,
+                                                  permuted[1 - current]);
+    }
+    for (size_t j = 0; j < m; ++j) {
+      const uint64_t p[2] = {permuted[current][0][j], permuted[current][1][j]};
+      uint64_t z[2] = {0, 0};
+      for (int s = 0; s < 2; ++s) {
+        memcpy(&z[s], &here->data_[s][p[s] >> libfilter_taffy_cuckoo_head_size],
+               sizeof(libfilter_frozen_taffy_cuckoo_bucket));
+      }
+      out[i + j] = (0 != libfilter_frozen_taffy_cuckoo_buckets_match(z, p)) |
+                   libfilter_frozen_taffy_cuckoo_stashes_find(here, p);
+    }
+  }
+}
+
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo* x,
                                                     const libfilter_taffy_cuckoo* y);
+
+// Adding all of one filter to another, as union and upsize do, can be split across
+// threads. The library does not start any threads itself; instead, the work is divided
+// into shards, each of which owns a disjoint range of the buckets of each side of the
+// target, and is done in LIBFILTER_TAFFY_CUCKOO_MERGE_PHASES phases. The caller runs
+// libfilter_taffy_cuckoo_merge_step for every shard of one phase, on as many threads as
+// it likes, and waits for all of them before starting the next phase. Paths that would
+// have to evict a slot or move into another shard's range are handed to the shard that
+// owns their bucket on the other side, and those that do not fit there either are
+// inserted by libfilter_taffy_cuckoo_merge_finish, one at a time.
+//
+// To upsize a filter this way, merge it into
+// libfilter_taffy_cuckoo_create(1 + here->log_side_size, here->entropy) and swap the two.
+
+#if defined(LIBFILTER_TAFFY_CUCKOO_MERGE_PHASES)
+#error "An exported feature macro cannot be defined"
+#endif
+
+#define LIBFILTER_TAFFY_CUCKOO_MERGE_PHASES 3
+
+typedef struct {
+  uint64_t* data;
+  size_t size;
+  size_t capacity;
+} libfilter_taffy_cuckoo_path_list;
+
+typedef struct {
+  libfilter_taffy_cuckoo* here;
+  const libfilter_taffy_cuckoo* that;
+  int shards;
+  // gathered[w * shards + v] holds the side-0 paths found by shard w in bucket range v
+  libfilter_taffy_cuckoo_path_list* gathered;
+  // crossing[v * shards + u] holds the side-1 paths that shard v could not place in
+  // side 0 and that belong to shard u
+  libfilter_taffy_cuckoo_path_list* crossing;
+  // leftover[u] holds the side-0 paths that shard u could not place without evicting
+  libfilter_taffy_cuckoo_path_list* leftover;
+  uint64_t* occupied;
+} libfilter_taffy_cuckoo_merge;
+
+// Prepares to add everything in that, including any table it is still migrating from,
+// to here, in the given number of shards. here must be at least as large as that. Any
+// incremental upsize of here is finished first. Returns 0 on success and < 0 if the
+// arguments are invalid or memory could not be allocated.
+int libfilter_taffy_cuckoo_merge_init(libfilter_taffy_cuckoo* here,
+                                      const libfilter_taffy_cuckoo* that, int shards,
+                                      libfilter_taffy_cuckoo_merge* m);
+
+// Does shard's part of the given phase. Calls for different shards of the same phase may
+// run at once.
+void libfilter_taffy_cuckoo_merge_step(libfilter_taffy_cuckoo_merge* m, int phase,
+                                       int shard);
+
+// Inserts the paths no shard could place and frees the memory held by m
+void libfilter_taffy_cuckoo_merge_finish(libfilter_taffy_cuckoo_merge* m);
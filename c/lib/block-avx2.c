@@ -0,0 +1,54 @@
+// This file is compiled with -mavx2 on x86-64, whatever instruction set the rest of the
+// library targets. See block-internal.h.
+
+#include "block-internal.h"
+
+#if defined(__x86_64)
+
+#if !defined(__AVX2__)
+#error "block-avx2.c must be compiled with AVX2 enabled"
+#endif
+
+static void add_hash(uint64_t hash, libfilter_block *here) {
+  libfilter_block_simd_add_hash(hash, here);
+}
+
+static bool find_hash(uint64_t hash, const libfilter_block *here) {
+  return libfilter_block_simd_find_hash(hash, here);
+}
+
+static void find_hash_batch(const uint64_t *hashes, size_t n, uint8_t *out,
+                            const libfilter_block *here) {
+  libfilter_block_simd_find_hash_batch(hashes, n, out, here);
+}
+
+static void add_hash_batch(const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_simd_add_hash_batch(hashes, n, here);
+}
+
+static void union_buckets(uint32_t *dst, const uint32_t *src, uint64_t num_buckets) {
+  __m256i *d = (__m256i *)dst;
+  const __m256i *s = (const __m256i *)src;
+  for (uint64_t i = 0; i < num_buckets; ++i) {
+    _mm256_store_si256(&d[i], _mm256_or_si256(d[i], s[i]));
+  }
+}
+
+static void intersect_buckets(uint32_t *dst, const uint32_t *src, uint64_t num_buckets) {
+  __m256i *d = (__m256i *)dst;
+  const __m256i *s = (const __m256i *)src;
+  for (uint64_t i = 0; i < num_buckets; ++i) {
+    _mm256_store_si256(&d[i], _mm256_and_si256(d[i], s[i]));
+  }
+}
+
+const libfilter_block_kernels libfilter_block_avx2_kernels = {
+    .add_hash = add_hash,
+    .find_hash = find_hash,
+    .find_hash_batch = find_hash_batch,
+    .add_hash_batch = add_hash_batch,
+    .union_buckets = union_buckets,
+    .intersect_buckets = intersect_buckets,
+    .isa = "avx2"};
+
+#endif
@@ -0,0 +1,69 @@
+// This file is compiled with -mavx512f -mavx512vl on x86-64, whatever instruction set the
+// rest of the library targets. See block-internal.h.
+
+#include "block-internal.h"
+
+#if defined(__x86_64)
+
+#if !defined(LIBFILTER_BLOCK_AVX512)
+#error "block-avx512.c must be compiled with AVX-512F and AVX-512VL enabled"
+#endif
+
+static void add_hash(uint64_t hash, libfilter_block *here) {
+  libfilter_block_avx512_add_hash(hash, here);
+}
+
+static bool find_hash(uint64_t hash, const libfilter_block *here) {
+  return libfilter_block_avx512_find_hash(hash, here);
+}
+
+static void find_hash_batch(const uint64_t *hashes, size_t n, uint8_t *out,
+                            const libfilter_block *here) {
+  libfilter_block_avx512_find_hash_batch(hashes, n, out, here);
+}
+
+static void add_hash_batch(const uint64_t *hashes, size_t n, libfilter_block *here) {
+  libfilter_block_avx512_add_hash_batch(hashes, n, here);
+}
+
+// Buckets are only 32-byte aligned, so these use unaligned loads and stores to do two
+// buckets at a time.
+
+static void union_buckets(uint32_t *dst, const uint32_t *src, uint64_t num_buckets) {
+  uint64_t i = 0;
+  for (; i + 1 < num_buckets; i += 2) {
+    const __m512i d = _mm512_loadu_si512(&dst[8 * i]);
+    const __m512i s = _mm512_loadu_si512(&src[8 * i]);
+    _mm512_storeu_si512(&dst[8 * i], _mm512_or_si512(d, s));
+  }
+  if (i < num_buckets) {
+    __m256i *d = (__m256i *)&dst[8 * i];
+    const __m256i *s = (const __m256i *)&src[8 * i];
+    _mm256_store_si256(d, _mm256_or_si256(*d, *s));
+  }
+}
+
+static void intersect_buckets(uint32_t *dst, const uint32_t *src, uint64_t num_buckets) {
+  uint64_t i = 0;
+  for (; i + 1 < num_buckets; i += 2) {
+    const __m512i d = _mm512_loadu_si512(&dst[8 * i]);
+    const __m512i s = _mm512_loadu_si512(&src[8 * i]);
+    _mm512_storeu_si512(&dst[8 * i], _mm512_and_si512(d, s));
+  }
+  if (i < num_buckets) {
+    __m256i *d = (__m256i *)&dst[8 * i];
+    const __m256i *s = (const __m256i *)&src[8 * i];
+    _mm256_store_si256(d, _mm256_and_si256(*d, *s));
+  }
+}
+
+const libfilter_block_kernels libfilter_block_avx512_kernels = {
+    .add_hash = add_hash,
+    .find_hash = find_hash,
+    .find_hash_batch = find_hash_batch,
+    .add_hash_batch = add_hash_batch,
+    .union_buckets = union_buckets,
+    .intersect_buckets = intersect_buckets,
+    .isa = "avx512"};
+
+#endif
@@ -0,0 +1,31 @@
+// Block filter kernels compiled for specific instruction sets, for choosing between at run
+// time. Each of block-avx2.c and block-avx512.c is compiled with the flags for its own
+// instruction set and defines one table; block.c must not call into a table until it has
+// checked that the CPU supports the instructions that table uses.
+
+#pragma once
+
+#include <stdbool.h>  // for bool
+#include <stddef.h>   // for size_t
+#include <stdint.h>   // for uint64_t, uint8_t
+
+#include "filter/block.h"
+
+typedef struct {
+  void (*add_hash)(uint64_t hash, libfilter_block *);
+  bool (*find_hash)(uint64_t hash, const libfilter_block *);
+  void (*find_hash_batch)(const uint64_t *hashes, size_t n, uint8_t *out,
+                          const libfilter_block *);
+  void (*add_hash_batch)(const uint64_t *hashes, size_t n, libfilter_block *);
+  // Sets dst to dst | src or dst & src for each of the 8 * num_buckets words in them
+  void (*union_buckets)(uint32_t *dst, const uint32_t *src, uint64_t num_buckets);
+  void (*intersect_buckets)(uint32_t *dst, const uint32_t *src, uint64_t num_buckets);
+  const char *isa;
+} libfilter_block_kernels;
+
+#if defined(__x86_64)
+extern const libfilter_block_kernels libfilter_block_avx2_kernels
+    __attribute__((visibility("hidden")));
+extern const libfilter_block_kernels libfilter_block_avx512_kernels
+    __attribute__((visibility("hidden")));
+#endif
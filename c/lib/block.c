@@ -1,6 +1,8 @@
 #include "filter/block.h"
 
+#include <stdlib.h>           // for malloc, free
 #include <string.h>           // for memset
+#include "block-internal.h"   // for libfilter_block_kernels
 #include "filter/memory.h"    // for libfilter_region
 #include "memory-internal.h"  // for libfilter_region_alloc_result, libfilte...
 #include "util-internal.h"    // for libfilter_block_bytes_needed_detail
@@ -17,15 +19,50 @@ uint64_t libfilter_block_bytes_needed(double ndv, double fpp) {
   return libfilter_block_bytes_needed_detail(ndv, fpp, 32, 8, 32);
 }
 
-void libfilter_block_serialize(const libfilter_block *from, char *to) {
-  for (uint64_t i = 0; i < from->num_buckets_; ++i) {
-    for (int j = 0; j < 8; ++j) {
-      uint32_t x = from->block_.block[8 * i + j];
-      for (int k = 0; k < 4; ++k) {
-        to[32 * i + 4 * j + k] = x >> (8 * k);
-      }
-    }
+// The serialized form stores each 32-bit word little-endian. On little-endian machines
+// that is the in-memory layout and these are just memcpy; elsewhere the whole-word loops
+// are simple enough for the compiler to turn into vector byte shuffles.
+
+// Copies bytes [offset, offset + len) of the serialized form of the words at from to to.
+static void libfilter_block_words_to_le(const uint32_t *from, uint64_t offset,
+                                        uint64_t len, char *to) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(to, (const char *)from + offset, len);
+#else
+  uint64_t i = offset;
+  const uint64_t end = offset + len;
+  for (; i < end && (i & 3); ++i) to[i - offset] = from[i / 4] >> (8 * (i & 3));
+  for (; i + 4 <= end; i += 4) {
+    const uint32_t x = __builtin_bswap32(from[i / 4]);
+    memcpy(&to[i - offset], &x, sizeof(x));
+  }
+  for (; i < end; ++i) to[i - offset] = from[i / 4] >> (8 * (i & 3));
+#endif
+}
+
+static void libfilter_block_le_to_words(const char *from, uint64_t n, uint32_t *to) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(to, from, 4 * n);
+#else
+  for (uint64_t i = 0; i < n; ++i) {
+    uint32_t x;
+    memcpy(&x, &from[4 * i], sizeof(x));
+    to[i] = __builtin_bswap32(x);
   }
+#endif
+}
+
+void libfilter_block_serialize(const libfilter_block *from, char *to) {
+  libfilter_block_words_to_le(from->block_.block, 0, libfilter_block_size_in_bytes(from),
+                              to);
+}
+
+int libfilter_block_serialize_range(const libfilter_block *from, uint64_t offset,
+                                    uint64_t len, char *to) {
+  const uint64_t size = libfilter_block_size_in_bytes(from);
+  if (offset > size || len > size - offset) return -1;
+  libfilter_block_words_to_le(from->block_.block, offset, len, to);
+  return 0;
 }
 
 // returns < 0 on error
@@ -33,14 +70,9 @@ int libfilter_block_deserialize(uint64_t size_in_bytes, const char* from,
                                 libfilter_block* to) {
   const int result = libfilter_block_init(size_in_bytes, to);
   if (result < 0) return result;
-  for (uint64_t i = 0; i < size_in_bytes / 32; ++i) {
-    for (int j = 0; j < 8; ++j) {
-      uint32_t *x = &to->block_.block[8 * i + j];
-      for (int k = 0; k < 4; ++k) {
-        *x |= ((uint32_t)(unsigned char)from[32 * i + 4 * j + k]) << (8 * k);
-      }
-    }
-  }
+  uint64_t num_buckets = size_in_bytes / 32;
+  if (num_buckets > to->num_buckets_) num_buckets = to->num_buckets_;
+  libfilter_block_le_to_words(from, 8 * num_buckets, to->block_.block);
   return result;
 }
 
@@ -55,18 +87,10 @@ int libfilter_block_deserialize_from_ints(size_t n, const int32_t * from,
 __attribute__((visibility("hidden"))) int libfilter_block_calloc(uint64_t heap_space,
                                                                  uint64_t bucket_bytes,
                                                                  libfilter_block* here) {
-  heap_space = (heap_space > bucket_bytes) ? heap_space : bucket_bytes;
-  const libfilter_region_alloc_result allocated =
-      libfilter_alloc_at_most(heap_space, bucket_bytes);
-  if (0 == allocated.block_bytes) return -1;
-  if (!allocated.zero_filled) memset(allocated.region.block, 0, allocated.block_bytes);
-  here->num_buckets_ = allocated.block_bytes / bucket_bytes;
-  here->block_ = allocated.region;
-  return 0;
+  return libfilter_calloc_region(heap_space, bucket_bytes, &here->num_buckets_,
+                                 &here->block_);
 }
 
-// TODO: intersection, union
-
 __attribute__((visibility("hidden"))) int libfilter_block_free(uint64_t bucket_bytes,
                                                                libfilter_block* here) {
   return libfilter_do_free(here->block_, here->num_buckets_ * bucket_bytes, bucket_bytes);
@@ -99,3 +123,261 @@ bool libfilter_block_equals(const libfilter_block* here, const libfilter_block*
   if (here->num_buckets_ != there->num_buckets_) return false;
   return 0 == memcmp(here->block_.block, there->block_.block, here->num_buckets_ * 32);
 }
+
+// The partitioned insert aims for each partition to cover a slice of the filter about the
+// size of a typical L2 cache, with no more partitions than can be scattered to at once
+// without thrashing the TLB.
+static const uint64_t PARTITION_SLICE_BYTES = 1 << 18;
+enum { PARTITION_MAX_BITS = 10 };
+
+int libfilter_block_add_hash_batch_partitioned(const uint64_t *hashes, size_t n,
+                                               libfilter_block *here) {
+  int bits = 0;
+  while (bits < PARTITION_MAX_BITS &&
+         (here->num_buckets_ * 32 >> bits) > PARTITION_SLICE_BYTES &&
+         (n >> bits) >= LIBFILTER_BLOCK_BATCH_WINDOW) {
+    ++bits;
+  }
+  if (bits == 0) {
+    libfilter_block_add_hash_batch(hashes, n, here);
+    return 0;
+  }
+  uint64_t *scratch = (uint64_t *)malloc(n * sizeof(uint64_t));
+  if (scratch == NULL) return -1;
+  // The bucket index is monotone in the high 32 bits of the hash, so partitioning on the
+  // top bits of those gives each partition a contiguous range of buckets.
+  const int shift = 64 - bits;
+  size_t offsets[(1 << PARTITION_MAX_BITS) + 1] = {0};
+  for (size_t i = 0; i < n; ++i) ++offsets[(hashes[i] >> shift) + 1];
+  for (int i = 0; i < (1 << bits); ++i) offsets[i + 1] += offsets[i];
+  for (size_t i = 0; i < n; ++i) scratch[offsets[hashes[i] >> shift]++] = hashes[i];
+  // Each offsets[i] has now advanced to the start of partition i + 1.
+  size_t begin = 0;
+  for (int i = 0; i < (1 << bits); ++i) {
+    libfilter_block_add_hash_batch(&scratch[begin], offsets[i] - begin, here);
+    begin = offsets[i];
+  }
+  free(scratch);
+  return 0;
+}
+
+// Run-time dispatch. The fallback table is in this file, and so is compiled for the same
+// instruction set as the rest of the library. On x86-64 it is scalar so that it is safe
+// on any CPU. Elsewhere, there is nothing to choose between, so it uses whatever the
+// header chose at compile time.
+#if defined(__x86_64)
+#define LIBFILTER_BLOCK_FALLBACK(op) libfilter_block_scalar_##op
+#define LIBFILTER_BLOCK_FALLBACK_ISA "scalar"
+#else
+#define LIBFILTER_BLOCK_FALLBACK(op) libfilter_block_##op
+#define LIBFILTER_BLOCK_FALLBACK_ISA "native"
+#endif
+
+static void fallback_add_hash(uint64_t hash, libfilter_block *here) {
+  LIBFILTER_BLOCK_FALLBACK(add_hash)(hash, here);
+}
+
+static bool fallback_find_hash(uint64_t hash, const libfilter_block *here) {
+  return LIBFILTER_BLOCK_FALLBACK(find_hash)(hash, here);
+}
+
+static void fallback_find_hash_batch(const uint64_t *hashes, size_t n, uint8_t *out,
+                                     const libfilter_block *here) {
+  LIBFILTER_BLOCK_FALLBACK(find_hash_batch)(hashes, n, out, here);
+}
+
+static void fallback_add_hash_batch(const uint64_t *hashes, size_t n,
+                                    libfilter_block *here) {
+  LIBFILTER_BLOCK_FALLBACK(add_hash_batch)(hashes, n, here);
+}
+
+// These are written so that the compiler can vectorize them for whatever instruction set
+// this file is compiled for.
+
+static void fallback_union_buckets(uint32_t *dst, const uint32_t *src,
+                                   uint64_t num_buckets) {
+  for (uint64_t i = 0; i < 8 * num_buckets; ++i) dst[i] |= src[i];
+}
+
+static void fallback_intersect_buckets(uint32_t *dst, const uint32_t *src,
+                                       uint64_t num_buckets) {
+  for (uint64_t i = 0; i < 8 * num_buckets; ++i) dst[i] &= src[i];
+}
+
+static const libfilter_block_kernels fallback_kernels = {
+    .add_hash = fallback_add_hash,
+    .find_hash = fallback_find_hash,
+    .find_hash_batch = fallback_find_hash_batch,
+    .add_hash_batch = fallback_add_hash_batch,
+    .union_buckets = fallback_union_buckets,
+    .intersect_buckets = fallback_intersect_buckets,
+    .isa = LIBFILTER_BLOCK_FALLBACK_ISA};
+
+#undef LIBFILTER_BLOCK_FALLBACK_ISA
+#undef LIBFILTER_BLOCK_FALLBACK
+
+static const libfilter_block_kernels *libfilter_block_choose_kernels(void) {
+#if defined(__x86_64)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) {
+    return &libfilter_block_avx512_kernels;
+  }
+  if (__builtin_cpu_supports("avx2")) return &libfilter_block_avx2_kernels;
+#endif
+  return &fallback_kernels;
+}
+
+// NULL until the first call to a _runtime function. Racing threads all choose the same
+// table, so no ordering is needed beyond atomicity.
+static const libfilter_block_kernels *chosen_kernels = NULL;
+
+static const libfilter_block_kernels *libfilter_block_kernels_get(void) {
+  const libfilter_block_kernels *result =
+      __atomic_load_n(&chosen_kernels, __ATOMIC_RELAXED);
+  if (__builtin_expect(result == NULL, 0)) {
+    result = libfilter_block_choose_kernels();
+    __atomic_store_n(&chosen_kernels, result, __ATOMIC_RELAXED);
+  }
+  return result;
+}
+
+void libfilter_block_runtime_add_hash(uint64_t hash, libfilter_block *here) {
+  libfilter_block_kernels_get()->add_hash(hash, here);
+}
+
+bool libfilter_block_runtime_find_hash(uint64_t hash, const libfilter_block *here) {
+  return libfilter_block_kernels_get()->find_hash(hash, here);
+}
+
+void libfilter_block_runtime_find_hash_batch(const uint64_t *hashes, size_t n,
+                                             uint8_t *out, const libfilter_block *here) {
+  libfilter_block_kernels_get()->find_hash_batch(hashes, n, out, here);
+}
+
+void libfilter_block_runtime_add_hash_batch(const uint64_t *hashes, size_t n,
+                                            libfilter_block *here) {
+  libfilter_block_kernels_get()->add_hash_batch(hashes, n, here);
+}
+
+const char *libfilter_block_runtime_isa(void) {
+  return libfilter_block_kernels_get()->isa;
+}
+
+int libfilter_block_union_range(libfilter_block *dst, const libfilter_block *src,
+                                uint64_t begin, uint64_t end) {
+  if (dst->num_buckets_ != src->num_buckets_) return -1;
+  if (begin > end || end > dst->num_buckets_) return -1;
+  libfilter_block_kernels_get()->union_buckets(&dst->block_.block[8 * begin],
+                                               &src->block_.block[8 * begin],
+                                               end - begin);
+  return 0;
+}
+
+int libfilter_block_intersect_range(libfilter_block *dst, const libfilter_block *src,
+                                    uint64_t begin, uint64_t end) {
+  if (dst->num_buckets_ != src->num_buckets_) return -1;
+  if (begin > end || end > dst->num_buckets_) return -1;
+  libfilter_block_kernels_get()->intersect_buckets(&dst->block_.block[8 * begin],
+                                                   &src->block_.block[8 * begin],
+                                                   end - begin);
+  return 0;
+}
+
+int libfilter_block_union(libfilter_block *dst, const libfilter_block *src) {
+  return libfilter_block_union_range(dst, src, 0, dst->num_buckets_);
+}
+
+int libfilter_block_intersect(libfilter_block *dst, const libfilter_block *src) {
+  return libfilter_block_intersect_range(dst, src, 0, dst->num_buckets_);
+}
+
+// The header of the view format. All of the fields are in the byte order of the machine
+// that wrote them, as are the buckets.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // Always LIBFILTER_BLOCK_VIEW_BYTE_ORDER when read by a machine of the same byte order
+  uint32_t byte_order;
+  // 1 for the split block scheme in block.h: 8 32-bit words per bucket, one bit set in
+  // each, at positions given by the seeds in LIBFILTER_INTERNAL_HASH_SEEDS
+  uint32_t hash_scheme;
+  uint32_t bucket_bytes;
+  uint64_t num_buckets;
+  char padding[32];
+} libfilter_block_view_header;
+
+_Static_assert(sizeof(libfilter_block_view_header) == 64,
+               "the header must keep the buckets after it aligned");
+
+static const char LIBFILTER_BLOCK_VIEW_MAGIC[8] = "libfblk";
+static const uint32_t LIBFILTER_BLOCK_VIEW_VERSION = 1;
+static const uint32_t LIBFILTER_BLOCK_VIEW_BYTE_ORDER = 0x01020304;
+static const uint32_t LIBFILTER_BLOCK_VIEW_HASH_SCHEME = 1;
+
+uint64_t libfilter_block_view_bytes(const libfilter_block *here) {
+  return sizeof(libfilter_block_view_header) + libfilter_block_size_in_bytes(here);
+}
+
+void libfilter_block_serialize_view(const libfilter_block *here, char *to) {
+  libfilter_block_view_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LIBFILTER_BLOCK_VIEW_MAGIC, sizeof(header.magic));
+  header.version = LIBFILTER_BLOCK_VIEW_VERSION;
+  header.byte_order = LIBFILTER_BLOCK_VIEW_BYTE_ORDER;
+  header.hash_scheme = LIBFILTER_BLOCK_VIEW_HASH_SCHEME;
+  header.bucket_bytes = 32;
+  header.num_buckets = here->num_buckets_;
+  memcpy(to, &header, sizeof(header));
+  memcpy(to + sizeof(header), here->block_.block, libfilter_block_size_in_bytes(here));
+}
+
+int libfilter_block_view_init(const void *from, uint64_t bytes,
+                              libfilter_block_view *here) {
+  // Leave here safe to destruct even if the image is rejected
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  libfilter_block_zero_out(&here->filter);
+  libfilter_block_view_header header;
+  if (bytes < sizeof(header)) return -1;
+  if (0 != ((uintptr_t)from & 31)) return -1;
+  memcpy(&header, from, sizeof(header));
+  if (0 != memcmp(header.magic, LIBFILTER_BLOCK_VIEW_MAGIC, sizeof(header.magic))) {
+    return -1;
+  }
+  if (header.version != LIBFILTER_BLOCK_VIEW_VERSION) return -1;
+  if (header.byte_order != LIBFILTER_BLOCK_VIEW_BYTE_ORDER) return -1;
+  if (header.hash_scheme != LIBFILTER_BLOCK_VIEW_HASH_SCHEME) return -1;
+  if (header.bucket_bytes != 32) return -1;
+  // libfilter_block_index only handles 32-bit bucket counts
+  if (header.num_buckets == 0 || header.num_buckets > UINT32_MAX) return -1;
+  if (bytes - sizeof(header) != header.num_buckets * 32) return -1;
+  here->filter.num_buckets_ = header.num_buckets;
+  here->filter.block_.block = (uint32_t *)((const char *)from + sizeof(header));
+  here->filter.block_.to_free = NULL;
+  return 0;
+}
+
+int libfilter_block_view_map(const char *path, libfilter_block_view *here) {
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  libfilter_block_zero_out(&here->filter);
+  void *mapping;
+  uint64_t bytes;
+  if (0 != libfilter_map_file(path, &mapping, &bytes)) return -1;
+  const int result = libfilter_block_view_init(mapping, bytes, here);
+  if (result < 0) {
+    libfilter_unmap_file(mapping, bytes);
+    return result;
+  }
+  here->mapping = mapping;
+  here->mapping_bytes = bytes;
+  return 0;
+}
+
+int libfilter_block_view_destruct(libfilter_block_view *here) {
+  libfilter_block_zero_out(&here->filter);
+  const int result = libfilter_unmap_file(here->mapping, here->mapping_bytes);
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  return result;
+}
@@ -0,0 +1,53 @@
+#include "filter/counting-block.h"
+
+#include "filter/memory.h"    // for libfilter_region
+#include "memory-internal.h"  // for libfilter_calloc_region, libfilter_do_free
+#include "util-internal.h"    // for libfilter_block_bytes_needed_detail
+
+// 8 words of 32 4-bit counters each
+static const uint64_t BUCKET_BYTES = 8 * 32 * 4 / CHAR_BIT;
+
+// A counting filter has the false positive probability of a block filter with the same
+// number of buckets, and so a quarter of the size.
+
+double libfilter_counting_block_fpp(double ndv, double bytes) {
+  return libfilter_block_fpp_detail(ndv, bytes / 4, 32, 8, 32);
+}
+
+uint64_t libfilter_counting_block_capacity(uint64_t bytes, double fpp) {
+  return libfilter_block_capacity_detail(bytes / 4, fpp, 32, 8, 32);
+}
+
+uint64_t libfilter_counting_block_bytes_needed(double ndv, double fpp) {
+  return 4 * libfilter_block_bytes_needed_detail(ndv, fpp, 32, 8, 32);
+}
+
+int libfilter_counting_block_init(uint64_t heap_space, libfilter_counting_block *here) {
+  return libfilter_calloc_region(heap_space, BUCKET_BYTES, &here->num_buckets_,
+                                 &here->block_);
+}
+
+int libfilter_counting_block_destruct(libfilter_counting_block *here) {
+  return libfilter_do_free(here->block_, here->num_buckets_ * BUCKET_BYTES, BUCKET_BYTES);
+}
+
+void libfilter_counting_block_zero_out(libfilter_counting_block *here) {
+  here->num_buckets_ = 0;
+  libfilter_clear_region(&here->block_);
+}
+
+int libfilter_counting_block_clone(const libfilter_counting_block *here,
+                                   libfilter_counting_block *to) {
+  if (0 != libfilter_clone_region(here->block_, here->num_buckets_ * BUCKET_BYTES,
+                                  BUCKET_BYTES, &to->block_)) {
+    return -1;
+  }
+  to->num_buckets_ = here->num_buckets_;
+  return 0;
+}
+
+bool libfilter_counting_block_equals(const libfilter_counting_block *here,
+                                     const libfilter_counting_block *there) {
+  return libfilter_equal_regions(here->block_, here->num_buckets_ * BUCKET_BYTES,
+                                 there->block_, there->num_buckets_ * BUCKET_BYTES);
+}
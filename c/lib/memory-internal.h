@@ -39,7 +39,53 @@ libfilter_do_free(libfilter_region r, uint64_t bytes, uint64_t alignment);
 void __attribute__((visibility("hidden")))
 libfilter_clear_region(libfilter_region* here);
 
+// Sets *region to a new zero-filled region aligned to bucket_bytes, of at least
+// bucket_bytes bytes and at most heap_space, and *num_buckets to the number of buckets
+// in it. Returns 0 on success and < 0 on allocation failure, leaving both unchanged.
+int __attribute__((visibility("hidden")))
+libfilter_calloc_region(uint64_t heap_space, uint64_t bucket_bytes, uint64_t* num_buckets,
+                        libfilter_region* region);
+
+// Sets *to to a new region, aligned to alignment, holding a copy of the first bytes bytes
+// of from. Returns 0 on success and < 0 on allocation failure, leaving *to unchanged.
+int __attribute__((visibility("hidden")))
+libfilter_clone_region(libfilter_region from, uint64_t bytes, uint64_t alignment,
+                       libfilter_region* to);
+
+// Returns true if the regions are the same size and hold the same bytes
+bool __attribute__((visibility("hidden")))
+libfilter_equal_regions(libfilter_region x, uint64_t x_bytes, libfilter_region y,
+                        uint64_t y_bytes);
+
 // How many bytes should be requested to guarantee at least exact_bytes of space is
 // available
 uint64_t __attribute__((visibility("hidden")))
 libfilter_new_alloc_request(uint64_t exact_bytes, uint64_t alignment);
+
+// Maps the whole file at path into memory, read-only, for filter lookups. Returns 0 on
+// success and < 0 on error.
+int __attribute__((visibility("hidden")))
+libfilter_map_file(const char* path, void** mapping, uint64_t* bytes);
+
+// Unmaps a mapping made by libfilter_map_file. Does nothing if mapping is NULL.
+int __attribute__((visibility("hidden")))
+libfilter_unmap_file(void* mapping, uint64_t bytes);
+
+// Reserving address space up front lets a structure that grows on a fixed schedule, like
+// a taffy block filter, skip allocating and zeroing each time it grows.
+
+uint64_t __attribute__((visibility("hidden"))) libfilter_page_size(void);
+
+// Reserves bytes of address space, page aligned and with no memory behind it yet. Returns
+// NULL on failure or if this platform does not support reservations.
+__attribute__((visibility("hidden"))) void* libfilter_reserve(uint64_t bytes);
+
+// Makes the pages in [at, at + bytes) of a reservation readable and writable. at must be
+// page aligned. Each page is zero-filled and backed by memory when it is first touched,
+// using transparent huge pages where available.
+// Returns 0 on success and < 0 on error.
+int __attribute__((visibility("hidden"))) libfilter_commit(void* at, uint64_t bytes);
+
+// Releases a reservation made by libfilter_reserve. Does nothing if reservation is NULL.
+int __attribute__((visibility("hidden")))
+libfilter_release(void* reservation, uint64_t bytes);
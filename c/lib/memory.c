@@ -2,10 +2,18 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>  // for memcpy, memcmp, memset
 
 #include "filter/memory.h"
 #include "memory-internal.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>     // for open
+#include <sys/mman.h>  // for mmap
+#include <sys/stat.h>  // for fstat
+#include <unistd.h>    // for close
+#endif
+
 // TODO: try _mm_malloc, __mingw_aligned_malloc, _aligned_malloc
 
 // When C11 is available, aligned_alloc can be used
@@ -112,11 +120,18 @@ libfilter_do_mmap_alloc(uint64_t exact_bytes) {
   // printf("mmap 0x%016zx\n", exact_bytes);
   result.region.block = mmap(NULL, exact_bytes, PROT_READ | PROT_WRITE,
                              MAP_PRIVATE | MAP_HUGETLB | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == result.region.block) {
+    // No huge pages are available, but exact_bytes must still be mmapped, since
+    // libfilter_do_free decides whether to munmap from the size alone.
+    result.region.block = mmap(NULL, exact_bytes, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
   if (MAP_FAILED == result.region.block) {
     result.region.block = NULL;
     result.block_bytes = 0;
+  } else {
+    result.block_bytes = exact_bytes;
   }
-  result.block_bytes = exact_bytes;
   result.region.to_free = result.region.block;
   return result;
 }
@@ -195,3 +210,121 @@ libfilter_clear_region(libfilter_region* here) {
   here->block = NULL;
   here->to_free = NULL;
 }
+
+int __attribute__((visibility("hidden")))
+libfilter_calloc_region(uint64_t heap_space, uint64_t bucket_bytes, uint64_t* num_buckets,
+                        libfilter_region* region) {
+  heap_space = (heap_space > bucket_bytes) ? heap_space : bucket_bytes;
+  const libfilter_region_alloc_result allocated =
+      libfilter_alloc_at_most(heap_space, bucket_bytes);
+  if (0 == allocated.block_bytes) return -1;
+  if (!allocated.zero_filled) memset(allocated.region.block, 0, allocated.block_bytes);
+  *num_buckets = allocated.block_bytes / bucket_bytes;
+  *region = allocated.region;
+  return 0;
+}
+
+int __attribute__((visibility("hidden")))
+libfilter_clone_region(libfilter_region from, uint64_t bytes, uint64_t alignment,
+                       libfilter_region* to) {
+  const uint64_t request = libfilter_new_alloc_request(bytes, alignment);
+  const libfilter_region_alloc_result r = libfilter_alloc_at_most(request, alignment);
+  if (r.block_bytes < bytes) {
+    libfilter_do_free(r.region, r.block_bytes, alignment);
+    return -1;
+  }
+  memcpy(r.region.block, from.block, bytes);
+  *to = r.region;
+  return 0;
+}
+
+bool __attribute__((visibility("hidden")))
+libfilter_equal_regions(libfilter_region x, uint64_t x_bytes, libfilter_region y,
+                        uint64_t y_bytes) {
+  return x_bytes == y_bytes && 0 == memcmp(x.block, y.block, x_bytes);
+}
+
+int __attribute__((visibility("hidden")))
+libfilter_map_file(const char* path, void** mapping, uint64_t* bytes) {
+#if defined(__unix__) || defined(__APPLE__)
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (0 != fstat(fd, &st) || st.st_size <= 0) {
+    close(fd);
+    return -1;
+  }
+  *bytes = st.st_size;
+  *mapping = mmap(NULL, *bytes, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping keeps the file open.
+  close(fd);
+  if (MAP_FAILED == *mapping) return -1;
+#if defined(MADV_RANDOM)
+  // Filter probes are uniformly random, so reading ahead only wastes I/O.
+  madvise(*mapping, *bytes, MADV_RANDOM);
+#endif
+  return 0;
+#else
+  (void)path;
+  (void)mapping;
+  (void)bytes;
+  return -1;
+#endif
+}
+
+int __attribute__((visibility("hidden")))
+libfilter_unmap_file(void* mapping, uint64_t bytes) {
+  if (mapping == NULL) return 0;
+#if defined(__unix__) || defined(__APPLE__)
+  return munmap(mapping, bytes);
+#else
+  (void)bytes;
+  return -1;
+#endif
+}
+
+uint64_t __attribute__((visibility("hidden"))) libfilter_page_size(void) {
+#if defined(__unix__) || defined(__APPLE__)
+  return sysconf(_SC_PAGESIZE);
+#else
+  return 4096;
+#endif
+}
+
+__attribute__((visibility("hidden"))) void* libfilter_reserve(uint64_t bytes) {
+#if defined(__unix__) || defined(__APPLE__)
+  // PROT_NONE pages are not charged against the commit limit until they are made
+  // writable.
+  void* result = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (MAP_FAILED == result) ? NULL : result;
+#else
+  (void)bytes;
+  return NULL;
+#endif
+}
+
+int __attribute__((visibility("hidden"))) libfilter_commit(void* at, uint64_t bytes) {
+#if defined(__unix__) || defined(__APPLE__)
+  if (0 != mprotect(at, bytes, PROT_READ | PROT_WRITE)) return -1;
+#if defined(MADV_HUGEPAGE)
+  // Faulting in huge pages takes 512 times fewer faults than faulting in small ones.
+  madvise(at, bytes, MADV_HUGEPAGE);
+#endif
+  return 0;
+#else
+  (void)at;
+  (void)bytes;
+  return -1;
+#endif
+}
+
+int __attribute__((visibility("hidden")))
+libfilter_release(void* reservation, uint64_t bytes) {
+  if (reservation == NULL) return 0;
+#if defined(__unix__) || defined(__APPLE__)
+  return munmap(reservation, bytes);
+#else
+  (void)bytes;
+  return -1;
+#endif
+}
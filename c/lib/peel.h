@@ -15,14 +15,38 @@
 void libfilter_init_edges(size_t n, size_t m, const uint64_t* hashes /* [n] */,
                           libfilter_edge* result /* [n] */) {
   if (NULL == result) return;
-  for (size_t i = 0; i < n; ++i) libfilter_make_edge(hashes[i], m, &result[i]);
+  const uint64_t window = libfilter_edge_window(m);
+  for (size_t i = 0; i < n; ++i) {
+    libfilter_make_edge_in_window(hashes[i], m, window, &result[i]);
+  }
 }
 
-// structure temporarily used for peeling a hypergraph
-typedef struct {
-  size_t count_;   // number of hyperedges incident to this node
-  uint64_t edges_; // xor of the remaining hyperedges incident to this node
-} libfilter_peel_node;
+// Edges whose windows start near each other touch nodes near each other. When the m
+// nodes are split into segments of window nodes each, this is the segment the window of
+// the edge of hash starts in.
+static inline size_t libfilter_edge_segment(uint64_t hash, size_t m, uint64_t window) {
+  return libfilter_edge_start(hash, m, window) / window;
+}
+
+// Adds the number of hashes[0, n) whose edges start in each segment to counts
+void libfilter_count_edge_segments(size_t n, size_t m, const uint64_t* hashes /* [n] */,
+                                   size_t* counts /* [number of segments] */) {
+  const uint64_t window = libfilter_edge_window(m);
+  for (size_t i = 0; i < n; ++i) ++counts[libfilter_edge_segment(hashes[i], m, window)];
+}
+
+// Makes the edges of hashes[0, n) with nodes less than m, sorted by segment: the edge of
+// each hash in segment s goes to result[offsets[s]], and offsets[s] is incremented. Within
+// a segment, edges stay in the order of hashes.
+void libfilter_init_edges_partitioned(size_t n, size_t m, const uint64_t* hashes /* [n] */,
+                                      size_t* offsets /* [number of segments] */,
+                                      libfilter_edge* result) {
+  const uint64_t window = libfilter_edge_window(m);
+  for (size_t i = 0; i < n; ++i) {
+    size_t* offset = &offsets[libfilter_edge_segment(hashes[i], m, window)];
+    libfilter_make_edge_in_window(hashes[i], m, window, &result[(*offset)++]);
+  }
+}
 
 // // Allocate and zero-initialize libfilter_peel_node array of size m
 // libfilter_peel_node* libfilter_init_peel_nodes(size_t m) {
@@ -30,23 +54,30 @@ typedef struct {
 //   return result;
 // }
 
-// take n edges and initialize nodes
-void libfilter_populate_peel_nodes(size_t num_edges, const libfilter_edge* edges,
-                                   libfilter_peel_node* nodes) {
-  for (size_t i = 0; i < num_edges; ++i) {
+// take edges [begin, end) and add them to nodes. If concurrent, other threads may be
+// adding other edges to the same nodes at the same time.
+void libfilter_populate_peel_nodes_range(size_t begin, size_t end,
+                                         const libfilter_edge* edges,
+                                         libfilter_peel_node* nodes, bool concurrent) {
+  for (size_t i = begin; i < end; ++i) {
     for(int j = 0; j < LIBFILTER_EDGE_ARITY; ++j) {
       libfilter_peel_node * node = &nodes[edges[i].vertex_[j]];
-      node->count_++;
-      node->edges_ = node->edges_ ^ i;
+      if (concurrent) {
+        __atomic_fetch_add(&node->count_, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_xor(&node->edges_, i, __ATOMIC_RELAXED);
+      } else {
+        node->count_++;
+        node->edges_ = node->edges_ ^ i;
+      }
     }
   }
 }
 
-// strcture temporarily used for tracking the order of peeling
-typedef struct {
-  size_t edge_number_;
-  size_t peeled_vertex_; // the vertex this edge was peeled at
-} libfilter_edge_peel;
+// take n edges and initialize nodes
+void libfilter_populate_peel_nodes(size_t num_edges, const libfilter_edge* edges,
+                                   libfilter_peel_node* nodes) {
+  libfilter_populate_peel_nodes_range(0, num_edges, edges, nodes, false);
+}
 
 // peel vetex_number, given edges and nodes.
 // returns number of new peelable vertexes uncovered. Always strictly less than
@@ -70,8 +101,8 @@ size_t libfilter_peel_once(uint64_t vertex_number, const libfilter_edge* edges,
   return result;
 }
 
-// returns number of nodes peeled
-// TODO: multi-threading and SIMD
+// returns number of nodes peeled. This peels one vertex at a time. libfilter_static_builder
+// peels in rounds instead, so that it can use threads; see libfilter_peel_claim.
 size_t libfilter_peel(size_t num_nodes, const libfilter_edge* edges,
                       libfilter_peel_node* nodes, libfilter_edge_peel* to_peel) {
   uint64_t begin_stack = 0, end_stack = 0, to_see = 0;
@@ -105,6 +136,87 @@ size_t libfilter_peel(size_t num_nodes, const libfilter_edge* edges,
   return begin_stack;
 }
 
+// Peeling in rounds, as libfilter_static_builder does so that each round can be split
+// across threads. The frontier of a round is the vertices with exactly one edge left. Each
+// of them peels its edge, unless a smaller vertex in the frontier has the same edge. So
+// every edge peeled in a round is peeled at the smallest vertex it has that is in the
+// frontier, no matter how the frontier is split up or ordered, and no vertex that one of
+// them is peeled at is in another.
+
+static inline void libfilter_vertex_list_push(libfilter_vertex_list* here, uint64_t v) {
+  if (here->size_ == here->capacity_) {
+    here->capacity_ = (here->capacity_ < 16) ? 16 : 2 * here->capacity_;
+    here->data_ = (uint64_t*)realloc(here->data_, here->capacity_ * sizeof(uint64_t));
+  }
+  here->data_[here->size_++] = v;
+}
+
+// Keeps the vertices in frontier that peel their edge this round, in order, and returns
+// how many there are. The rest either have no edges left or lose their edge to a smaller
+// vertex. nodes is only read, so this can run on parts of a frontier at the same time.
+size_t libfilter_peel_claim(size_t n, uint64_t* frontier, const libfilter_edge* edges,
+                            const libfilter_peel_node* nodes) {
+  size_t result = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t v = frontier[i];
+    if (nodes[v].count_ != 1) continue;
+    const libfilter_edge* e = &edges[nodes[v].edges_];
+    bool wins = true;
+    for (int j = 0; j < LIBFILTER_EDGE_ARITY; ++j) {
+      const size_t u = e->vertex_[j];
+      wins = wins && !(u < v && nodes[u].count_ == 1);
+    }
+    frontier[result] = v;
+    result += wins;
+  }
+  return result;
+}
+
+// Peels the edge of each of the n vertices in winners, as kept by libfilter_peel_claim,
+// recording the peels in to_peel[0, n), and adds the vertices this leaves with one edge
+// to next. If concurrent, other threads may be peeling other winners of the same round
+// at the same time.
+void libfilter_peel_winners(size_t n, const uint64_t* winners, const libfilter_edge* edges,
+                            libfilter_peel_node* nodes, libfilter_edge_peel* to_peel,
+                            libfilter_vertex_list* next, bool concurrent) {
+  for (size_t i = 0; i < n; ++i) {
+    const uint64_t v = winners[i];
+    // Only v's own edge has v in it, and only v removes that edge, so this is stable
+    const uint64_t edge_number = nodes[v].edges_;
+    to_peel[i].edge_number_ = edge_number;
+    to_peel[i].peeled_vertex_ = v;
+    for (int j = 0; j < LIBFILTER_EDGE_ARITY; ++j) {
+      const size_t vertex = edges[edge_number].vertex_[j];
+      size_t count;
+      if (concurrent) {
+        __atomic_fetch_xor(&nodes[vertex].edges_, edge_number, __ATOMIC_RELAXED);
+        count = __atomic_sub_fetch(&nodes[vertex].count_, 1, __ATOMIC_RELAXED);
+      } else {
+        nodes[vertex].edges_ ^= edge_number;
+        count = --nodes[vertex].count_;
+      }
+      // A count reaches one at most once, so no vertex is added twice
+      if (count == 1 && vertex != v) libfilter_vertex_list_push(next, vertex);
+    }
+  }
+}
+
+// Sets the fingerprints for the peels in peel_order[begin, end), which must all be from
+// the same round. Their peeled vertices are in none of their edges but their own, so they
+// can be set in any order, or at the same time, once every later round has been set.
+void libfilter_unpeel_range(size_t begin, size_t end, const libfilter_edge* edges,
+                            const libfilter_edge_peel* peel_order, uint8_t* xors) {
+  for (size_t i = begin; i < end; ++i) {
+    const libfilter_edge* e = &edges[peel_order[i].edge_number_];
+    uint8_t xor_remainder = e->fingerprint_;
+    assert(0 == xors[peel_order[i].peeled_vertex_]);
+    for (int k = 0; k < LIBFILTER_EDGE_ARITY; ++k) {
+      xor_remainder ^= xors[e->vertex_[k]];
+    }
+    xors[peel_order[i].peeled_vertex_] = xor_remainder;
+  }
+}
+
 void libfilter_unpeel(size_t node_count, const libfilter_edge* edges,
                       const libfilter_edge_peel* peel_order, uint8_t* xors) {
   for (size_t i = 0; i < node_count; ++i) {
@@ -8,77 +8,302 @@
 #include "memory-internal.h"
 #include "peel.h"
 
-// Free result with libfilter_do_free(result.region_, result.length_, sizeof(void*));
-libfilter_static libfilter_static_construct(size_t n, const uint64_t* hashes) {
-  size_t size = ((n < 10) ? 2.0 : (0.75 + 1.0 / log(log(n)))) * n;
-  size = (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
- retry:;
-   // initialize the fingerprints
-   size_t alloc_size = libfilter_new_alloc_request(size, sizeof(void*));
-   libfilter_region_alloc_result region_result =
-       libfilter_alloc_at_most(alloc_size, sizeof(void*));
-   assert(region_result.block_bytes >= size);
-   size = region_result.block_bytes;
-   if (!region_result.zero_filled) {
-     memset(region_result.region.block, 0, size);
-   }
-   libfilter_static result;
-   result.region_ = region_result.region;
-   result.length_ = size;
-
-   // initialize the edges
-   libfilter_region_alloc_result edge_region_result = libfilter_alloc_at_most(
-       libfilter_new_alloc_request(n * sizeof(libfilter_edge), alignof(libfilter_edge)),
-       alignof(libfilter_edge));
-   libfilter_edge* edges = (libfilter_edge*)edge_region_result.region.block;
-   libfilter_init_edges(n, size, hashes, edges);
-
-   // initialize the nodes
-   libfilter_region_alloc_result nodes_region_result = libfilter_alloc_at_most(
-       libfilter_new_alloc_request(size * sizeof(libfilter_peel_node),
-                                   alignof(libfilter_peel_node)),
-       alignof(libfilter_peel_node));
-   assert(nodes_region_result.block_bytes == size * sizeof(libfilter_peel_node));
-   if (!nodes_region_result.zero_filled) {
-     memset(nodes_region_result.region.block, 0, size * sizeof(libfilter_peel_node));
-   }
-   libfilter_peel_node* nodes = (libfilter_peel_node*)(nodes_region_result.region.block);
-   libfilter_populate_peel_nodes(n, edges, nodes);
-
-   // initialize the peel results
-   libfilter_region_alloc_result peel_results_region_result = libfilter_alloc_at_most(
-       libfilter_new_alloc_request(size * sizeof(libfilter_edge_peel),
-                                   alignof(libfilter_edge_peel)),
-       alignof(libfilter_edge_peel));
-   libfilter_edge_peel* peel_result =
-       (libfilter_edge_peel*)peel_results_region_result.region.block;
-
-   // Do the peeling
-   size_t answer = libfilter_peel(size, edges, nodes, peel_result);
-   libfilter_do_free(nodes_region_result.region, size * sizeof(libfilter_peel_node),
-                     alignof(libfilter_peel_node));
-   if (answer < size) { // if peeling failed to peel all the way (found a 2-core)
-     // printf("%zu\t", size - answer);
-     size *= 1.01;
-     size += 1;
-     size = (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
-     // printf("%zu\n", size);
-     libfilter_do_free(peel_results_region_result.region,
-                       size * sizeof(libfilter_edge_peel), alignof(libfilter_edge_peel));
-     libfilter_do_free(edge_region_result.region, n * sizeof(libfilter_edge),
-                       alignof(libfilter_edge));
-     libfilter_do_free(result.region_, result.length_, sizeof(void*));
-     goto retry;
+enum {
+  LIBFILTER_STATIC_ALLOCATE,  // before each attempt, not a phase any shard runs
+  LIBFILTER_STATIC_COUNT,     // count the edges in each segment, if partitioned
+  LIBFILTER_STATIC_INIT,      // make the edges and zero the nodes and fingerprints
+  LIBFILTER_STATIC_POPULATE,  // add the edges to the nodes
+  LIBFILTER_STATIC_SCAN,      // find the first frontier
+  LIBFILTER_STATIC_CLAIM,     // pick the vertices that peel in this round
+  LIBFILTER_STATIC_PEEL,      // peel them and find the next frontier
+  LIBFILTER_STATIC_UNPEEL,    // set the fingerprints of one round, last round first
+  LIBFILTER_STATIC_DONE
+};
+
+// The start of shard's part of n items
+static size_t libfilter_static_slice(size_t n, int shards, int shard) {
+  return (size_t)((unsigned __int128)n * shard / shards);
+}
+
+static void libfilter_static_builder_allocate(libfilter_static_builder* here) {
+  size_t size = here->result_.length_;
+  // initialize the fingerprints
+  size_t alloc_size = libfilter_new_alloc_request(size, sizeof(void*));
+  libfilter_region_alloc_result region_result =
+      libfilter_alloc_at_most(alloc_size, sizeof(void*));
+  assert(region_result.block_bytes >= size);
+  size = region_result.block_bytes;
+  here->result_.region_ = region_result.region;
+  here->result_.length_ = size;
+  here->result_zero_filled_ = region_result.zero_filled;
+
+  // initialize the edges
+  here->edges_region_ =
+      libfilter_alloc_at_most(
+          libfilter_new_alloc_request(here->n_ * sizeof(libfilter_edge),
+                                      alignof(libfilter_edge)),
+          alignof(libfilter_edge))
+          .region;
+  here->edges_ = (libfilter_edge*)here->edges_region_.block;
+
+  // initialize the nodes
+  libfilter_region_alloc_result nodes_region_result = libfilter_alloc_at_most(
+      libfilter_new_alloc_request(size * sizeof(libfilter_peel_node),
+                                  alignof(libfilter_peel_node)),
+      alignof(libfilter_peel_node));
+  assert(nodes_region_result.block_bytes == size * sizeof(libfilter_peel_node));
+  here->nodes_region_ = nodes_region_result.region;
+  here->nodes_zero_filled_ = nodes_region_result.zero_filled;
+  here->nodes_ = (libfilter_peel_node*)here->nodes_region_.block;
+
+  // initialize the peel results, one per edge
+  here->peels_region_ =
+      libfilter_alloc_at_most(
+          libfilter_new_alloc_request(here->n_ * sizeof(libfilter_edge_peel),
+                                      alignof(libfilter_edge_peel)),
+          alignof(libfilter_edge_peel))
+          .region;
+  here->peels_ = (libfilter_edge_peel*)here->peels_region_.block;
+  here->peeled_ = 0;
+  here->rounds_.size_ = 0;
+
+  if (here->partitioned_) {
+    const uint64_t window = libfilter_edge_window(size);
+    here->segments_ = (window == 0) ? 1 : (size - 1) / window + 1;
+    here->segment_offsets_ =
+        (size_t*)calloc(here->shards_ * here->segments_, sizeof(size_t));
   }
-  // printf("%f\n", 1.0 * size / n);
+}
+
+static void libfilter_static_builder_free_nodes(libfilter_static_builder* here) {
+  libfilter_do_free(here->nodes_region_,
+                    here->result_.length_ * sizeof(libfilter_peel_node),
+                    alignof(libfilter_peel_node));
+  here->nodes_ = NULL;
+}
 
-  // populate the fingerprints
-  libfilter_unpeel(size, edges, peel_result, (uint8_t*)result.region_.block);
-  libfilter_do_free(peel_results_region_result.region, size * sizeof(libfilter_edge_peel),
+static void libfilter_static_builder_free_edges(libfilter_static_builder* here) {
+  free(here->segment_offsets_);
+  here->segment_offsets_ = NULL;
+  libfilter_do_free(here->peels_region_, here->n_ * sizeof(libfilter_edge_peel),
                     alignof(libfilter_edge_peel));
-  libfilter_do_free(edge_region_result.region, n * sizeof(libfilter_edge),
+  libfilter_do_free(here->edges_region_, here->n_ * sizeof(libfilter_edge),
                     alignof(libfilter_edge));
-  return result;
+}
+
+int libfilter_static_builder_init(size_t n, const uint64_t* hashes, int shards,
+                                  libfilter_static_builder* here) {
+  if (shards < 1) return -1;
+  size_t size = ((n < 10) ? 2.0 : (0.75 + 1.0 / log(log(n)))) * n;
+  size = (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+  here->n_ = n;
+  here->hashes_ = hashes;
+  here->shards_ = shards;
+  here->phase_ = LIBFILTER_STATIC_ALLOCATE;
+  here->result_.length_ = size;
+  here->rounds_.data_ = NULL;
+  here->rounds_.size_ = here->rounds_.capacity_ = 0;
+  here->partitioned_ = false;
+  here->segments_ = 0;
+  here->segment_offsets_ = NULL;
+  here->frontier_ = (libfilter_vertex_list*)calloc(shards, sizeof(libfilter_vertex_list));
+  here->next_ = (libfilter_vertex_list*)calloc(shards, sizeof(libfilter_vertex_list));
+  if (here->frontier_ == NULL || here->next_ == NULL) {
+    free(here->frontier_);
+    free(here->next_);
+    return -1;
+  }
+  return 0;
+}
+
+void libfilter_static_builder_set_partitioned(libfilter_static_builder* here,
+                                              bool partitioned) {
+  assert(here->phase_ == LIBFILTER_STATIC_ALLOCATE);
+  here->partitioned_ = partitioned;
+}
+
+bool libfilter_static_builder_next(libfilter_static_builder* here) {
+  switch (here->phase_) {
+    case LIBFILTER_STATIC_ALLOCATE:
+      libfilter_static_builder_allocate(here);
+      here->phase_ =
+          here->partitioned_ ? LIBFILTER_STATIC_COUNT : LIBFILTER_STATIC_INIT;
+      return true;
+    case LIBFILTER_STATIC_COUNT: {
+      // Segment by segment, each shard's edges go after those of the shards before it
+      size_t offset = 0;
+      for (size_t s = 0; s < here->segments_; ++s) {
+        for (int i = 0; i < here->shards_; ++i) {
+          size_t* count = &here->segment_offsets_[i * here->segments_ + s];
+          const size_t tmp = *count;
+          *count = offset;
+          offset += tmp;
+        }
+      }
+      here->phase_ = LIBFILTER_STATIC_INIT;
+      return true;
+    }
+    case LIBFILTER_STATIC_INIT:
+    case LIBFILTER_STATIC_POPULATE:
+      ++here->phase_;
+      return true;
+    case LIBFILTER_STATIC_CLAIM:
+      // Each shard writes its peels after those of the shards before it
+      libfilter_vertex_list_push(&here->rounds_, here->peeled_);
+      for (int i = 0; i < here->shards_; ++i) {
+        here->next_[i].size_ = 0;
+        here->peeled_ += here->frontier_[i].size_;
+      }
+      here->phase_ = LIBFILTER_STATIC_PEEL;
+      return true;
+    case LIBFILTER_STATIC_PEEL:
+      for (int i = 0; i < here->shards_; ++i) {
+        const libfilter_vertex_list tmp = here->frontier_[i];
+        here->frontier_[i] = here->next_[i];
+        here->next_[i] = tmp;
+      }
+      // fall through
+    case LIBFILTER_STATIC_SCAN: {
+      size_t frontier = 0;
+      for (int i = 0; i < here->shards_; ++i) frontier += here->frontier_[i].size_;
+      if (frontier > 0) {
+        here->phase_ = LIBFILTER_STATIC_CLAIM;
+        return true;
+      }
+      libfilter_static_builder_free_nodes(here);
+      if (here->peeled_ < here->n_) {
+        // if peeling failed to peel all the way (found a 2-core)
+        size_t size = here->result_.length_;
+        libfilter_static_builder_free_edges(here);
+        libfilter_do_free(here->result_.region_, size, sizeof(void*));
+        size *= 1.01;
+        size += 1;
+        size = (size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+        here->result_.length_ = size;
+        here->phase_ = LIBFILTER_STATIC_ALLOCATE;
+        return libfilter_static_builder_next(here);
+      }
+      here->unpeel_round_ = here->rounds_.size_;
+    }
+      // fall through
+    case LIBFILTER_STATIC_UNPEEL:
+      if (here->unpeel_round_ == 0) {
+        here->phase_ = LIBFILTER_STATIC_DONE;
+        return false;
+      }
+      --here->unpeel_round_;
+      here->phase_ = LIBFILTER_STATIC_UNPEEL;
+      return true;
+    default:
+      return false;
+  }
+}
+
+void libfilter_static_builder_step(libfilter_static_builder* here, int shard) {
+  const int shards = here->shards_;
+  const bool concurrent = shards > 1;
+  const size_t size = here->result_.length_;
+  switch (here->phase_) {
+    case LIBFILTER_STATIC_COUNT: {
+      const size_t begin = libfilter_static_slice(here->n_, shards, shard);
+      const size_t end = libfilter_static_slice(here->n_, shards, shard + 1);
+      libfilter_count_edge_segments(end - begin, size, &here->hashes_[begin],
+                                    &here->segment_offsets_[shard * here->segments_]);
+      return;
+    }
+    case LIBFILTER_STATIC_INIT: {
+      const size_t begin = libfilter_static_slice(here->n_, shards, shard);
+      const size_t end = libfilter_static_slice(here->n_, shards, shard + 1);
+      if (here->partitioned_) {
+        libfilter_init_edges_partitioned(end - begin, size, &here->hashes_[begin],
+                                         &here->segment_offsets_[shard * here->segments_],
+                                         here->edges_);
+      } else {
+        libfilter_init_edges(end - begin, size, &here->hashes_[begin],
+                             &here->edges_[begin]);
+      }
+      const size_t vbegin = libfilter_static_slice(size, shards, shard);
+      const size_t vend = libfilter_static_slice(size, shards, shard + 1);
+      if (!here->nodes_zero_filled_) {
+        memset(&here->nodes_[vbegin], 0, (vend - vbegin) * sizeof(libfilter_peel_node));
+      }
+      if (!here->result_zero_filled_) {
+        memset((uint8_t*)here->result_.region_.block + vbegin, 0, vend - vbegin);
+      }
+      return;
+    }
+    case LIBFILTER_STATIC_POPULATE:
+      libfilter_populate_peel_nodes_range(
+          libfilter_static_slice(here->n_, shards, shard),
+          libfilter_static_slice(here->n_, shards, shard + 1), here->edges_, here->nodes_,
+          concurrent);
+      return;
+    case LIBFILTER_STATIC_SCAN: {
+      libfilter_vertex_list* frontier = &here->frontier_[shard];
+      frontier->size_ = 0;
+      const size_t end = libfilter_static_slice(size, shards, shard + 1);
+      for (size_t v = libfilter_static_slice(size, shards, shard); v < end; ++v) {
+        if (here->nodes_[v].count_ == 1) libfilter_vertex_list_push(frontier, v);
+      }
+      return;
+    }
+    case LIBFILTER_STATIC_CLAIM: {
+      libfilter_vertex_list* frontier = &here->frontier_[shard];
+      frontier->size_ =
+          libfilter_peel_claim(frontier->size_, frontier->data_, here->edges_, here->nodes_);
+      return;
+    }
+    case LIBFILTER_STATIC_PEEL: {
+      size_t offset = here->rounds_.data_[here->rounds_.size_ - 1];
+      for (int i = 0; i < shard; ++i) offset += here->frontier_[i].size_;
+      libfilter_peel_winners(here->frontier_[shard].size_, here->frontier_[shard].data_,
+                             here->edges_, here->nodes_, &here->peels_[offset],
+                             &here->next_[shard], concurrent);
+      return;
+    }
+    case LIBFILTER_STATIC_UNPEEL: {
+      const size_t round = here->unpeel_round_;
+      const size_t begin = here->rounds_.data_[round];
+      const size_t end =
+          (round + 1 < here->rounds_.size_) ? here->rounds_.data_[round + 1] : here->peeled_;
+      libfilter_unpeel_range(begin + libfilter_static_slice(end - begin, shards, shard),
+                             begin + libfilter_static_slice(end - begin, shards, shard + 1),
+                             here->edges_, here->peels_,
+                             (uint8_t*)here->result_.region_.block);
+      return;
+    }
+    default:
+      return;
+  }
+}
+
+libfilter_static libfilter_static_builder_finish(libfilter_static_builder* here) {
+  assert(here->phase_ == LIBFILTER_STATIC_DONE);
+  libfilter_static_builder_free_edges(here);
+  for (int i = 0; i < here->shards_; ++i) {
+    free(here->frontier_[i].data_);
+    free(here->next_[i].data_);
+  }
+  free(here->frontier_);
+  free(here->next_);
+  free(here->rounds_.data_);
+  return here->result_;
+}
+
+// Free result with libfilter_do_free(result.region_, result.length_, sizeof(void*));
+libfilter_static libfilter_static_construct(size_t n, const uint64_t* hashes) {
+  libfilter_static_builder builder;
+  if (0 != libfilter_static_builder_init(n, hashes, 1, &builder)) {
+    libfilter_static result;
+    result.length_ = 0;
+    libfilter_clear_region(&result.region_);
+    return result;
+  }
+  libfilter_static_builder_set_partitioned(&builder, true);
+  while (libfilter_static_builder_next(&builder)) {
+    libfilter_static_builder_step(&builder, 0);
+  }
+  return libfilter_static_builder_finish(&builder);
 }
 
 // Free result with libfilter_do_free(result.region_, result.length_, 1);
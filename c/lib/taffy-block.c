@@ -1,45 +1,360 @@
 #include "filter/taffy-block.h"
 
+#include <string.h>           // for memcpy, memcmp, memset
+
+#include "memory-internal.h"  // for libfilter_map_file, libfilter_reserve
+
+// An arena reserves no memory, only address space, but address space is finite too, and
+// a process may hold many small filters. Each arena holds only the next few levels,
+// enough to grow to 2^(LIBFILTER_TAFFY_BLOCK_ARENA_LEVELS - 1) times the size of the
+// first of them, and never more than LIBFILTER_TAFFY_BLOCK_ARENA_MAX_BYTES. A level too
+// large for any arena is allocated on its own.
+static const int LIBFILTER_TAFFY_BLOCK_ARENA_LEVELS = 6;
+static const uint64_t LIBFILTER_TAFFY_BLOCK_ARENA_MAX_BYTES = ((uint64_t)1) << 36;
+
+// The number of buckets libfilter_block_init allocates for a level of the given size
+static uint64_t libfilter_taffy_block_level_buckets(uint64_t bytes) {
+  return ((bytes > 32) ? bytes : 32) / 32;
+}
+
+static uint64_t libfilter_taffy_block_round_to_page(uint64_t bytes, uint64_t page) {
+  return (bytes + page - 1) / page * page;
+}
+
+// The bytes level i takes up in an arena
+static uint64_t libfilter_taffy_block_arena_level_bytes(const libfilter_taffy_block* here,
+                                                        int i) {
+  return libfilter_taffy_block_round_to_page(
+      32 * libfilter_taffy_block_level_buckets(here->sizes[i]), libfilter_page_size());
+}
+
+// Reserves a new arena for up to LIBFILTER_TAFFY_BLOCK_ARENA_LEVELS levels, as many as
+// fit in LIBFILTER_TAFFY_BLOCK_ARENA_MAX_BYTES, starting with the first level that is
+// neither added nor reserved. here->sizes must already be set. If the reservation fails,
+// nothing changes, and the levels are allocated on their own unless a later reservation
+// succeeds.
+static void libfilter_taffy_block_reserve(libfilter_taffy_block* here) {
+  const int first =
+      (here->cursor > here->arena_levels) ? here->cursor : here->arena_levels;
+  uint64_t total = 0;
+  int last = first;
+  for (; last < 48 && last < first + LIBFILTER_TAFFY_BLOCK_ARENA_LEVELS; ++last) {
+    const uint64_t level_bytes = libfilter_taffy_block_arena_level_bytes(here, last);
+    if (level_bytes > LIBFILTER_TAFFY_BLOCK_ARENA_MAX_BYTES - total) break;
+    total += level_bytes;
+  }
+  if (last == first) return;
+  void* arena = libfilter_reserve(total);
+  if (arena == NULL) return;
+  here->arenas[here->num_arenas] = arena;
+  here->arena_bytes[here->num_arenas] = total;
+  here->arena_first[here->num_arenas] = first;
+  ++here->num_arenas;
+  here->arena_levels = last;
+}
+
+// Returns where level i starts in its arena. i must be below here->arena_levels.
+static char* libfilter_taffy_block_arena_start(const libfilter_taffy_block* here, int i) {
+  int a = here->num_arenas - 1;
+  while (here->arena_first[a] > i) --a;
+  char* result = here->arenas[a];
+  for (int j = here->arena_first[a]; j < i; ++j) {
+    result += libfilter_taffy_block_arena_level_bytes(here, j);
+  }
+  return result;
+}
+
+// Adds level here->cursor, sized by here->sizes, and then publishes it by advancing the
+// cursor. See libfilter_taffy_block_cursor.
+static int libfilter_taffy_block_grow(libfilter_taffy_block* here) {
+  // Reserving is only an mmap of address space, so doing it one level early keeps every
+  // level that fits in an arena from being allocated and zeroed on the insert path.
+  if (here->cursor + 1 >= here->arena_levels) libfilter_taffy_block_reserve(here);
+  libfilter_block* level = &here->levels[here->cursor];
+  if (here->cursor < here->arena_levels) {
+    const uint64_t num_buckets =
+        libfilter_taffy_block_level_buckets(here->sizes[here->cursor]);
+    char* start = libfilter_taffy_block_arena_start(here, here->cursor);
+    if (0 == libfilter_commit(start, 32 * num_buckets)) {
+      level->num_buckets_ = num_buckets;
+      level->block_.block = (uint32_t*)start;
+      // Marks the level as part of an arena, for libfilter_taffy_block_destruct
+      level->block_.to_free = NULL;
+      __atomic_store_n(&here->cursor, here->cursor + 1, __ATOMIC_RELEASE);
+      return 0;
+    }
+    // Fall back to allocating this level on its own
+  }
+  const int result = libfilter_block_init(here->sizes[here->cursor], level);
+  if (result < 0) return result;
+  __atomic_store_n(&here->cursor, here->cursor + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// Leaves here with no levels and no arena, so that libfilter_taffy_block_destruct does
+// nothing to it
+static void libfilter_taffy_block_clear(libfilter_taffy_block* here) {
+  for (int i = 0; i < 48; ++i) libfilter_block_zero_out(&here->levels[i]);
+  here->cursor = 0;
+  here->num_arenas = 0;
+  here->arena_levels = 0;
+}
+
 void libfilter_taffy_block_destruct(libfilter_taffy_block* here) {
   for (int i = 0; i < here->cursor; ++i) {
-    libfilter_block_destruct(&here->levels[i]);
+    if (here->levels[i].block_.to_free != NULL) {
+      libfilter_block_destruct(&here->levels[i]);
+    }
+  }
+  for (int i = 0; i < here->num_arenas; ++i) {
+    libfilter_release(here->arenas[i], here->arena_bytes[i]);
   }
+  here->num_arenas = 0;
+  here->arena_levels = 0;
 }
 
 int libfilter_taffy_block_init(uint64_t ndv, double fpp, libfilter_taffy_block * here) {
-  here->last_ndv = ndv;
-  here->ttl = ndv;
   here->cursor = 0;
   const double sum = 6.0 / pow(3.1415, 2);
   uint64_t ndv2 = libfilter_block_capacity(1, fpp * sum);
   ndv = (ndv > ndv2) ? ndv : ndv2;
   here->last_ndv = ndv;
   here->ttl = ndv;
-  const int result = libfilter_block_init(libfilter_block_bytes_needed(ndv, fpp * sum),
-                                          &here->levels[0]);
-  ++here->cursor;
   for (uint64_t x = 0; x < 48; ++x) {
     here->sizes[x] = libfilter_block_bytes_needed(ndv << x, fpp / pow(x + 1, 2) * sum);
   }
+  for (int i = 0; i < 48; ++i) libfilter_block_zero_out(&here->levels[i]);
+  here->num_arenas = 0;
+  here->arena_levels = 0;
+  const int result = libfilter_taffy_block_grow(here);
+  if (result < 0) {
+    // Callers do not destruct a filter that failed to initialize
+    libfilter_taffy_block_destruct(here);
+  }
   return result;
 }
 
 void libfilter_taffy_block_upsize(libfilter_taffy_block* here) {
   here->last_ndv *= 2;
-  libfilter_block_init(here->sizes[here->cursor], &here->levels[here->cursor]);
-  ++here->cursor;
-  here->ttl = here->last_ndv;
+  libfilter_taffy_block_grow(here);
+  // This also discards the decrements of any threads in
+  // libfilter_taffy_block_add_hash_atomic that are waiting for the new level; they
+  // retry.
+  __atomic_store_n(&here->ttl, here->last_ndv, __ATOMIC_RELEASE);
 }
 
 int libfilter_taffy_block_clone(const libfilter_taffy_block* from,
                                 libfilter_taffy_block* to) {
-  for(int i = 0; i < 48; ++i) {
-    int notok = libfilter_block_clone(&from->levels[i], &to->levels[i]);
-    if (notok) return notok;
+  for (int i = 0; i < 48; ++i) {
     to->sizes[i] = from->sizes[i];
+    libfilter_block_zero_out(&to->levels[i]);
   }
-  to->cursor = from->cursor;
+  to->cursor = 0;
   to->last_ndv = from->last_ndv;
   to->ttl = from->ttl;
+  to->num_arenas = 0;
+  to->arena_levels = 0;
+  for (int i = 0; i < from->cursor; ++i) {
+    const int result = libfilter_taffy_block_grow(to);
+    if (result < 0) {
+      libfilter_taffy_block_destruct(to);
+      return result;
+    }
+    memcpy(to->levels[i].block_.block, from->levels[i].block_.block,
+           libfilter_block_size_in_bytes(&from->levels[i]));
+  }
+  return 0;
+}
+
+int libfilter_taffy_block_compact(const libfilter_taffy_block* from, double fpp,
+                                  const uint64_t* hashes, size_t n, libfilter_block* to) {
+  if (hashes != NULL) {
+    const int result = libfilter_block_init(libfilter_block_bytes_needed(n, fpp), to);
+    if (result < 0) return result;
+    libfilter_block_add_hash_batch(hashes, n, to);
+    return 0;
+  }
+  // Each level must have at least as many buckets as `to`, and libfilter_block_init
+  // allocates at most the bytes it is asked for.
+  const uint64_t bytes =
+      libfilter_block_bytes_needed(libfilter_taffy_block_ndv(from), fpp);
+  for (int i = 0; i < from->cursor; ++i) {
+    if (libfilter_block_size_in_bytes(&from->levels[i]) < bytes) return -1;
+  }
+  const int result = libfilter_block_init(bytes, to);
+  if (result < 0) return result;
+  const uint64_t num_buckets = to->num_buckets_;
+  for (int i = 0; i < from->cursor; ++i) {
+    const libfilter_block* level = &from->levels[i];
+    const uint64_t level_buckets = level->num_buckets_;
+    for (uint64_t j = 0; j < level_buckets; ++j) {
+      // Bucket j holds the hash values whose high 32 bits x have floor(x * level_buckets /
+      // 2^32) = j. Those are the x in [lo, hi], and each of them is in bucket
+      // floor(x * num_buckets / 2^32) of `to`.
+      const uint64_t lo = ((j << 32) + level_buckets - 1) / level_buckets;
+      const uint64_t hi = (((j + 1) << 32) + level_buckets - 1) / level_buckets - 1;
+      for (uint64_t t = libfilter_block_index(lo << 32, num_buckets);
+           t <= libfilter_block_index(hi << 32, num_buckets); ++t) {
+        for (int k = 0; k < 8; ++k) {
+          to->block_.block[8 * t + k] |= level->block_.block[8 * j + k];
+        }
+      }
+    }
+  }
   return 0;
 }
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // LIBFILTER_TAFFY_BLOCK_BYTE_ORDER, in the byte order of the writer
+  uint32_t byte_order;
+  // 1 for the hash scheme of block.h
+  uint32_t hash_scheme;
+  int32_t cursor;
+  uint64_t last_ndv;
+  int64_t ttl;
+  char padding[24];
+  uint64_t sizes[48];
+  uint64_t num_buckets[48];
+} libfilter_taffy_block_header;
+
+_Static_assert(sizeof(libfilter_taffy_block_header) % 32 == 0,
+               "the header must keep the levels after it aligned");
+
+static const char LIBFILTER_TAFFY_BLOCK_MAGIC[8] = "libftbk";
+static const uint32_t LIBFILTER_TAFFY_BLOCK_VERSION = 1;
+static const uint32_t LIBFILTER_TAFFY_BLOCK_BYTE_ORDER = 0x01020304;
+static const uint32_t LIBFILTER_TAFFY_BLOCK_HASH_SCHEME = 1;
+
+uint64_t libfilter_taffy_block_serialized_bytes(const libfilter_taffy_block* here) {
+  return sizeof(libfilter_taffy_block_header) + libfilter_taffy_block_size_in_bytes(here);
+}
+
+void libfilter_taffy_block_serialize(const libfilter_taffy_block* here, char* to) {
+  libfilter_taffy_block_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LIBFILTER_TAFFY_BLOCK_MAGIC, sizeof(header.magic));
+  header.version = LIBFILTER_TAFFY_BLOCK_VERSION;
+  header.byte_order = LIBFILTER_TAFFY_BLOCK_BYTE_ORDER;
+  header.hash_scheme = LIBFILTER_TAFFY_BLOCK_HASH_SCHEME;
+  header.cursor = here->cursor;
+  header.last_ndv = here->last_ndv;
+  header.ttl = here->ttl;
+  memcpy(header.sizes, here->sizes, sizeof(header.sizes));
+  for (int i = 0; i < here->cursor; ++i) {
+    header.num_buckets[i] = here->levels[i].num_buckets_;
+  }
+  memcpy(to, &header, sizeof(header));
+  to += sizeof(header);
+  for (int i = 0; i < here->cursor; ++i) {
+    const uint64_t level_bytes = libfilter_block_size_in_bytes(&here->levels[i]);
+    memcpy(to, here->levels[i].block_.block, level_bytes);
+    to += level_bytes;
+  }
+}
+
+// Reads and checks the header of a serialized filter. Returns 0 if it is valid and
+// describes exactly bytes bytes, and < 0 otherwise.
+static int libfilter_taffy_block_read_header(const char* from, uint64_t bytes,
+                                             libfilter_taffy_block_header* header) {
+  if (bytes < sizeof(*header)) return -1;
+  memcpy(header, from, sizeof(*header));
+  if (0 != memcmp(header->magic, LIBFILTER_TAFFY_BLOCK_MAGIC, sizeof(header->magic))) {
+    return -1;
+  }
+  if (header->version != LIBFILTER_TAFFY_BLOCK_VERSION) return -1;
+  if (header->byte_order != LIBFILTER_TAFFY_BLOCK_BYTE_ORDER) return -1;
+  if (header->hash_scheme != LIBFILTER_TAFFY_BLOCK_HASH_SCHEME) return -1;
+  if (header->cursor < 1 || header->cursor > 48) return -1;
+  uint64_t expected = sizeof(*header);
+  for (int i = 0; i < header->cursor; ++i) {
+    // libfilter_block_index only handles 32-bit bucket counts
+    if (header->num_buckets[i] == 0 || header->num_buckets[i] > UINT32_MAX) return -1;
+    expected += header->num_buckets[i] * 32;
+  }
+  return (expected == bytes) ? 0 : -1;
+}
+
+// Sets everything in `to` but the levels, the cursor, and the arena
+static void libfilter_taffy_block_from_header(const libfilter_taffy_block_header* header,
+                                              libfilter_taffy_block* to) {
+  memcpy(to->sizes, header->sizes, sizeof(to->sizes));
+  to->last_ndv = header->last_ndv;
+  to->ttl = header->ttl;
+  for (int i = 0; i < 48; ++i) libfilter_block_zero_out(&to->levels[i]);
+}
+
+int libfilter_taffy_block_deserialize(const char* from, uint64_t bytes,
+                                      libfilter_taffy_block* to) {
+  libfilter_taffy_block_clear(to);
+  libfilter_taffy_block_header header;
+  if (0 != libfilter_taffy_block_read_header(from, bytes, &header)) return -1;
+  for (int i = 0; i < header.cursor; ++i) {
+    // Levels are always sized by the schedule in sizes, which the filter keeps
+    // following as it grows.
+    if (header.num_buckets[i] != libfilter_taffy_block_level_buckets(header.sizes[i])) {
+      return -1;
+    }
+  }
+  libfilter_taffy_block_from_header(&header, to);
+  from += sizeof(header);
+  for (int i = 0; i < header.cursor; ++i) {
+    const int result = libfilter_taffy_block_grow(to);
+    if (result < 0) {
+      libfilter_taffy_block_destruct(to);
+      return result;
+    }
+    const uint64_t level_bytes = header.num_buckets[i] * 32;
+    memcpy(to->levels[i].block_.block, from, level_bytes);
+    from += level_bytes;
+  }
+  return 0;
+}
+
+int libfilter_taffy_block_view_init(const void* from, uint64_t bytes,
+                                    libfilter_taffy_block_view* here) {
+  // Leave here safe to destruct even if the image is rejected
+  libfilter_taffy_block_clear(&here->filter);
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  if (0 != ((uintptr_t)from & 31)) return -1;
+  libfilter_taffy_block_header header;
+  if (0 != libfilter_taffy_block_read_header(from, bytes, &header)) return -1;
+  libfilter_taffy_block_from_header(&header, &here->filter);
+  here->filter.cursor = header.cursor;
+  const char* level = (const char*)from + sizeof(header);
+  for (int i = 0; i < header.cursor; ++i) {
+    here->filter.levels[i].num_buckets_ = header.num_buckets[i];
+    here->filter.levels[i].block_.block = (uint32_t*)level;
+    here->filter.levels[i].block_.to_free = NULL;
+    level += header.num_buckets[i] * 32;
+  }
+  return 0;
+}
+
+int libfilter_taffy_block_view_map(const char* path, libfilter_taffy_block_view* here) {
+  libfilter_taffy_block_clear(&here->filter);
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  void* mapping;
+  uint64_t bytes;
+  if (0 != libfilter_map_file(path, &mapping, &bytes)) return -1;
+  const int result = libfilter_taffy_block_view_init(mapping, bytes, here);
+  if (result < 0) {
+    libfilter_unmap_file(mapping, bytes);
+    return result;
+  }
+  here->mapping = mapping;
+  here->mapping_bytes = bytes;
+  return 0;
+}
+
+int libfilter_taffy_block_view_destruct(libfilter_taffy_block_view* here) {
+  for (int i = 0; i < 48; ++i) libfilter_block_zero_out(&here->filter.levels[i]);
+  here->filter.cursor = 0;
+  const int result = libfilter_unmap_file(here->mapping, here->mapping_bytes);
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  return result;
+}
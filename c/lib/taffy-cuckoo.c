@@ -1,5 +1,7 @@
 #include "filter/taffy-cuckoo.h"
 
+#include "memory-internal.h"  // for libfilter_map_file
+
 libfilter_taffy_cuckoo_side libfilter_taffy_cuckoo_side_create(int log_side_size,
                                                                const uint64_t* keys) {
   libfilter_taffy_cuckoo_side here;
@@ -14,6 +16,29 @@ libfilter_taffy_cuckoo_side libfilter_taffy_cuckoo_side_create(int log_side_size
   return here;
 }
 
+void libfilter_taffy_cuckoo_stash_add(libfilter_taffy_cuckoo_side* here,
+                                      libfilter_taffy_cuckoo_path p) {
+  if (here->stash_size == here->stash_capacity) {
+    here->stash_capacity *= 2;
+    libfilter_taffy_cuckoo_path* new_stash = (libfilter_taffy_cuckoo_path*)calloc(
+        here->stash_capacity, sizeof(libfilter_taffy_cuckoo_path));
+    memcpy(new_stash, here->stash, here->stash_size * sizeof(libfilter_taffy_cuckoo_path));
+    free(here->stash);
+    here->stash = new_stash;
+  }
+  // After every path in p's bucket, so that paths stay in the order they were stashed
+  const size_t i = libfilter_taffy_cuckoo_stash_lower_bound(here, p.bucket + 1);
+  memmove(&here->stash[i + 1], &here->stash[i],
+          (here->stash_size - i) * sizeof(libfilter_taffy_cuckoo_path));
+  here->stash[i] = p;
+  ++here->stash_size;
+}
+
+static int libfilter_frozen_taffy_cuckoo_compare(const void* x, const void* y) {
+  const uint64_t a = *(const uint64_t*)x, b = *(const uint64_t*)y;
+  return (a > b) - (a < b);
+}
+
 size_t libfilter_frozen_taffy_cuckoo_size_in_bytes(
     const libfilter_frozen_taffy_cuckoo* b) {
   return (sizeof(libfilter_frozen_taffy_cuckoo_bucket) * 2ul << b->log_side_size_) +
@@ -48,6 +73,195 @@ libfilter_frozen_taffy_cuckoo libfilter_frozen_taffy_cuckoo_create(
   return here;
 }
 
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  int32_t log_side_size;
+  uint64_t stash_size[2];
+  // keys[i] is hash_[i].keys[0][0], hash_[i].keys[0][1], hash_[i].keys[1][0], and
+  // hash_[i].keys[1][1]
+  uint64_t keys[2][4];
+} libfilter_frozen_taffy_cuckoo_header;
+
+_Static_assert(sizeof(libfilter_frozen_taffy_cuckoo_header) == 96,
+               "the header must keep the stashes after it aligned");
+_Static_assert(sizeof(libfilter_frozen_taffy_cuckoo_bucket) == 5,
+               "buckets are stored as they are laid out in memory");
+
+static const char LIBFILTER_FROZEN_TAFFY_CUCKOO_MAGIC[8] = "libftcf";
+static const uint32_t LIBFILTER_FROZEN_TAFFY_CUCKOO_VERSION = 1;
+
+// The image is read and written with memcpy, which is only the documented little-endian
+// format on little-endian machines.
+static bool libfilter_frozen_taffy_cuckoo_little_endian(void) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint64_t libfilter_frozen_taffy_cuckoo_serialized_bytes(
+    const libfilter_frozen_taffy_cuckoo* here) {
+  return sizeof(libfilter_frozen_taffy_cuckoo_header) +
+         sizeof(uint64_t) * (here->stash_size_[0] + here->stash_size_[1]) +
+         (2 * sizeof(libfilter_frozen_taffy_cuckoo_bucket) << here->log_side_size_);
+}
+
+int libfilter_frozen_taffy_cuckoo_serialize(const libfilter_frozen_taffy_cuckoo* here,
+                                            char* to) {
+  if (!libfilter_frozen_taffy_cuckoo_little_endian()) return -1;
+  libfilter_frozen_taffy_cuckoo_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, LIBFILTER_FROZEN_TAFFY_CUCKOO_MAGIC, sizeof(header.magic));
+  header.version = LIBFILTER_FROZEN_TAFFY_CUCKOO_VERSION;
+  header.log_side_size = here->log_side_size_;
+  for (int i = 0; i < 2; ++i) {
+    header.stash_size[i] = here->stash_size_[i];
+    header.keys[i][0] = here->hash_[i].keys[0][0];
+    header.keys[i][1] = here->hash_[i].keys[0][1];
+    header.keys[i][2] = here->hash_[i].keys[1][0];
+    header.keys[i][3] = here->hash_[i].keys[1][1];
+  }
+  memcpy(to, &header, sizeof(header));
+  to += sizeof(header);
+  for (int i = 0; i < 2; ++i) {
+    memcpy(to, here->stash_[i], sizeof(uint64_t) * here->stash_size_[i]);
+    to += sizeof(uint64_t) * here->stash_size_[i];
+  }
+  for (int i = 0; i < 2; ++i) {
+    memcpy(to, here->data_[i],
+           sizeof(libfilter_frozen_taffy_cuckoo_bucket) << here->log_side_size_);
+    to += sizeof(libfilter_frozen_taffy_cuckoo_bucket) << here->log_side_size_;
+  }
+  return 0;
+}
+
+// Reads and checks the header of a serialized filter and sets everything in `to` but the
+// buckets and stashes. Returns 0 if the header is valid and describes exactly bytes
+// bytes, and < 0 otherwise.
+static int libfilter_frozen_taffy_cuckoo_read_header(const char* from, uint64_t bytes,
+                                                     libfilter_frozen_taffy_cuckoo* to) {
+  libfilter_frozen_taffy_cuckoo_header header;
+  if (!libfilter_frozen_taffy_cuckoo_little_endian()) return -1;
+  if (bytes < sizeof(header)) return -1;
+  memcpy(&header, from, sizeof(header));
+  if (0 != memcmp(header.magic, LIBFILTER_FROZEN_TAFFY_CUCKOO_MAGIC,
+                  sizeof(header.magic))) {
+    return -1;
+  }
+  if (header.version != LIBFILTER_FROZEN_TAFFY_CUCKOO_VERSION) return -1;
+  // The permuted values are log_side_size + libfilter_taffy_cuckoo_head_size bits wide
+  if (header.log_side_size < 1 || header.log_side_size > 48) return -1;
+  uint64_t expected = sizeof(header) +
+                      (2 * sizeof(libfilter_frozen_taffy_cuckoo_bucket)
+                       << header.log_side_size);
+  for (int i = 0; i < 2; ++i) {
+    if (header.stash_size[i] > bytes / sizeof(uint64_t)) return -1;
+    expected += sizeof(uint64_t) * header.stash_size[i];
+  }
+  if (expected != bytes) return -1;
+  to->log_side_size_ = header.log_side_size;
+  for (int i = 0; i < 2; ++i) {
+    to->hash_[i] = libfilter_feistel_create(header.keys[i]);
+    to->stash_size_[i] = header.stash_size[i];
+  }
+  return 0;
+}
+
+// The frozen find searches stashes with a binary search
+static bool libfilter_frozen_taffy_cuckoo_stashes_sorted(
+    const libfilter_frozen_taffy_cuckoo* here) {
+  for (int i = 0; i < 2; ++i) {
+    for (size_t j = 1; j < here->stash_size_[i]; ++j) {
+      if (here->stash_[i][j - 1] > here->stash_[i][j]) return false;
+    }
+  }
+  return true;
+}
+
+int libfilter_frozen_taffy_cuckoo_deserialize(const char* from, uint64_t bytes,
+                                              libfilter_frozen_taffy_cuckoo* to) {
+  libfilter_frozen_taffy_cuckoo result;
+  if (0 != libfilter_frozen_taffy_cuckoo_read_header(from, bytes, &result)) return -1;
+  from += sizeof(libfilter_frozen_taffy_cuckoo_header);
+  const size_t side_bytes = sizeof(libfilter_frozen_taffy_cuckoo_bucket)
+                            << result.log_side_size_;
+  for (int i = 0; i < 2; ++i) {
+    result.stash_capacity_[i] = (result.stash_size_[i] > 4) ? result.stash_size_[i] : 4;
+    result.stash_[i] = (uint64_t*)calloc(result.stash_capacity_[i], sizeof(uint64_t));
+    result.data_[i] = (libfilter_frozen_taffy_cuckoo_bucket*)malloc(side_bytes);
+  }
+  if (result.stash_[0] == NULL || result.stash_[1] == NULL || result.data_[0] == NULL ||
+      result.data_[1] == NULL) {
+    libfilter_frozen_taffy_cuckoo_destruct(&result);
+    return -1;
+  }
+  for (int i = 0; i < 2; ++i) {
+    memcpy(result.stash_[i], from, sizeof(uint64_t) * result.stash_size_[i]);
+    from += sizeof(uint64_t) * result.stash_size_[i];
+  }
+  for (int i = 0; i < 2; ++i) {
+    memcpy(result.data_[i], from, side_bytes);
+    from += side_bytes;
+  }
+  if (!libfilter_frozen_taffy_cuckoo_stashes_sorted(&result)) {
+    libfilter_frozen_taffy_cuckoo_destruct(&result);
+    return -1;
+  }
+  *to = result;
+  return 0;
+}
+
+int libfilter_frozen_taffy_cuckoo_view_init(const void* from, uint64_t bytes,
+                                            libfilter_frozen_taffy_cuckoo_view* here) {
+  // Leave here safe to destruct even if the image is rejected
+  memset(here, 0, sizeof(*here));
+  if (0 != ((uintptr_t)from & 7)) return -1;
+  libfilter_frozen_taffy_cuckoo* f = &here->filter;
+  if (0 != libfilter_frozen_taffy_cuckoo_read_header(from, bytes, f)) return -1;
+  const char* next = (const char*)from + sizeof(libfilter_frozen_taffy_cuckoo_header);
+  for (int i = 0; i < 2; ++i) {
+    f->stash_[i] = (uint64_t*)next;
+    f->stash_capacity_[i] = f->stash_size_[i];
+    next += sizeof(uint64_t) * f->stash_size_[i];
+  }
+  for (int i = 0; i < 2; ++i) {
+    f->data_[i] = (libfilter_frozen_taffy_cuckoo_bucket*)next;
+    next += sizeof(libfilter_frozen_taffy_cuckoo_bucket) << f->log_side_size_;
+  }
+  if (!libfilter_frozen_taffy_cuckoo_stashes_sorted(f)) return -1;
+  return 0;
+}
+
+int libfilter_frozen_taffy_cuckoo_view_map(const char* path,
+                                           libfilter_frozen_taffy_cuckoo_view* here) {
+  memset(here, 0, sizeof(*here));
+  void* mapping;
+  uint64_t bytes;
+  if (0 != libfilter_map_file(path, &mapping, &bytes)) return -1;
+  const int result = libfilter_frozen_taffy_cuckoo_view_init(mapping, bytes, here);
+  if (result < 0) {
+    libfilter_unmap_file(mapping, bytes);
+    return result;
+  }
+  here->mapping = mapping;
+  here->mapping_bytes = bytes;
+  return 0;
+}
+
+int libfilter_frozen_taffy_cuckoo_view_destruct(libfilter_frozen_taffy_cuckoo_view* here) {
+  for (int i = 0; i < 2; ++i) {
+    here->filter.data_[i] = NULL;
+    here->filter.stash_[i] = NULL;
+    here->filter.stash_size_[i] = 0;
+  }
+  const int result = libfilter_unmap_file(here->mapping, here->mapping_bytes);
+  here->mapping = NULL;
+  here->mapping_bytes = 0;
+  return result;
+}
+
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y) {
   // SideSwap(&x->sides[0], &y->sides[0]);
   // SideSwap(&x->sides[1], &y->sides[1]);
@@ -70,6 +284,9 @@ libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create(int log_side_size,
   here.rng = libfilter_pcg_random_create(libfilter_log_slots);
   here.entropy = entropy;
   here.occupied = 0;
+  here.incremental = false;
+  here.migrating = NULL;
+  here.migrated = 0;
   return here;
 }
 
@@ -82,6 +299,13 @@ int libfilter_taffy_cuckoo_clone(const libfilter_taffy_cuckoo* that, libfilter_t
   here->rng = that->rng;
   here->entropy = that->entropy;
   here->occupied = that->occupied;
+  here->incremental = that->incremental;
+  here->migrating = NULL;
+  here->migrated = that->migrated;
+  if (that->migrating != NULL) {
+    here->migrating = (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+    libfilter_taffy_cuckoo_clone(that->migrating, here->migrating);
+  }
   for (int i = 0; i < 2; ++i) {
     free(here->sides[i].stash);
     here->sides[i].stash = (libfilter_taffy_cuckoo_path*)calloc(
@@ -96,10 +320,13 @@ int libfilter_taffy_cuckoo_clone(const libfilter_taffy_cuckoo* that, libfilter_t
   return 0;
 }
 
+// The entropy of filters created by libfilter_taffy_cuckoo_init and
+// libfilter_taffy_cuckoo_create_with_bytes
+static const uint64_t kEntropy[8] = {
+    0x2ba7538ee1234073, 0xfcc3777539b147d6, 0x6086c563576347e7, 0x52eff34ee1764465,
+    0x8639cbf57f264867, 0x5a31ee34f0224ccb, 0x07a1cb8140744ee6, 0xf2296cf6a6524e9f};
+
 void libfilter_taffy_cuckoo_init(uint64_t bytes, libfilter_taffy_cuckoo* here) {
-  static const uint64_t kEntropy[8] = {
-      0x2ba7538ee1234073, 0xfcc3777539b147d6, 0x6086c563576347e7, 0x52eff34ee1764465,
-      0x8639cbf57f264867, 0x5a31ee34f0224ccb, 0x07a1cb8140744ee6, 0xf2296cf6a6524e9f};
   double f =
       log(1.0 * bytes / 2 / libfilter_slots / sizeof(libfilter_taffy_cuckoo_slot)) /
       log(2);
@@ -111,12 +338,12 @@ void libfilter_taffy_cuckoo_init(uint64_t bytes, libfilter_taffy_cuckoo* here) {
   here->rng = libfilter_pcg_random_create(libfilter_log_slots);
   here->entropy = kEntropy;
   here->occupied = 0;
+  here->incremental = false;
+  here->migrating = NULL;
+  here->migrated = 0;
 }
 
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create_with_bytes(uint64_t bytes) {
-  static const uint64_t kEntropy[8] = {
-      0x2ba7538ee1234073, 0xfcc3777539b147d6, 0x6086c563576347e7, 0x52eff34ee1764465,
-      0x8639cbf57f264867, 0x5a31ee34f0224ccb, 0x07a1cb8140744ee6, 0xf2296cf6a6524e9f};
   double f =
       log(1.0 * bytes / 2 / libfilter_slots / sizeof(libfilter_taffy_cuckoo_slot)) /
       log(2);
@@ -126,21 +353,34 @@ libfilter_taffy_cuckoo libfilter_taffy_cuckoo_create_with_bytes(uint64_t bytes)
 
 void libfilter_taffy_cuckoo_freeze_init(const libfilter_taffy_cuckoo* here,
                                         libfilter_frozen_taffy_cuckoo* result) {
+  if (here->migrating != NULL) {
+    // Every key must be in the one table that is frozen
+    libfilter_taffy_cuckoo finished;
+    libfilter_taffy_cuckoo_clone(here, &finished);
+    libfilter_taffy_cuckoo_finish_upsize(&finished);
+    libfilter_taffy_cuckoo_freeze_init(&finished, result);
+    libfilter_taffy_cuckoo_destruct(&finished);
+    return;
+  }
   libfilter_frozen_taffy_cuckoo_init(here->entropy, here->log_side_size, result);
   for (int i = 0; i < 2; ++i) {
     for (size_t j = 0; j < here->sides[i].stash_size; ++j) {
-      uint64_t topush = libfilter_taffy_cuckoo_from_path_no_tail(
-          here->sides[i].stash[j], &here->sides[i].f, here->log_side_size);
+      // The frozen find compares stashed values to the permuted bucket and fingerprint
+      uint64_t topush =
+          (here->sides[i].stash[j].bucket << libfilter_taffy_cuckoo_head_size) |
+          here->sides[i].stash[j].slot.fingerprint;
       if (result->stash_size_[i] == result->stash_capacity_[i]) {
         result->stash_capacity_[i] *= 2;
         uint64_t* new_stash =
             (uint64_t*)calloc(result->stash_capacity_[i], sizeof(uint64_t));
-        memcpy(new_stash, result->stash_[i], result->stash_size_[i]);
+        memcpy(new_stash, result->stash_[i], result->stash_size_[i] * sizeof(uint64_t));
         free(result->stash_[i]);
         result->stash_[i] = new_stash;
       }
       result->stash_[i][result->stash_size_[i]++] = topush;
     }
+    qsort(result->stash_[i], result->stash_size_[i], sizeof(uint64_t),
+          libfilter_frozen_taffy_cuckoo_compare);
     for (size_t j = 0; j < (1ul << here->log_side_size); ++j) {
       libfilter_frozen_taffy_cuckoo_bucket* out = &result->data_[i][j];
       const libfilter_taffy_cuckoo_bucket* in = &here->sides[i].data[j];
@@ -159,11 +399,60 @@ libfilter_frozen_taffy_cuckoo libfilter_taffy_cuckoo_freeze(
   return result;
 }
 
+int libfilter_frozen_taffy_cuckoo_thaw(const libfilter_frozen_taffy_cuckoo* here,
+                                       const uint64_t* entropy, libfilter_taffy_cuckoo* to) {
+  if (entropy == NULL) entropy = kEntropy;
+  for (int i = 0; i < 2; ++i) {
+    const libfilter_feistel f = libfilter_feistel_create(&entropy[4 * i]);
+    if (0 != memcmp(&f, &here->hash_[i], sizeof(f))) return -1;
+  }
+  *to = libfilter_taffy_cuckoo_create(here->log_side_size_, entropy);
+  libfilter_taffy_cuckoo_slot empty_tail;
+  empty_tail.fingerprint = 0;
+  empty_tail.tail = 1u << libfilter_taffy_cuckoo_tail_size;
+  for (int i = 0; i < 2; ++i) {
+    for (uint64_t j = 0; j < (1ul << here->log_side_size_); ++j) {
+      const libfilter_frozen_taffy_cuckoo_bucket* in = &here->data_[i][j];
+      const uint64_t fingerprints[libfilter_slots] = {in->zero, in->one, in->two,
+                                                      in->three};
+      libfilter_taffy_cuckoo_bucket* out = &to->sides[i].data[j];
+      int used = 0;
+      bool zero = false;
+      for (int k = 0; k < libfilter_slots; ++k) {
+        if (fingerprints[k] == 0) {
+          zero = true;
+          continue;
+        }
+        out->data[used] = empty_tail;
+        out->data[used].fingerprint = fingerprints[k];
+        ++used;
+      }
+      // Either a slot was empty, which this now fills, or it held a fingerprint of zero
+      if (zero) out->data[used++] = empty_tail;
+      to->occupied += used;
+    }
+    for (size_t j = 0; j < here->stash_size_[i]; ++j) {
+      // Paths that differed only in their tails are the same once the tails are gone
+      if (j > 0 && here->stash_[i][j] == here->stash_[i][j - 1]) continue;
+      libfilter_taffy_cuckoo_path p;
+      p.bucket = here->stash_[i][j] >> libfilter_taffy_cuckoo_head_size;
+      p.slot = empty_tail;
+      // Helpfully gets cut off by being a bitfield
+      p.slot.fingerprint = here->stash_[i][j];
+      libfilter_taffy_cuckoo_stash_add(&to->sides[i], p);
+      ++to->occupied;
+    }
+  }
+  return 0;
+}
+
 uint64_t libfilter_taffy_cuckoo_size_in_bytes(const libfilter_taffy_cuckoo* here) {
   return sizeof(libfilter_taffy_cuckoo_path) *
              (here->sides[0].stash_capacity + here->sides[1].stash_capacity) +
          2 * sizeof(libfilter_taffy_cuckoo_slot) * (1 << here->log_side_size) *
-             libfilter_slots;
+             libfilter_slots +
+         (here->migrating == NULL ? 0
+                                  : libfilter_taffy_cuckoo_size_in_bytes(here->migrating));
 }
 
 // // Verifies the occupied field:
@@ -200,6 +489,10 @@ void libfilter_taffy_cuckoo_destruct(libfilter_taffy_cuckoo* t) {
   free(t->sides[0].stash);
   free(t->sides[1].data);
   free(t->sides[1].stash);
+  if (t->migrating != NULL) {
+    libfilter_taffy_cuckoo_destruct(t->migrating);
+    free(t->migrating);
+  }
 }
 
 // Take an item from slot sl with bucket index i, a filter u that sl is in, a side that
@@ -236,10 +529,59 @@ INLINE void UpsizeHelper(libfilter_taffy_cuckoo* here, libfilter_taffy_cuckoo_sl
   }
 }
 
+void libfilter_taffy_cuckoo_migrate(libfilter_taffy_cuckoo* here, uint64_t n) {
+  libfilter_taffy_cuckoo* old = here->migrating;
+  if (old == NULL) return;
+  const uint64_t side_buckets = 1ul << old->log_side_size;
+  // Side 0 is moved first, then side 1
+  for (; n > 0 && here->migrated < 2 * side_buckets; --n, ++here->migrated) {
+    const int s = here->migrated >= side_buckets;
+    const uint64_t i = here->migrated & (side_buckets - 1);
+    for (int j = 0; j < libfilter_slots; ++j) {
+      UpsizeHelper(old, old->sides[s].data[i].data[j], i, s, here);
+    }
+  }
+  if (here->migrated == 2 * side_buckets) {
+    here->migrating = NULL;
+    here->migrated = 0;
+    libfilter_taffy_cuckoo_destruct(old);
+    free(old);
+  }
+}
+
+void libfilter_taffy_cuckoo_finish_upsize(libfilter_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo_migrate(here, UINT64_MAX);
+}
+
+void libfilter_taffy_cuckoo_set_incremental(libfilter_taffy_cuckoo* here,
+                                            bool incremental) {
+  here->incremental = incremental;
+  if (!incremental) libfilter_taffy_cuckoo_finish_upsize(here);
+}
+
 void libfilter_taffy_cuckoo_upsize(libfilter_taffy_cuckoo* here) {
+  libfilter_taffy_cuckoo_finish_upsize(here);
   libfilter_taffy_cuckoo t =
       libfilter_taffy_cuckoo_create(1 + here->log_side_size, here->entropy);
 
+  if (here->incremental) {
+    // The stashes are small, so they are moved right away. The buckets are moved by
+    // libfilter_taffy_cuckoo_migrate, and until then the old table is searched too.
+    libfilter_taffy_cuckoo* old =
+        (libfilter_taffy_cuckoo*)malloc(sizeof(libfilter_taffy_cuckoo));
+    *old = *here;
+    for (int s = 0; s < 2; ++s) {
+      for (size_t i = 0; i < old->sides[s].stash_size; ++i) {
+        UpsizeHelper(old, old->sides[s].stash[i].slot, old->sides[s].stash[i].bucket, s,
+                     &t);
+      }
+    }
+    t.incremental = true;
+    t.migrating = old;
+    *here = t;
+    return;
+  }
+
   for (int s = 0; s < 2; ++s) {
     for (size_t i = 0; i < here->sides[s].stash_size; ++i) {
       UpsizeHelper(here, here->sides[s].stash[i].slot, here->sides[s].stash[i].bucket, s,
@@ -257,9 +599,61 @@ void libfilter_taffy_cuckoo_upsize(libfilter_taffy_cuckoo* here) {
   libfilter_taffy_cuckoo_destruct(&t);
 }
 
+static uint64_t libfilter_taffy_cuckoo_path_pack(libfilter_taffy_cuckoo_path p) {
+  return (p.bucket << (libfilter_taffy_cuckoo_head_size + libfilter_taffy_cuckoo_tail_size +
+                       1)) |
+         ((uint64_t)p.slot.tail << libfilter_taffy_cuckoo_head_size) | p.slot.fingerprint;
+}
+
+static libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_path_unpack(uint64_t x) {
+  libfilter_taffy_cuckoo_path p;
+  p.bucket =
+      x >> (libfilter_taffy_cuckoo_head_size + libfilter_taffy_cuckoo_tail_size + 1);
+  p.slot.tail = (x >> libfilter_taffy_cuckoo_head_size) &
+                ((1u << (libfilter_taffy_cuckoo_tail_size + 1)) - 1);
+  p.slot.fingerprint = x & ((1u << libfilter_taffy_cuckoo_head_size) - 1);
+  return p;
+}
+
+static void libfilter_taffy_cuckoo_path_list_push(libfilter_taffy_cuckoo_path_list* here,
+                                                  libfilter_taffy_cuckoo_path p) {
+  if (here->size == here->capacity) {
+    here->capacity = (here->capacity < 16) ? 16 : 2 * here->capacity;
+    here->data = (uint64_t*)realloc(here->data, here->capacity * sizeof(uint64_t));
+  }
+  here->data[here->size++] = libfilter_taffy_cuckoo_path_pack(p);
+}
+
+static void libfilter_taffy_cuckoo_path_list_free(libfilter_taffy_cuckoo_path_list* here) {
+  free(here->data);
+  here->data = NULL;
+  here->size = here->capacity = 0;
+}
+
+// The merge shard that owns bucket b of each side of here
+static int libfilter_taffy_cuckoo_shard(const libfilter_taffy_cuckoo* here, int shards,
+                                        uint64_t b) {
+  return (b * shards) >> here->log_side_size;
+}
+
+// Inserts q into side 0 of here or, if lists is not NULL, appends it to the list of the
+// merge shard that owns its bucket.
+static void libfilter_taffy_cuckoo_union_emit(libfilter_taffy_cuckoo* here,
+                                              libfilter_taffy_cuckoo_path_list* lists,
+                                              int shards, libfilter_taffy_cuckoo_path q) {
+  if (lists == NULL) {
+    libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
+    return;
+  }
+  libfilter_taffy_cuckoo_path_list_push(
+      &lists[libfilter_taffy_cuckoo_shard(here, shards, q.bucket)], q);
+}
+
 static void libfilter_taffy_cuckoo_union_help(libfilter_taffy_cuckoo* here,
                                               const libfilter_taffy_cuckoo* that,
-                                              int side, libfilter_taffy_cuckoo_path p) {
+                                              int side, libfilter_taffy_cuckoo_path p,
+                                              libfilter_taffy_cuckoo_path_list* lists,
+                                              int shards) {
   uint64_t hashed = libfilter_taffy_cuckoo_from_path_no_tail(p, &that->sides[side].f,
                                                              that->log_side_size);
   // hashed is high that->log_side_size + libfilter_taffy_cuckoo_head_size, in high bits
@@ -269,8 +663,7 @@ static void libfilter_taffy_cuckoo_union_help(libfilter_taffy_cuckoo* here,
     libfilter_taffy_cuckoo_path q =
         libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
     q.slot.tail = p.slot.tail;
-    libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
-    q.slot.tail = 0;  // dummy line just to break on
+    libfilter_taffy_cuckoo_union_emit(here, lists, shards, q);
   } else if (that->log_side_size + tail_size >= here->log_side_size) {
     uint64_t orin3 = (((uint64_t)(p.slot.tail & (p.slot.tail - 1)))
                       << (64 - that->log_side_size - libfilter_taffy_cuckoo_head_size -
@@ -280,7 +673,7 @@ static void libfilter_taffy_cuckoo_union_help(libfilter_taffy_cuckoo* here,
     libfilter_taffy_cuckoo_path q =
         libfilter_taffy_cuckoo_to_path(hashed, &here->sides[0].f, here->log_side_size);
     q.slot.tail = (p.slot.tail << (here->log_side_size - that->log_side_size));
-    libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
+    libfilter_taffy_cuckoo_union_emit(here, lists, shards, q);
   } else {
     // p.tail & (p.tail - 1) removes the final 1 marker. The resulting length is
     // 0, 1, 2, 3, 4, or 5. It is also tail_size, but is packed in high bits of a
@@ -307,7 +700,7 @@ static void libfilter_taffy_cuckoo_union_help(libfilter_taffy_cuckoo* here,
       libfilter_taffy_cuckoo_path q = libfilter_taffy_cuckoo_to_path(
           tmphashed, &here->sides[0].f, here->log_side_size);
       q.slot.tail = (1u << libfilter_taffy_cuckoo_tail_size);
-      libfilter_taffy_cuckoo_insert_side_path(here, 0, q);
+      libfilter_taffy_cuckoo_union_emit(here, lists, shards, q);
     }
   }
 }
@@ -318,7 +711,8 @@ static void libfilter_taffy_cuckoo_union_one(libfilter_taffy_cuckoo* here,
   libfilter_taffy_cuckoo_path p;
   for (int side = 0; side < 2; ++side) {
     for (size_t i = 0; i < that->sides[side].stash_size; ++i) {
-      libfilter_taffy_cuckoo_union_help(here, that, side, that->sides[side].stash[i]);
+      libfilter_taffy_cuckoo_union_help(here, that, side, that->sides[side].stash[i], NULL,
+                                        0);
     }
     for (uint64_t bucket = 0; bucket < (1ul << that->log_side_size); ++bucket) {
       p.bucket = bucket;
@@ -326,7 +720,7 @@ static void libfilter_taffy_cuckoo_union_one(libfilter_taffy_cuckoo* here,
         if (that->sides[side].data[bucket].data[slot].tail == 0) continue;
         p.slot.fingerprint = that->sides[side].data[bucket].data[slot].fingerprint;
         p.slot.tail = that->sides[side].data[bucket].data[slot].tail;
-        libfilter_taffy_cuckoo_union_help(here, that, side, p);
+        libfilter_taffy_cuckoo_union_help(here, that, side, p, NULL, 0);
         continue;
       }
     }
@@ -335,6 +729,19 @@ static void libfilter_taffy_cuckoo_union_one(libfilter_taffy_cuckoo* here,
 
 libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo* x,
                                                     const libfilter_taffy_cuckoo* y) {
+  if (x->migrating != NULL || y->migrating != NULL) {
+    // Finish upsizing copies first, so that every key is in one table and occupied counts
+    // all of them
+    libfilter_taffy_cuckoo a, b;
+    libfilter_taffy_cuckoo_clone(x, &a);
+    libfilter_taffy_cuckoo_clone(y, &b);
+    libfilter_taffy_cuckoo_finish_upsize(&a);
+    libfilter_taffy_cuckoo_finish_upsize(&b);
+    libfilter_taffy_cuckoo result = libfilter_taffy_cuckoo_union(&a, &b);
+    libfilter_taffy_cuckoo_destruct(&a);
+    libfilter_taffy_cuckoo_destruct(&b);
+    return result;
+  }
   if (x->occupied > y->occupied) {
     libfilter_taffy_cuckoo result;
     libfilter_taffy_cuckoo_clone(x, &result);
@@ -346,3 +753,167 @@ libfilter_taffy_cuckoo libfilter_taffy_cuckoo_union(const libfilter_taffy_cuckoo
   libfilter_taffy_cuckoo_union_one(&result, x);
   return result;
 }
+
+int libfilter_taffy_cuckoo_merge_init(libfilter_taffy_cuckoo* here,
+                                      const libfilter_taffy_cuckoo* that, int shards,
+                                      libfilter_taffy_cuckoo_merge* m) {
+  // Shards are found by multiplying a bucket index by shards, which must not overflow
+  if (shards < 1 || shards > (1 << 16) || here == that ||
+      that->log_side_size > here->log_side_size) {
+    return -1;
+  }
+  libfilter_taffy_cuckoo_finish_upsize(here);
+  m->here = here;
+  m->that = that;
+  m->shards = shards;
+  m->gathered = (libfilter_taffy_cuckoo_path_list*)calloc(
+      (size_t)shards * shards, sizeof(libfilter_taffy_cuckoo_path_list));
+  m->crossing = (libfilter_taffy_cuckoo_path_list*)calloc(
+      (size_t)shards * shards, sizeof(libfilter_taffy_cuckoo_path_list));
+  m->leftover = (libfilter_taffy_cuckoo_path_list*)calloc(
+      shards, sizeof(libfilter_taffy_cuckoo_path_list));
+  m->occupied = (uint64_t*)calloc(shards, sizeof(uint64_t));
+  if (m->gathered == NULL || m->crossing == NULL || m->leftover == NULL ||
+      m->occupied == NULL) {
+    libfilter_taffy_cuckoo_merge_finish(m);
+    return -1;
+  }
+  return 0;
+}
+
+// Sends shard's part of every slot in that, and, for shard 0, the stashes, to the lists
+// of the shards that own their buckets in here
+static void libfilter_taffy_cuckoo_merge_gather(libfilter_taffy_cuckoo_merge* m,
+                                                const libfilter_taffy_cuckoo* that,
+                                                int shard) {
+  libfilter_taffy_cuckoo_path_list* lists = &m->gathered[(size_t)shard * m->shards];
+  if (shard == 0) {
+    for (int side = 0; side < 2; ++side) {
+      for (size_t i = 0; i < that->sides[side].stash_size; ++i) {
+        libfilter_taffy_cuckoo_union_help(m->here, that, side, that->sides[side].stash[i],
+                                          lists, m->shards);
+      }
+    }
+  }
+  // Both sides of that, one after the other
+  const uint64_t n = 2ul << that->log_side_size;
+  const uint64_t mask = (1ul << that->log_side_size) - 1;
+  libfilter_taffy_cuckoo_path p;
+  for (uint64_t i = n * shard / m->shards; i < n * (shard + 1) / m->shards; ++i) {
+    const int side = i >> that->log_side_size;
+    p.bucket = i & mask;
+    for (int slot = 0; slot < libfilter_slots; ++slot) {
+      p.slot = that->sides[side].data[p.bucket].data[slot];
+      if (p.slot.tail == 0) continue;
+      libfilter_taffy_cuckoo_union_help(m->here, that, side, p, lists, m->shards);
+    }
+  }
+}
+
+// Puts p in an empty slot of its bucket, unless it is already present. Returns 1 if it
+// was placed, 0 if it was present, and -1 if the bucket is full.
+static int libfilter_taffy_cuckoo_side_place(libfilter_taffy_cuckoo_side* here,
+                                             libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_bucket* b = &here->data[p.bucket];
+  const uint64_t bucket = libfilter_taffy_cuckoo_bucket_load(b);
+  const uint64_t empty = libfilter_taffy_cuckoo_bucket_empty(bucket);
+  const uint64_t match = libfilter_taffy_cuckoo_bucket_match(bucket, p.slot);
+  const uint64_t first = (empty | match) & -(empty | match);
+  if (first & match) return 0;
+  if (first == 0) return -1;
+  b->data[__builtin_ctzll(first) / 16] = p.slot;
+  return 1;
+}
+
+// The path of the same value in the other side of here
+static libfilter_taffy_cuckoo_path libfilter_taffy_cuckoo_other_side(
+    const libfilter_taffy_cuckoo* here, int side, libfilter_taffy_cuckoo_path p) {
+  libfilter_taffy_cuckoo_path q = libfilter_taffy_cuckoo_to_path(
+      libfilter_taffy_cuckoo_from_path_no_tail(p, &here->sides[side].f,
+                                               here->log_side_size),
+      &here->sides[1 - side].f, here->log_side_size);
+  q.slot.tail = p.slot.tail;
+  return q;
+}
+
+void libfilter_taffy_cuckoo_merge_step(libfilter_taffy_cuckoo_merge* m, int phase,
+                                       int shard) {
+  libfilter_taffy_cuckoo* here = m->here;
+  const int shards = m->shards;
+  uint64_t occupied = 0;
+  if (phase == 0) {
+    libfilter_taffy_cuckoo_merge_gather(m, m->that, shard);
+    if (m->that->migrating != NULL) {
+      libfilter_taffy_cuckoo_merge_gather(m, m->that->migrating, shard);
+    }
+  } else if (phase == 1) {
+    // Place this shard's paths in side 0 or, if their bucket there is full, side 1. Those
+    // that belong to another shard in side 1 are left for it in the next phase.
+    for (int w = 0; w < shards; ++w) {
+      libfilter_taffy_cuckoo_path_list* in = &m->gathered[(size_t)w * shards + shard];
+      for (size_t i = 0; i < in->size; ++i) {
+        const libfilter_taffy_cuckoo_path p =
+            libfilter_taffy_cuckoo_path_unpack(in->data[i]);
+        int placed = libfilter_taffy_cuckoo_side_place(&here->sides[0], p);
+        if (placed < 0) {
+          const libfilter_taffy_cuckoo_path q =
+              libfilter_taffy_cuckoo_other_side(here, 0, p);
+          const int owner = libfilter_taffy_cuckoo_shard(here, shards, q.bucket);
+          if (owner != shard) {
+            libfilter_taffy_cuckoo_path_list_push(
+                &m->crossing[(size_t)shard * shards + owner], q);
+            continue;
+          }
+          placed = libfilter_taffy_cuckoo_side_place(&here->sides[1], q);
+          if (placed < 0) {
+            libfilter_taffy_cuckoo_path_list_push(&m->leftover[shard], p);
+            continue;
+          }
+        }
+        occupied += placed;
+      }
+      libfilter_taffy_cuckoo_path_list_free(in);
+    }
+  } else if (phase == 2) {
+    for (int v = 0; v < shards; ++v) {
+      libfilter_taffy_cuckoo_path_list* in = &m->crossing[(size_t)v * shards + shard];
+      for (size_t i = 0; i < in->size; ++i) {
+        const libfilter_taffy_cuckoo_path q =
+            libfilter_taffy_cuckoo_path_unpack(in->data[i]);
+        const int placed = libfilter_taffy_cuckoo_side_place(&here->sides[1], q);
+        if (placed < 0) {
+          libfilter_taffy_cuckoo_path_list_push(
+              &m->leftover[shard], libfilter_taffy_cuckoo_other_side(here, 1, q));
+          continue;
+        }
+        occupied += placed;
+      }
+      libfilter_taffy_cuckoo_path_list_free(in);
+    }
+  }
+  m->occupied[shard] += occupied;
+}
+
+void libfilter_taffy_cuckoo_merge_finish(libfilter_taffy_cuckoo_merge* m) {
+  for (int i = 0; m->occupied != NULL && i < m->shards; ++i) {
+    m->here->occupied += m->occupied[i];
+  }
+  for (int i = 0; m->leftover != NULL && i < m->shards; ++i) {
+    for (size_t j = 0; j < m->leftover[i].size; ++j) {
+      libfilter_taffy_cuckoo_insert_side_path(
+          m->here, 0, libfilter_taffy_cuckoo_path_unpack(m->leftover[i].data[j]));
+    }
+    libfilter_taffy_cuckoo_path_list_free(&m->leftover[i]);
+  }
+  // Lists are normally freed by the phase that reads them, but not if a phase was skipped
+  for (size_t i = 0; i < (size_t)m->shards * m->shards; ++i) {
+    if (m->gathered != NULL) libfilter_taffy_cuckoo_path_list_free(&m->gathered[i]);
+    if (m->crossing != NULL) libfilter_taffy_cuckoo_path_list_free(&m->crossing[i]);
+  }
+  free(m->gathered);
+  free(m->crossing);
+  free(m->leftover);
+  free(m->occupied);
+  m->gathered = m->crossing = m->leftover = NULL;
+  m->occupied = NULL;
+}
@@ -0,0 +1,50 @@
+#include "filter/wide-block.h"
+
+#include "filter/memory.h"    // for libfilter_region
+#include "memory-internal.h"  // for libfilter_calloc_region, libfilter_do_free
+#include "util-internal.h"    // for libfilter_block_bytes_needed_detail
+
+// 16 words of 32 bits each
+static const uint64_t BUCKET_BYTES = 16 * 32 / CHAR_BIT;
+
+double libfilter_wide_block_fpp(double ndv, double bytes) {
+  return libfilter_block_fpp_detail(ndv, bytes, 32, 16, 32);
+}
+
+uint64_t libfilter_wide_block_capacity(uint64_t bytes, double fpp) {
+  return libfilter_block_capacity_detail(bytes, fpp, 32, 16, 32);
+}
+
+uint64_t libfilter_wide_block_bytes_needed(double ndv, double fpp) {
+  return libfilter_block_bytes_needed_detail(ndv, fpp, 32, 16, 32);
+}
+
+int libfilter_wide_block_init(uint64_t heap_space, libfilter_wide_block *here) {
+  return libfilter_calloc_region(heap_space, BUCKET_BYTES, &here->num_buckets_,
+                                 &here->block_);
+}
+
+int libfilter_wide_block_destruct(libfilter_wide_block *here) {
+  return libfilter_do_free(here->block_, here->num_buckets_ * BUCKET_BYTES, BUCKET_BYTES);
+}
+
+void libfilter_wide_block_zero_out(libfilter_wide_block *here) {
+  here->num_buckets_ = 0;
+  libfilter_clear_region(&here->block_);
+}
+
+int libfilter_wide_block_clone(const libfilter_wide_block *here,
+                               libfilter_wide_block *to) {
+  if (0 != libfilter_clone_region(here->block_, here->num_buckets_ * BUCKET_BYTES,
+                                  BUCKET_BYTES, &to->block_)) {
+    return -1;
+  }
+  to->num_buckets_ = here->num_buckets_;
+  return 0;
+}
+
+bool libfilter_wide_block_equals(const libfilter_wide_block *here,
+                                 const libfilter_wide_block *there) {
+  return libfilter_equal_regions(here->block_, here->num_buckets_ * BUCKET_BYTES,
+                                 there->block_, there->num_buckets_ * BUCKET_BYTES);
+}
@@ -20,9 +20,11 @@
 #include "cuckoo32.hpp"
 #include "cuckoofilter.h"
 #include "filter/block.hpp"  // for BlockFilter, ScalarBlockFilter (ptr o...
+#include "filter/counting-block.hpp"
 #include "filter/minimal-taffy-cuckoo.hpp"
 #include "filter/taffy-block.hpp"
 #include "filter/taffy-cuckoo.hpp"
+#include "filter/wide-block.hpp"
 #if defined(__x86_64)
 #include "filter/taffy-vector-quotient.hpp"
 #endif
@@ -331,5 +333,11 @@ int main(int argc, char** argv) {
     BenchWithBytes<TaffyCuckooFilter>(reps, bytes, 1.05, to_insert, to_find);
     BenchGrowWithNdvFpp<TaffyBlockFilter>(reps, 1.05, to_insert, to_find, ndv, taffy_fpp);
     BenchWithNdvFpp<BlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
+    BenchWithNdvFpp<ScalarBlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
+    BenchWithNdvFpp<WideBlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
+    BenchWithNdvFpp<CountingBlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
+#if defined(LIBFILTER_BLOCK_AVX512)
+    BenchWithNdvFpp<Avx512BlockFilter>(reps, 1.05, to_insert, to_find, ndv, block_fpp);
+#endif
   }
 }
@@ -7,6 +7,7 @@
 using namespace std;
 
 #include "filter/block.hpp"  // for BlockFilter, ScalarBlockFilter, Scala...
+#include "filter/wide-block.hpp"  // for WideBlockFilter
 #include "util.hpp"          // for Rand
 
 using namespace filter;
@@ -37,4 +38,8 @@ int main() {
        << endl;
   cout << ScalarBlockFilter::Name() << "\t"
        << experimental_fpp<ScalarBlockFilter>(ndv, bytes) << endl;
+  cout << "Expected fpp for wide:\t"
+       << WideBlockFilter::FalsePositiveProbability(ndv, bytes) << endl;
+  cout << WideBlockFilter::Name() << "\t"
+       << experimental_fpp<WideBlockFilter>(ndv, bytes) << endl;
 }
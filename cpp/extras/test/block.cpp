@@ -1,13 +1,20 @@
 #include <jni.h>
 
 #include <cstdint>  // for uint64_t
+#include <cstring>  // for memset
 #include <memory>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>  // for write, close, truncate, unlink
 #include <unordered_set>
 #include <vector>  // for allocator, vector
 
+#include "filter/counting-block.hpp"
 #include "filter/minimal-taffy-cuckoo.hpp"
+#include "filter/static.hpp"
 #include "filter/taffy-block.hpp"
 #include "filter/taffy-cuckoo.hpp"
+#include "filter/wide-block.hpp"
 #include "gtest/gtest.h"
 #include "util.hpp"  // for Rand
 #if defined(__x86_64)
@@ -31,9 +38,17 @@ class BytesTest : public ::testing::Test {};
 template <typename F>
 class NdvFppTest : public ::testing::Test {};
 
-using BlockTypes = ::testing::Types<BlockFilter, ScalarBlockFilter>;
-using CreatedWithBytes = ::testing::Types<TaffyCuckooFilter, MinimalTaffyCuckooFilter,
-                                          BlockFilter, ScalarBlockFilter>;
+#if defined(LIBFILTER_BLOCK_AVX512)
+using BlockTypes = ::testing::Types<BlockFilter, ScalarBlockFilter, RuntimeBlockFilter,
+                                    ConcurrentBlockFilter, Avx512BlockFilter>;
+#else
+using BlockTypes = ::testing::Types<BlockFilter, ScalarBlockFilter, RuntimeBlockFilter,
+                                    ConcurrentBlockFilter>;
+#endif
+using CreatedWithBytes =
+    ::testing::Types<TaffyCuckooFilter, MinimalTaffyCuckooFilter, BlockFilter,
+                     ScalarBlockFilter, WideBlockFilter, ScalarWideBlockFilter,
+                     CountingBlockFilter, ScalarCountingBlockFilter>;
 using CreatedWithNdvFpp = ::testing::Types<TaffyBlockFilter>;
 using UnionTypes = ::testing::Types<TaffyCuckooFilter>;
 
@@ -214,6 +229,89 @@ TYPED_TEST(BlockTest, Buddy) {
   }
 }
 
+// Test that batched finds agree with one-at-a-time finds
+TYPED_TEST(BlockTest, FindHashBatch) {
+  auto ndv = 160000;
+  auto x = TypeParam::CreateWithBytes(ndv);
+  Rand r;
+  vector<uint64_t> hashes;
+  for (int i = 0; i < ndv; ++i) {
+    hashes.push_back(r());
+    x.InsertHash(hashes.back());
+    hashes.push_back(r());
+  }
+  for (size_t n : {size_t{0}, size_t{1}, size_t{7}, hashes.size()}) {
+    vector<uint8_t> out(n, 2);
+    x.FindHashBatch(hashes.data(), n, out.data());
+    for (size_t i = 0; i < n; ++i) {
+      EXPECT_EQ(x.FindHash(hashes[i]), out[i]) << n << " " << i;
+    }
+  }
+}
+
+// Test that batch inserts set the same bits as inserting one hash at a time. The filter is
+// big enough that the partitioned insert actually partitions.
+TYPED_TEST(BlockTest, InsertHashBatch) {
+  auto ndv = 200000;
+  auto x = TypeParam::CreateWithBytes(1 << 20);
+  auto y = TypeParam::CreateWithBytes(1 << 20);
+  auto z = TypeParam::CreateWithBytes(1 << 20);
+  Rand r;
+  vector<uint64_t> hashes(ndv);
+  for (int i = 0; i < ndv; ++i) {
+    hashes[i] = r();
+    x.InsertHash(hashes[i]);
+  }
+  y.InsertHashBatch(hashes.data(), 7);
+  y.InsertHashBatch(hashes.data() + 7, ndv - 7);
+  z.InsertHashBatchPartitioned(hashes.data(), 7);
+  z.InsertHashBatchPartitioned(hashes.data() + 7, ndv - 7);
+  EXPECT_TRUE(x == y);
+  EXPECT_TRUE(x == z);
+}
+
+// Test that union and intersection are bitwise, and that they reject filters of different
+// sizes.
+TYPED_TEST(BlockTest, UnionIntersect) {
+  // An odd number of buckets, to exercise the kernels' tails
+  const uint64_t bytes = 32 * 4099;
+  auto x = TypeParam::CreateWithBytes(bytes);
+  auto y = TypeParam::CreateWithBytes(bytes);
+  auto both = TypeParam::CreateWithBytes(bytes);
+  auto either = TypeParam::CreateWithBytes(bytes);
+  Rand r;
+  for (int i = 0; i < 20000; ++i) {
+    const auto h = r();
+    switch (i % 3) {
+      case 0:
+        x.InsertHash(h);
+        either.InsertHash(h);
+        break;
+      case 1:
+        y.InsertHash(h);
+        either.InsertHash(h);
+        break;
+      case 2:
+        x.InsertHash(h);
+        y.InsertHash(h);
+        both.InsertHash(h);
+        either.InsertHash(h);
+    }
+  }
+  auto u = x;
+  u |= y;
+  EXPECT_TRUE(u == either);
+  auto v = x;
+  v &= y;
+  // The intersection has every bit of both, plus collisions.
+  auto w = v;
+  w |= both;
+  EXPECT_TRUE(w == v);
+  auto z = TypeParam::CreateWithBytes(2 * bytes);
+  EXPECT_THROW(z |= x, std::invalid_argument);
+  EXPECT_THROW(z &= x, std::invalid_argument);
+}
+
 // Test eqaulity operator
 TYPED_TEST(BlockTest, EqualStayEqual) {
   auto ndv = 160000;
@@ -234,6 +332,481 @@ TYPED_TEST(BlockTest, EqualStayEqual) {
   }
 }
 
+// Test that inserting from many threads at once sets the same bits as inserting from one,
+// and that finds running at the same time see no false negatives for hashes inserted
+// before they started.
+TEST(ConcurrentBlockTest, ManyWriters) {
+  const int ndv = 1 << 20, nthreads = 8;
+  auto x = ConcurrentBlockFilter::CreateWithBytes(ndv);
+  auto y = ScalarBlockFilter::CreateWithBytes(ndv);
+  Rand r;
+  vector<uint64_t> hashes(ndv);
+  for (auto& h : hashes) {
+    h = r();
+    y.InsertHash(h);
+  }
+  // The first chunk is inserted before the threads start.
+  const int chunk = ndv / (nthreads + 1);
+  x.InsertHashBatch(hashes.data(), chunk);
+  vector<thread> threads;
+  for (int t = 1; t <= nthreads; ++t) {
+    threads.emplace_back([&x, &hashes, t, chunk, ndv, nthreads]() {
+      const int end = (t == nthreads) ? ndv : (t + 1) * chunk;
+      if (t % 2 == 0) {
+        x.InsertHashBatch(&hashes[t * chunk], end - t * chunk);
+      } else {
+        for (int i = t * chunk; i < end; ++i) x.InsertHash(hashes[i]);
+      }
+      for (int i = 0; i < chunk; ++i) EXPECT_TRUE(x.FindHash(hashes[i]));
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_TRUE(x == y);
+}
+
+// Test that the Scalar and Simd wide block filters set the same bits
+TEST(WideBlockTest, Buddy) {
+  auto ndv = 1600000;
+  auto x = WideBlockFilter::CreateWithBytes(ndv);
+  auto y = ScalarWideBlockFilter::CreateWithBytes(ndv);
+  Rand r;
+  for (int i = 0; i < ndv; ++i) {
+    auto v = r();
+    x.InsertHash(v);
+    y.InsertHash(v);
+  }
+  for (int i = 0; i < ndv; ++i) {
+    auto v = r();
+    EXPECT_EQ(x.FindHash(v), y.FindHash(v));
+  }
+}
+
+// Test that, with enough space per key, setting 16 bits per key beats setting 8, and that
+// the model agrees with experiment.
+TEST(WideBlockTest, LowerFpp) {
+  const uint64_t ndv = 200000, bytes = 3 * ndv;
+  const double model = WideBlockFilter::FalsePositiveProbability(ndv, bytes);
+  EXPECT_LT(model, BlockFilter::FalsePositiveProbability(ndv, bytes));
+  auto x = WideBlockFilter::CreateWithBytes(bytes);
+  Rand r;
+  for (uint64_t i = 0; i < ndv; ++i) x.InsertHash(r());
+  const uint64_t samples = 10 * 1000 * 1000;
+  double found = 0;
+  for (uint64_t i = 0; i < samples; ++i) found += x.FindHash(r());
+  EXPECT_GT(found / samples, model / 2);
+  EXPECT_LT(found / samples, model * 2);
+  EXPECT_GE(WideBlockFilter::MinSpaceNeeded(ndv, model), bytes - 64);
+}
+
+// Test that the Scalar and Simd counting block filters agree as hashes are added and
+// removed, and that removing every hash that was added empties the filter
+TEST(CountingBlockTest, AddRemove) {
+  const int ndv = 100000;
+  auto x = CountingBlockFilter::CreateWithBytes(ndv * 4);
+  auto y = ScalarCountingBlockFilter::CreateWithBytes(ndv * 4);
+  const auto x_empty = x;
+  const auto y_empty = y;
+  Rand r;
+  vector<uint64_t> hashes(ndv);
+  for (auto& v : hashes) {
+    v = r();
+    x.InsertHash(v);
+    y.InsertHash(v);
+  }
+  for (int i = 0; i < ndv / 2; ++i) {
+    EXPECT_TRUE(x.RemoveHash(hashes[i]));
+    EXPECT_TRUE(y.RemoveHash(hashes[i]));
+  }
+  for (int i = ndv / 2; i < ndv; ++i) {
+    EXPECT_TRUE(x.FindHash(hashes[i]));
+    EXPECT_TRUE(y.FindHash(hashes[i]));
+  }
+  for (int i = 0; i < ndv; ++i) {
+    auto v = r();
+    EXPECT_EQ(x.FindHash(v), y.FindHash(v));
+  }
+  for (int i = ndv / 2; i < ndv; ++i) {
+    x.RemoveHash(hashes[i]);
+    y.RemoveHash(hashes[i]);
+  }
+  EXPECT_TRUE(x == x_empty);
+  EXPECT_TRUE(y == y_empty);
+}
+
+// Test that saturated counters are never decremented, and that removing a hash that is
+// not found changes nothing
+TEST(CountingBlockTest, Saturate) {
+  auto x = CountingBlockFilter::CreateWithBytes(1 << 12);
+  Rand r;
+  const uint64_t v = r();
+  for (int i = 0; i < 20; ++i) x.InsertHash(v);
+  for (int i = 0; i < 20; ++i) EXPECT_TRUE(x.RemoveHash(v));
+  EXPECT_TRUE(x.FindHash(v));
+  const auto before = x;
+  for (int i = 0; i < 1000; ++i) {
+    const uint64_t w = r();
+    if (!x.FindHash(w)) {
+      EXPECT_FALSE(x.RemoveHash(w));
+    }
+  }
+  EXPECT_TRUE(x == before);
+}
+
+// Test that inserting from many threads into a taffy block filter that grows many times
+// loses no hash values and counts each one once, and that finds running at the same time
+// see no false negatives for hashes inserted before they started.
+TEST(TaffyBlockTest, ManyWriters) {
+  // Its non-atomic InsertHash must not be reachable through a TaffyBlockFilter
+  static_assert(
+      !std::is_convertible<ConcurrentTaffyBlockFilter*, TaffyBlockFilter*>::value,
+      "ConcurrentTaffyBlockFilter is a TaffyBlockFilter");
+  const int ndv = 1 << 18, nthreads = 8;
+  auto x = ConcurrentTaffyBlockFilter::CreateWithNdvFpp(1000, 0.01);
+  Rand r;
+  vector<uint64_t> hashes(ndv);
+  for (auto& h : hashes) h = r();
+  const int chunk = ndv / (nthreads + 1);
+  for (int i = 0; i < chunk; ++i) x.InsertHash(hashes[i]);
+  vector<thread> threads;
+  for (int t = 1; t <= nthreads; ++t) {
+    threads.emplace_back([&x, &hashes, t, chunk, ndv, nthreads]() {
+      const int end = (t == nthreads) ? ndv : (t + 1) * chunk;
+      for (int i = t * chunk; i < end; ++i) x.InsertHash(hashes[i]);
+      vector<uint8_t> found(chunk);
+      x.FindHashBatch(hashes.data(), chunk, found.data());
+      for (int i = 0; i < chunk; ++i) {
+        EXPECT_TRUE(x.FindHash(hashes[i]));
+        EXPECT_TRUE(found[i]);
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_GT(x.data.cursor, 5);
+  EXPECT_EQ(static_cast<uint64_t>(ndv), libfilter_taffy_block_ndv(&x.data));
+  for (int i = 0; i < ndv; ++i) ASSERT_TRUE(x.FindHash(hashes[i])) << i;
+}
+
+// Test that a taffy block filter keeps its hash values as it grows through several
+// arenas, and that a copy grows on its own
+TEST(TaffyBlockTest, Arena) {
+  auto x = TaffyBlockFilter::CreateWithNdvFpp(1000, 0.01);
+  EXPECT_EQ(1, x.data.num_arenas);
+  EXPECT_GT(x.data.arena_levels, 3);
+  // The arena is sized for the filter, not for the largest it might ever grow to
+  EXPECT_LT(x.data.arena_bytes[0], 1u << 20);
+  Rand r;
+  vector<uint64_t> hashes(100000);
+  for (size_t i = 0; i < hashes.size() / 2; ++i) {
+    hashes[i] = r();
+    x.InsertHash(hashes[i]);
+  }
+  const int cursor = x.data.cursor;
+  EXPECT_GT(cursor, 5);
+  for (int i = 0; i < cursor; ++i) {
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(x.data.levels[i].block_.block) % 32);
+  }
+  auto y = x;
+  for (size_t i = hashes.size() / 2; i < hashes.size(); ++i) {
+    hashes[i] = r();
+    y.InsertHash(hashes[i]);
+  }
+  EXPECT_GT(y.data.cursor, cursor);
+  // Every level is in an arena, and the next one is reserved before it is needed
+  EXPECT_GT(y.data.num_arenas, 1);
+  EXPECT_GT(y.data.arena_levels, y.data.cursor);
+  for (int i = 0; i < y.data.cursor; ++i) {
+    EXPECT_EQ(nullptr, y.data.levels[i].block_.to_free) << i;
+  }
+  EXPECT_EQ(cursor, x.data.cursor);
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    ASSERT_TRUE(y.FindHash(hashes[i])) << i;
+    if (i < hashes.size() / 2) {
+      ASSERT_TRUE(x.FindHash(hashes[i])) << i;
+    }
+  }
+}
+
+// Test that the batch finds of a taffy block filter that has grown many times agree with
+// FindHash
+TEST(TaffyBlockTest, FindHashBatch) {
+  auto x = TaffyBlockFilter::CreateWithNdvFpp(1000, 0.01);
+  Rand r;
+  vector<uint64_t> hashes(200000);
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    hashes[i] = r();
+    if (i < hashes.size() / 2) x.InsertHash(hashes[i]);
+  }
+  EXPECT_GT(x.data.cursor, 5);
+  vector<uint8_t> found(hashes.size());
+  x.FindHashBatch(hashes.data(), hashes.size(), found.data());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    const bool expected = x.FindHash(hashes[i]);
+    if (i < hashes.size() / 2) {
+      ASSERT_TRUE(expected);
+    }
+    ASSERT_EQ(expected, found[i]) << i;
+  }
+}
+
+// Test that compacting a taffy block filter, by rebuilding or folding, keeps every hash
+// value and meets the false positive probability
+TEST(TaffyBlockTest, Compact) {
+  Rand r;
+  const double fpp = 0.01;
+  auto grown = TaffyBlockFilter::CreateWithNdvFpp(1000, fpp);
+  vector<uint64_t> hashes(100000);
+  for (auto& v : hashes) {
+    v = r();
+    grown.InsertHash(v);
+  }
+  EXPECT_GT(grown.data.cursor, 5);
+  EXPECT_EQ(hashes.size(), libfilter_taffy_block_ndv(&grown.data));
+  auto rebuilt = grown.Compact(fpp, hashes.data(), hashes.size());
+  EXPECT_LT(rebuilt.SizeInBytes(), grown.SizeInBytes());
+  for (auto v : hashes) ASSERT_TRUE(rebuilt.FindHash(v));
+  double found = 0;
+  const int samples = 1000 * 1000;
+  for (int i = 0; i < samples; ++i) found += rebuilt.FindHash(r());
+  EXPECT_LT(found / samples, 2 * fpp);
+
+  // A filter that was sized for more hash values than it got folds into a smaller one
+  auto roomy = TaffyBlockFilter::CreateWithNdvFpp(1 << 16, fpp);
+  for (int i = 0; i < 1000; ++i) roomy.InsertHash(hashes[i]);
+  auto folded = roomy.Compact(fpp);
+  EXPECT_LT(folded.SizeInBytes(), roomy.SizeInBytes());
+  EXPECT_GE(folded.SizeInBytes(), BlockFilter::MinSpaceNeeded(1000, fpp));
+  for (int i = 0; i < 1000; ++i) ASSERT_TRUE(folded.FindHash(hashes[i]));
+  found = 0;
+  for (int i = 0; i < samples; ++i) found += folded.FindHash(r());
+  EXPECT_LT(found / samples, 2 * fpp);
+
+  // The oldest levels of a filter that has been upsized several times are too small to
+  // be folded
+  auto upsized = TaffyBlockFilter::CreateWithNdvFpp(20000, fpp);
+  for (auto v : hashes) upsized.InsertHash(v);
+  EXPECT_GE(upsized.data.cursor, 3);
+  EXPECT_THROW(upsized.Compact(fpp), std::runtime_error);
+}
+
+// Test that a serialized taffy block filter can be read back, by copying or as a view,
+// and that the copy can keep growing
+TEST(TaffyBlockTest, SerDe) {
+  Rand r;
+  auto x = TaffyBlockFilter::CreateWithNdvFpp(1000, 0.01);
+  vector<uint64_t> hashes(50000);
+  for (auto& v : hashes) {
+    v = r();
+    x.InsertHash(v);
+  }
+  // Over-allocate so the image can start on a 32-byte boundary
+  vector<char> buffer(x.SerializedBytes() + 32);
+  char* image = buffer.data() + (32 - reinterpret_cast<uintptr_t>(buffer.data()) % 32);
+  x.Serialize(image);
+
+  auto y = TaffyBlockFilter::Deserialize(image, x.SerializedBytes());
+  EXPECT_EQ(x.SizeInBytes(), y.SizeInBytes());
+  auto v = TaffyBlockFilterView::FromBuffer(image, x.SerializedBytes());
+  EXPECT_EQ(x.SizeInBytes(), v.SizeInBytes());
+  for (auto h : hashes) {
+    ASSERT_TRUE(y.FindHash(h));
+    ASSERT_TRUE(v.FindHash(h));
+  }
+  for (int i = 0; i < 100000; ++i) {
+    const uint64_t h = r();
+    ASSERT_EQ(x.FindHash(h), y.FindHash(h));
+    ASSERT_EQ(x.FindHash(h), v.FindHash(h));
+  }
+  for (auto& h : hashes) {
+    h = r();
+    y.InsertHash(h);
+  }
+  EXPECT_GT(y.data.cursor, x.data.cursor);
+  for (auto h : hashes) ASSERT_TRUE(y.FindHash(h));
+
+  char path[] = "/tmp/libfilter-taffy-XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(static_cast<ssize_t>(x.SerializedBytes()),
+            write(fd, image, x.SerializedBytes()));
+  close(fd);
+  {
+    auto m = TaffyBlockFilterView::FromFile(path);
+    for (int i = 0; i < 100000; ++i) {
+      const uint64_t h = r();
+      ASSERT_EQ(x.FindHash(h), m.FindHash(h));
+    }
+  }
+  unlink(path);
+
+  EXPECT_THROW(TaffyBlockFilter::Deserialize(image, x.SerializedBytes() - 32),
+               std::invalid_argument);
+  EXPECT_THROW(TaffyBlockFilterView::FromBuffer(image + 8, x.SerializedBytes() - 8),
+               std::invalid_argument);
+}
+
+// Test that the batch Feistel permutation matches the scalar one at every width a taffy
+// cuckoo filter uses
+TEST(TaffyCuckooTest, FeistelBatch) {
+  Rand r;
+  const uint64_t entropy[4] = {r(), r(), r(), r()};
+  const libfilter_feistel f = libfilter_feistel_create(entropy);
+  for (int w = libfilter_taffy_cuckoo_head_size + 1; w < 64; ++w) {
+    for (int i = 0; i < 100; ++i) {
+      uint64_t x[4], out[4];
+      for (auto& y : x) y = libfilter_mask(w, r());
+      libfilter_feistel_permute_forward4(&f, w, x, out);
+      for (int j = 0; j < 4; ++j) {
+        ASSERT_EQ(libfilter_feistel_permute_forward(&f, w, x[j]), out[j]) << w;
+      }
+    }
+  }
+}
+
+// Test that the SWAR bucket tests agree with testing each slot on its own
+TEST(TaffyCuckooTest, BucketMatch) {
+  Rand r;
+  for (int i = 0; i < 1000000; ++i) {
+    libfilter_taffy_cuckoo_bucket b;
+    for (auto& slot : b.data) {
+      slot.fingerprint = r() % 4;
+      slot.tail = r();
+    }
+    libfilter_taffy_cuckoo_slot s;
+    s.fingerprint = r() % 4;
+    s.tail = r() | 1 << (r() % 6);
+    const uint64_t bucket = libfilter_taffy_cuckoo_bucket_load(&b);
+    const uint64_t empty = libfilter_taffy_cuckoo_bucket_empty(bucket);
+    const uint64_t match = libfilter_taffy_cuckoo_bucket_match(bucket, s);
+    for (int j = 0; j < libfilter_slots; ++j) {
+      const uint64_t flag = uint64_t{1} << (16 * j + 15);
+      const bool full = b.data[j].tail != 0;
+      ASSERT_EQ(!full, 0 != (empty & flag));
+      ASSERT_EQ(full && b.data[j].fingerprint == s.fingerprint &&
+                    libfilter_taffy_is_prefix_of(b.data[j].tail, s.tail),
+                0 != (match & flag));
+    }
+    ASSERT_EQ(0u, (empty | match) & ~uint64_t{0x8000800080008000});
+  }
+}
+
+// Test that finds see every stashed path, in the mutable and frozen filters, however
+// large the stash gets
+TEST(TaffyCuckooTest, Stash) {
+  Rand r;
+  auto x = TaffyCuckooFilter::CreateWithBytes(1 << 16);
+  vector<uint64_t> hashes(20000);
+  for (auto& h : hashes) h = r();
+  // Inserts upsize the filter once the stash holds more than a few paths, so the stash is
+  // filled after them.
+  for (size_t i = 0; i < hashes.size(); i += 2) x.InsertHash(hashes[i]);
+  for (size_t i = 1; i < hashes.size(); i += 2) {
+    libfilter_taffy_cuckoo_side* side = &x.b.sides[i % 4 / 2];
+    libfilter_taffy_cuckoo_stash_add(
+        side, libfilter_taffy_cuckoo_to_path(hashes[i], &side->f, x.b.log_side_size));
+  }
+  for (const auto& side : x.b.sides) {
+    EXPECT_GT(side.stash_size, 4000u);
+    for (size_t j = 1; j < side.stash_size; ++j) {
+      ASSERT_LE(side.stash[j - 1].bucket, side.stash[j].bucket);
+    }
+  }
+  auto y = x.Freeze();
+  for (auto h : hashes) {
+    ASSERT_TRUE(x.FindHash(h));
+    ASSERT_TRUE(y.FindHash(h));
+  }
+}
+
+// Test that batch inserts build the same filter as one-at-a-time inserts, through many
+// upsizes, and that batch finds agree with FindHash
+TEST(TaffyCuckooTest, Batch) {
+  Rand r;
+  vector<uint64_t> hashes(1 << 20);
+  for (auto& h : hashes) h = r();
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  auto y = TaffyCuckooFilter::CreateWithBytes(0);
+  const size_t half = hashes.size() / 2;
+  // Odd lengths exercise partial groups.
+  for (size_t i = 0; i < half; i += 1001) {
+    x.InsertHashBatch(&hashes[i], std::min<size_t>(1001, half - i));
+  }
+  for (size_t i = 0; i < half; ++i) y.InsertHash(hashes[i]);
+  EXPECT_EQ(x.SizeInBytes(), y.SizeInBytes());
+  vector<uint8_t> found(hashes.size());
+  x.FindHashBatch(hashes.data(), hashes.size(), found.data());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    const bool expected = y.FindHash(hashes[i]);
+    if (i < half) {
+      ASSERT_TRUE(expected);
+    }
+    ASSERT_EQ(expected, x.FindHash(hashes[i])) << i;
+    ASSERT_EQ(expected, found[i]) << i;
+  }
+}
+
+TEST(TaffyCuckooTest, IncrementalUpsize) {
+  Rand r;
+  vector<uint64_t> hashes(1 << 18);
+  for (auto& h : hashes) h = r();
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  x.SetIncremental(true);
+  bool migrated = false;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    x.InsertHash(hashes[i]);
+    if (x.b.migrating == nullptr) continue;
+    migrated = true;
+    if (i % 97 != 0) continue;
+    // Keys inserted before the upsize are found whether or not they have been moved yet
+    for (size_t j = 0; j <= i; j += 13) ASSERT_TRUE(x.FindHash(hashes[j])) << i << " " << j;
+    auto copy = x;
+    for (size_t j = 0; j <= i; j += 13) ASSERT_TRUE(copy.FindHash(hashes[j]));
+    if (i % (97 * 101) != 0) continue;
+    auto frozen = x.Freeze();
+    auto both = Union(x, TaffyCuckooFilter::CreateWithBytes(0));
+    for (size_t j = 0; j <= i; j += 13) {
+      ASSERT_TRUE(frozen.FindHash(hashes[j]));
+      ASSERT_TRUE(both.FindHash(hashes[j]));
+    }
+  }
+  EXPECT_TRUE(migrated);
+  vector<uint8_t> found(hashes.size());
+  x.FindHashBatch(hashes.data(), hashes.size(), found.data());
+  for (size_t i = 0; i < hashes.size(); ++i) ASSERT_TRUE(found[i]) << i;
+  x.SetIncremental(false);
+  EXPECT_EQ(nullptr, x.b.migrating);
+  for (size_t i = 0; i < hashes.size(); ++i) ASSERT_TRUE(x.FindHash(hashes[i])) << i;
+}
+
+TEST(TaffyCuckooTest, ParallelMerge) {
+  Rand r;
+  vector<uint64_t> hashes(1 << 19);
+  for (auto& h : hashes) h = r();
+  const size_t third = hashes.size() / 3;
+  auto x = TaffyCuckooFilter::CreateWithBytes(0);
+  auto y = TaffyCuckooFilter::CreateWithBytes(0);
+  for (size_t i = 0; i < third; ++i) x.InsertHash(hashes[i]);
+  y.SetIncremental(true);
+  for (size_t i = third; i < hashes.size(); ++i) y.InsertHash(hashes[i]);
+  for (int threads : {1, 3, 8}) {
+    auto u = Union(x, y, threads);
+    EXPECT_GE(u.b.log_side_size, y.b.log_side_size);
+    EXPECT_LE(u.b.sides[0].stash_size + u.b.sides[1].stash_size, 8u);
+    auto v = x;
+    v.Upsize(threads);
+    EXPECT_EQ(x.b.log_side_size + 1, v.b.log_side_size);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      ASSERT_TRUE(u.FindHash(hashes[i])) << threads << " " << i;
+      if (i < third) {
+        ASSERT_TRUE(v.FindHash(hashes[i])) << threads << " " << i;
+      }
+    }
+    // Upsized filters keep taking inserts
+    for (size_t i = third; i < hashes.size(); ++i) v.InsertHash(hashes[i]);
+    for (size_t i = 0; i < hashes.size(); ++i) ASSERT_TRUE(v.FindHash(hashes[i]));
+  }
+  EXPECT_THROW(Union(x, y, 0), std::invalid_argument);
+}
+
 TEST(FreezeTest, FreezeTest) {
   Rand r;
   vector<uint64_t> keys;
@@ -248,6 +821,146 @@ TEST(FreezeTest, FreezeTest) {
   }
 }
 
+// Test that batched frozen finds, stashes included, agree with one-at-a-time finds
+TEST(FreezeTest, FindHashBatch) {
+  Rand r;
+  auto x = TaffyCuckooFilter::CreateWithBytes(1 << 16);
+  vector<uint64_t> hashes(20000);
+  for (auto& h : hashes) h = r();
+  for (size_t i = 0; i < hashes.size(); i += 2) x.InsertHash(hashes[i]);
+  for (size_t i = 1; i < 40; i += 2) {
+    libfilter_taffy_cuckoo_side* side = &x.b.sides[i % 4 / 2];
+    libfilter_taffy_cuckoo_stash_add(
+        side, libfilter_taffy_cuckoo_to_path(hashes[i], &side->f, x.b.log_side_size));
+  }
+  const auto f = x.Freeze();
+  for (size_t i = 0; i < hashes.size(); i += 2) ASSERT_TRUE(f.FindHash(hashes[i]));
+  for (size_t i = 1; i < 40; i += 2) ASSERT_TRUE(f.FindHash(hashes[i]));
+  // Lengths that are not multiples of the batch width leave a partial last group
+  for (size_t n : {size_t{0}, size_t{1}, size_t{3}, size_t{4}, size_t{5}, hashes.size()}) {
+    vector<uint8_t> found(n + 1, 2);
+    f.FindHashBatch(hashes.data(), n, found.data());
+    for (size_t i = 0; i < n; ++i) ASSERT_EQ(f.FindHash(hashes[i]), found[i]) << n;
+    EXPECT_EQ(2, found[n]);
+  }
+}
+
+// Test that a frozen filter, stashes included, can be read back by copying or as a view
+TEST(FreezeTest, SerDe) {
+  Rand r;
+  auto x = TaffyCuckooFilter::CreateWithBytes(1 << 16);
+  vector<uint64_t> hashes(20000);
+  for (auto& h : hashes) h = r();
+  for (size_t i = 0; i < hashes.size(); i += 2) x.InsertHash(hashes[i]);
+  for (size_t i = 1; i < hashes.size(); i += 2) {
+    libfilter_taffy_cuckoo_side* side = &x.b.sides[i % 4 / 2];
+    libfilter_taffy_cuckoo_stash_add(
+        side, libfilter_taffy_cuckoo_to_path(hashes[i], &side->f, x.b.log_side_size));
+  }
+  const auto f = x.Freeze();
+  vector<uint64_t> buffer(f.SerializedBytes() / sizeof(uint64_t) + 1);
+  char* image = reinterpret_cast<char*>(buffer.data());
+  f.Serialize(image);
+
+  const auto y = FrozenTaffyCuckoo::Deserialize(image, f.SerializedBytes());
+  EXPECT_EQ(f.SerializedBytes(), y.SerializedBytes());
+  const auto v = FrozenTaffyCuckooView::FromBuffer(image, f.SerializedBytes());
+  for (auto h : hashes) {
+    ASSERT_TRUE(y.FindHash(h));
+    ASSERT_TRUE(v.FindHash(h));
+  }
+  for (int i = 0; i < 100000; ++i) {
+    const uint64_t h = r();
+    ASSERT_EQ(f.FindHash(h), y.FindHash(h));
+    ASSERT_EQ(f.FindHash(h), v.FindHash(h));
+  }
+  vector<uint8_t> found(hashes.size());
+  v.FindHashBatch(hashes.data(), hashes.size(), found.data());
+  for (auto b : found) ASSERT_TRUE(b);
+
+  char path[] = "/tmp/libfilter-frozen-XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(static_cast<ssize_t>(f.SerializedBytes()),
+            write(fd, image, f.SerializedBytes()));
+  close(fd);
+  {
+    const auto m = FrozenTaffyCuckooView::FromFile(path);
+    for (auto h : hashes) ASSERT_TRUE(m.FindHash(h));
+  }
+  unlink(path);
+
+  EXPECT_THROW(FrozenTaffyCuckoo::Deserialize(image, f.SerializedBytes() - 5),
+               std::invalid_argument);
+  EXPECT_THROW(FrozenTaffyCuckooView::FromBuffer(image + 4, f.SerializedBytes() - 4),
+               std::invalid_argument);
+  // Unsorted stashes would break the binary search
+  std::swap(buffer[12], buffer[13]);
+  EXPECT_THROW(FrozenTaffyCuckoo::Deserialize(image, f.SerializedBytes()),
+               std::invalid_argument);
+}
+
+// Test that a thawed filter, stashes included, still has everything and can keep growing
+TEST(FreezeTest, Thaw) {
+  Rand r;
+  auto x = TaffyCuckooFilter::CreateWithBytes(1 << 16);
+  vector<uint64_t> hashes(10000);
+  for (auto& h : hashes) {
+    h = r();
+    x.InsertHash(h);
+  }
+  for (int i = 0; i < 20; ++i) {
+    hashes.push_back(r());
+    libfilter_taffy_cuckoo_side* side = &x.b.sides[i % 2];
+    libfilter_taffy_cuckoo_stash_add(side, libfilter_taffy_cuckoo_to_path(
+                                               hashes.back(), &side->f, x.b.log_side_size));
+  }
+  auto y = TaffyCuckooFilter::Thaw(x.Freeze());
+  EXPECT_EQ(x.b.log_side_size, y.b.log_side_size);
+  for (auto h : hashes) ASSERT_TRUE(y.FindHash(h));
+  for (int i = 0; i < 200000; ++i) {
+    hashes.push_back(r());
+    y.InsertHash(hashes.back());
+  }
+  EXPECT_GT(y.b.log_side_size, x.b.log_side_size);
+  const auto f = y.Freeze();
+  for (auto h : hashes) {
+    ASSERT_TRUE(y.FindHash(h));
+    ASSERT_TRUE(f.FindHash(h));
+  }
+
+  static const uint64_t kEntropy[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  const TaffyCuckooFilter z{libfilter_taffy_cuckoo_create(4, kEntropy)};
+  EXPECT_THROW(TaffyCuckooFilter::Thaw(z.Freeze()), std::invalid_argument);
+  libfilter_taffy_cuckoo w;
+  const auto g = z.Freeze();
+  ASSERT_EQ(0, libfilter_frozen_taffy_cuckoo_thaw(&g.b, kEntropy, &w));
+  libfilter_taffy_cuckoo_destruct(&w);
+}
+
+// Test that building a static filter with threads gives the same filter as without
+TEST(StaticTest, Threads) {
+  struct Bytes : StaticFilter {
+    using StaticFilter::StaticFilter;
+    std::string Get() const {
+      return std::string(reinterpret_cast<const char*>(payload_.region_.block),
+                         payload_.length_);
+    }
+  };
+  Rand r;
+  for (size_t n : {size_t{100}, size_t{200000}}) {
+    vector<uint64_t> hashes(n);
+    for (auto& h : hashes) h = r();
+    const Bytes serial(n, hashes.data());
+    for (int threads : {1, 2, 5}) {
+      Bytes x(n, hashes.data(), threads);
+      EXPECT_EQ(serial.Get(), x.Get()) << n << ", " << threads;
+      for (auto h : hashes) ASSERT_TRUE(x.FindHash(h));
+    }
+  }
+  EXPECT_THROW(StaticFilter(1, nullptr, 0), std::invalid_argument);
+}
+
 TEST(SerDeTest, SerDeTest) {
   Rand r;
   for (size_t size = 1; size < 1 << 20; size *= 2) {
@@ -260,6 +973,115 @@ TEST(SerDeTest, SerDeTest) {
   }
 }
 
+TEST(SerDeTest, SerializeRangeTest) {
+  Rand r;
+  auto f = BlockFilter::CreateWithNdvFpp(1 << 12, 0.01);
+  for (int i = 0; i < 1 << 12; ++i) f.InsertHash(r());
+  vector<char> whole(f.SizeInBytes());
+  f.Serialize(whole.data());
+  // Chunks that start and end in the middle of words
+  for (uint64_t chunk : {1, 3, 32, 1000}) {
+    vector<char> pieces(f.SizeInBytes());
+    for (uint64_t i = 0; i < f.SizeInBytes(); i += chunk) {
+      f.SerializeRange(i, std::min(chunk, f.SizeInBytes() - i), &pieces[i]);
+    }
+    EXPECT_TRUE(whole == pieces) << chunk;
+  }
+  EXPECT_THROW(f.SerializeRange(f.SizeInBytes() - 1, 2, whole.data()), std::out_of_range);
+}
+
+TEST(SerDeTest, ViewTest) {
+  Rand r;
+  auto f = BlockFilter::CreateWithNdvFpp(1 << 14, 0.01);
+  vector<uint64_t> hashes(1 << 14);
+  for (auto& h : hashes) {
+    h = r();
+    f.InsertHash(h);
+  }
+  // Over-allocate so the image can start on a 32-byte boundary
+  vector<char> buffer(f.SerializedViewBytes() + 32);
+  char* image = buffer.data() + (32 - reinterpret_cast<uintptr_t>(buffer.data()) % 32);
+  f.SerializeView(image);
+
+  auto v = BlockFilterView::FromBuffer(image, f.SerializedViewBytes());
+  EXPECT_EQ(f.SizeInBytes(), v.SizeInBytes());
+  vector<uint8_t> found(hashes.size());
+  v.FindHashBatch(hashes.data(), hashes.size(), found.data());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    EXPECT_TRUE(v.FindHash(hashes[i]));
+    EXPECT_TRUE(found[i]);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    const uint64_t h = r();
+    EXPECT_EQ(f.FindHash(h), v.FindHash(h));
+  }
+
+  char path[] = "/tmp/libfilter-view-XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(static_cast<ssize_t>(f.SerializedViewBytes()),
+            write(fd, image, f.SerializedViewBytes()));
+  close(fd);
+  {
+    auto m = BlockFilterView::FromFile(path);
+    for (auto h : hashes) EXPECT_TRUE(m.FindHash(h));
+  }
+
+  // A truncated file, a misaligned buffer, and a corrupted header are all rejected.
+  ASSERT_EQ(0, truncate(path, f.SerializedViewBytes() - 32));
+  EXPECT_THROW(BlockFilterView::FromFile(path), std::runtime_error);
+  unlink(path);
+  EXPECT_THROW(BlockFilterView::FromBuffer(image + 1, f.SerializedViewBytes() - 1),
+               std::invalid_argument);
+  image[0] ^= 1;
+  EXPECT_THROW(BlockFilterView::FromBuffer(image, f.SerializedViewBytes()),
+               std::invalid_argument);
+}
+
+// Fills the stack below the caller with garbage, so that whatever a failed open leaves
+// uninitialized is garbage too
+__attribute__((noinline)) static void DirtyStack() {
+  volatile char garbage[1 << 14];
+  for (auto& c : garbage) c = 0x41;
+}
+
+TEST(SerDeTest, ViewBadImage) {
+  alignas(64) char image[4096];
+  memset(image, 0x41, sizeof(image));
+  DirtyStack();
+  EXPECT_THROW(BlockFilterView::FromBuffer(image, sizeof(image)), std::invalid_argument);
+  DirtyStack();
+  EXPECT_THROW(BlockFilterView::FromBuffer(image, 0), std::invalid_argument);
+
+  char path[] = "/tmp/libfilter-view-XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(image)), write(fd, image, sizeof(image)));
+  close(fd);
+  DirtyStack();
+  EXPECT_THROW(BlockFilterView::FromFile(path), std::runtime_error);
+  DirtyStack();
+  EXPECT_THROW(TaffyBlockFilterView::FromFile(path), std::runtime_error);
+  DirtyStack();
+  EXPECT_THROW(FrozenTaffyCuckooView::FromFile(path), std::runtime_error);
+  unlink(path);
+  DirtyStack();
+  EXPECT_THROW(BlockFilterView::FromFile(path), std::runtime_error);
+  DirtyStack();
+  EXPECT_THROW(TaffyBlockFilterView::FromFile(path), std::runtime_error);
+  DirtyStack();
+  EXPECT_THROW(FrozenTaffyCuckooView::FromFile(path), std::runtime_error);
+
+  DirtyStack();
+  EXPECT_THROW(TaffyBlockFilterView::FromBuffer(image, sizeof(image)),
+               std::invalid_argument);
+  DirtyStack();
+  EXPECT_THROW(FrozenTaffyCuckooView::FromBuffer(image, sizeof(image)),
+               std::invalid_argument);
+  DirtyStack();
+  EXPECT_THROW(TaffyBlockFilter::Deserialize(image, sizeof(image)), std::invalid_argument);
+}
+
 TEST(SerDeTest, JavaSerDeTest) {
   JavaVM* jvm = nullptr;
   JNIEnv* env = nullptr;
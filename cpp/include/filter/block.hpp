@@ -7,9 +7,11 @@ extern "C" {
 }
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <new>
 #include <stdexcept>
+#include <utility>
 
 namespace filter {
 
@@ -38,6 +40,10 @@ class GenericBF {
     }
   };
 
+  // Takes ownership of payload, which must have been initialized by the C library, as
+  // by libfilter_block_init
+  explicit GenericBF(const libfilter_block& payload) : payload_(payload) {}
+
   GenericBF(const GenericBF& that) {
     if (0 != libfilter_block_clone(&that.payload_, &payload_)) throw std::bad_alloc();
   }
@@ -65,6 +71,24 @@ class GenericBF {
     return libfilter_block_equals(&this->payload_, &that.payload_);
   }
 
+  // Afterwards, this finds every hash value that either this or that found before. Throws
+  // std::invalid_argument if the filters are not the same size.
+  GenericBF& operator|=(const GenericBF& that) {
+    if (0 != libfilter_block_union(&payload_, &that.payload_)) {
+      throw std::invalid_argument("libfilter_block_union");
+    }
+    return *this;
+  }
+
+  // Afterwards, this finds every hash value that was added to both this and that. Throws
+  // std::invalid_argument if the filters are not the same size.
+  GenericBF& operator&=(const GenericBF& that) {
+    if (0 != libfilter_block_intersect(&payload_, &that.payload_)) {
+      throw std::invalid_argument("libfilter_block_intersect");
+    }
+    return *this;
+  }
+
   // TODO: why passing hash bits twice?
   static double FalsePositiveProbability(uint64_t ndv, uint64_t bytes) {
     return libfilter_block_fpp(ndv, bytes);
@@ -91,6 +115,19 @@ class GenericBF {
     libfilter_block_serialize(&payload_, to);
   }
 
+  // Writes bytes [offset, offset + len) of what Serialize would write. See
+  // libfilter_block_serialize_range.
+  void SerializeRange(uint64_t offset, uint64_t len, char* to) const {
+    if (0 != libfilter_block_serialize_range(&payload_, offset, len, to)) {
+      throw std::out_of_range("libfilter_block_serialize_range");
+    }
+  }
+
+  // Writes the filter in the format BlockFilterView reads. See
+  // libfilter_block_serialize_view.
+  uint64_t SerializedViewBytes() const { return libfilter_block_view_bytes(&payload_); }
+  void SerializeView(char* to) const { libfilter_block_serialize_view(&payload_, to); }
+
   static GenericBF Deserialize(uint64_t size_in_bytes, const char* from) {
     GenericBF result{size_in_bytes};
     result.~GenericBF();
@@ -98,6 +135,14 @@ class GenericBF {
     return result;
   }
 
+  // Inserts n hashes, partitioning them by bucket first. See
+  // libfilter_block_add_hash_batch_partitioned.
+  void InsertHashBatchPartitioned(const uint64_t* hashes, size_t n) {
+    if (0 != libfilter_block_add_hash_batch_partitioned(hashes, n, &payload_)) {
+      throw std::bad_alloc();
+    }
+  }
+
   static GenericBF DeserializeFromInts(uint64_t size_in_ints, const int32_t* from) {
     GenericBF result{size_in_ints * sizeof(int32_t)};
     result.~GenericBF();
@@ -107,11 +152,24 @@ class GenericBF {
 };
 
 template <void (*INSERT_HASH)(uint64_t, libfilter_block*),
-          bool (*FIND_HASH)(uint64_t, const libfilter_block*)>
+          bool (*FIND_HASH)(uint64_t, const libfilter_block*),
+          void (*FIND_HASH_BATCH)(const uint64_t*, size_t, uint8_t*,
+                                  const libfilter_block*),
+          void (*INSERT_HASH_BATCH)(const uint64_t*, size_t, libfilter_block*)>
 struct SpecificBF : GenericBF {
  public:
   bool InsertHash(uint64_t hash) { INSERT_HASH(hash, &payload_); return true; }
   bool FindHash(uint64_t hash) const { return FIND_HASH(hash, &payload_); }
+  // Sets out[i] to FindHash(hashes[i]) for each i < n, but with the memory accesses
+  // pipelined. See libfilter_block_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    FIND_HASH_BATCH(hashes, n, out, &payload_);
+  }
+  // Equivalent to calling InsertHash on each of the n hashes, but with the memory accesses
+  // pipelined. See libfilter_block_add_hash_batch.
+  void InsertHashBatch(const uint64_t* hashes, size_t n) {
+    INSERT_HASH_BATCH(hashes, n, &payload_);
+  }
   SpecificBF(GenericBF&& x) : GenericBF(std::move(x)) {}
   SpecificBF& operator=(GenericBF&& that) {
     (GenericBF&)*this = std::move(that);
@@ -130,13 +188,17 @@ struct SpecificBF : GenericBF {
 }  // namespace detail
 
 struct ScalarBlockFilter : detail::SpecificBF<libfilter_block_scalar_add_hash,
-                                              libfilter_block_scalar_find_hash> {
+                                              libfilter_block_scalar_find_hash,
+                                              libfilter_block_scalar_find_hash_batch,
+                                              libfilter_block_scalar_add_hash_batch> {
   static const char* Name() {
     static const char NAME[] = "ScalarBlockFilter";
     return NAME;
   }
   using Parent = detail::SpecificBF<libfilter_block_scalar_add_hash,
-                                    libfilter_block_scalar_find_hash>;
+                                    libfilter_block_scalar_find_hash,
+                                    libfilter_block_scalar_find_hash_batch,
+                                    libfilter_block_scalar_add_hash_batch>;
   ScalarBlockFilter(detail::GenericBF&& x) : Parent(std::move(x)) {}
   ScalarBlockFilter& operator=(GenericBF&& that) {
     (Parent&)* this = std::move(that);
@@ -154,16 +216,82 @@ struct ScalarBlockFilter : detail::SpecificBF<libfilter_block_scalar_add_hash,
   }
 };
 
+// Uses the fastest kernels the CPU running the program supports, chosen at run time. See
+// libfilter_block_runtime_isa.
+struct RuntimeBlockFilter
+    : detail::SpecificBF<libfilter_block_runtime_add_hash,
+                         libfilter_block_runtime_find_hash,
+                         libfilter_block_runtime_find_hash_batch,
+                         libfilter_block_runtime_add_hash_batch> {
+  static const char* Name() {
+    static const char NAME[] = "RuntimeBlockFilter";
+    return NAME;
+  }
+  using Parent = detail::SpecificBF<libfilter_block_runtime_add_hash,
+                                    libfilter_block_runtime_find_hash,
+                                    libfilter_block_runtime_find_hash_batch,
+                                    libfilter_block_runtime_add_hash_batch>;
+  RuntimeBlockFilter(detail::GenericBF&& x) : Parent(std::move(x)) {}
+  static constexpr bool is_simd = true;
+  using Scalar = ScalarBlockFilter;
+  RuntimeBlockFilter& operator=(GenericBF&& that) {
+    (Parent&)* this = std::move(that);
+    return *this;
+  }
+  static RuntimeBlockFilter CreateWithBytes(uint64_t bytes) {
+    return GenericBF::CreateWithBytes(bytes);
+  }
+  static RuntimeBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return GenericBF::CreateWithNdvFpp(ndv, fpp);
+  }
+};
+
+// InsertHash and InsertHashBatch may be called from many threads at once, and
+// concurrently with FindHash and FindHashBatch. Inserts are visible to other threads once
+// those threads synchronize with the inserting thread, as by std::thread::join. All other
+// operations, including copying, are not thread-safe.
+struct ConcurrentBlockFilter
+    : detail::SpecificBF<libfilter_block_add_hash_atomic, libfilter_block_find_hash,
+                         libfilter_block_find_hash_batch,
+                         libfilter_block_add_hash_batch_atomic> {
+  static const char* Name() {
+    static const char NAME[] = "ConcurrentBlockFilter";
+    return NAME;
+  }
+  using Parent = detail::SpecificBF<libfilter_block_add_hash_atomic,
+                                    libfilter_block_find_hash,
+                                    libfilter_block_find_hash_batch,
+                                    libfilter_block_add_hash_batch_atomic>;
+  ConcurrentBlockFilter(detail::GenericBF&& x) : Parent(std::move(x)) {}
+  static constexpr bool is_simd = true;
+  using Scalar = ScalarBlockFilter;
+  ConcurrentBlockFilter& operator=(GenericBF&& that) {
+    (Parent&)* this = std::move(that);
+    return *this;
+  }
+  static ConcurrentBlockFilter CreateWithBytes(uint64_t bytes) {
+    return GenericBF::CreateWithBytes(bytes);
+  }
+  static ConcurrentBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return GenericBF::CreateWithNdvFpp(ndv, fpp);
+  }
+};
+
 #if defined(LIBFILTER_BLOCK_SIMD)
 
 struct SimdBlockFilter
-    : detail::SpecificBF<libfilter_block_simd_add_hash, libfilter_block_simd_find_hash> {
+    : detail::SpecificBF<libfilter_block_simd_add_hash, libfilter_block_simd_find_hash,
+                         libfilter_block_simd_find_hash_batch,
+                         libfilter_block_simd_add_hash_batch> {
   static const char* Name() {
     static const char NAME[] = "SimdBlockFilter";
     return NAME;
   }
   // static constexpr char NAME[] = "SimdBlockFilter";
-  using Parent = detail::SpecificBF<libfilter_block_simd_add_hash, libfilter_block_simd_find_hash>;
+  using Parent = detail::SpecificBF<libfilter_block_simd_add_hash,
+                                    libfilter_block_simd_find_hash,
+                                    libfilter_block_simd_find_hash_batch,
+                                    libfilter_block_simd_add_hash_batch>;
   SimdBlockFilter(detail::GenericBF&& x) : Parent(std::move(x)) {}
   static constexpr bool is_simd = true;
   using Scalar = ScalarBlockFilter;
@@ -183,8 +311,96 @@ struct SimdBlockFilter
 
 using BlockFilter = SimdBlockFilter;
 
+#if defined(LIBFILTER_BLOCK_AVX512)
+
+// Interchangeable with SimdBlockFilter, but with batch operations that work on two hash
+// values per instruction.
+struct Avx512BlockFilter
+    : detail::SpecificBF<libfilter_block_avx512_add_hash, libfilter_block_avx512_find_hash,
+                         libfilter_block_avx512_find_hash_batch,
+                         libfilter_block_avx512_add_hash_batch> {
+  static const char* Name() {
+    static const char NAME[] = "Avx512BlockFilter";
+    return NAME;
+  }
+  using Parent = detail::SpecificBF<libfilter_block_avx512_add_hash,
+                                    libfilter_block_avx512_find_hash,
+                                    libfilter_block_avx512_find_hash_batch,
+                                    libfilter_block_avx512_add_hash_batch>;
+  Avx512BlockFilter(detail::GenericBF&& x) : Parent(std::move(x)) {}
+  static constexpr bool is_simd = true;
+  using Scalar = ScalarBlockFilter;
+  Avx512BlockFilter& operator=(GenericBF&& that) {
+    (Parent&)* this = std::move(that);
+    return *this;
+  }
+  static Avx512BlockFilter CreateWithBytes(uint64_t bytes) {
+    return GenericBF::CreateWithBytes(bytes);
+  }
+  static Avx512BlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return GenericBF::CreateWithNdvFpp(ndv, fpp);
+  }
+};
+
+#endif
+
 #else
 using BlockFilter = ScalarBlockFilter;
 #endif
 
+// A read-only filter over an image written by SerializeView, either in a buffer the caller
+// owns or in a file mapped into memory. Nothing is copied, so a view of a large filter
+// can be opened without reading it all in. See libfilter_block_view_init.
+class BlockFilterView {
+  libfilter_block_view payload_{};
+
+  BlockFilterView() = default;
+
+ public:
+  using uint64_t = std::uint64_t;
+
+  // from must be 32-byte aligned and must outlive the view
+  static BlockFilterView FromBuffer(const void* from, uint64_t bytes) {
+    BlockFilterView result;
+    if (0 != libfilter_block_view_init(from, bytes, &result.payload_)) {
+      throw std::invalid_argument("libfilter_block_view_init");
+    }
+    return result;
+  }
+  static BlockFilterView FromFile(const char* path) {
+    BlockFilterView result;
+    if (0 != libfilter_block_view_map(path, &result.payload_)) {
+      throw std::runtime_error("libfilter_block_view_map");
+    }
+    return result;
+  }
+
+  BlockFilterView(const BlockFilterView&) = delete;
+  BlockFilterView& operator=(const BlockFilterView&) = delete;
+  BlockFilterView(BlockFilterView&& that) : payload_(that.payload_) {
+    that.payload_.mapping = nullptr;
+    libfilter_block_zero_out(&that.payload_.filter);
+  }
+  BlockFilterView& operator=(BlockFilterView&& that) {
+    std::swap(payload_, that.payload_);
+    return *this;
+  }
+  ~BlockFilterView() {
+    // TODO: this swallows an error when return value is negative
+    libfilter_block_view_destruct(&payload_);
+  }
+
+  uint64_t SizeInBytes() const {
+    return libfilter_block_size_in_bytes(&payload_.filter);
+  }
+  bool FindHash(uint64_t hash) const {
+    return libfilter_block_runtime_find_hash(hash, &payload_.filter);
+  }
+  // Sets out[i] to FindHash(hashes[i]) for each i < n. See
+  // libfilter_block_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_block_runtime_find_hash_batch(hashes, n, out, &payload_.filter);
+  }
+};
+
 }  // namespace filter
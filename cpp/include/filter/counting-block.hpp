@@ -0,0 +1,135 @@
+// C++ wrapper around counting-block.h.
+
+#pragma once
+
+extern "C" {
+#include "filter/counting-block.h"
+}
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace filter {
+
+namespace detail {
+
+template <void (*INSERT_HASH)(uint64_t, libfilter_counting_block*),
+          bool (*REMOVE_HASH)(uint64_t, libfilter_counting_block*),
+          bool (*FIND_HASH)(uint64_t, const libfilter_counting_block*)>
+class CountingBF {
+ protected:
+  libfilter_counting_block payload_;
+  using uint64_t = std::uint64_t;
+
+  explicit CountingBF(uint64_t bytes) {
+    if (0 != libfilter_counting_block_init(bytes, &payload_)) {
+      throw std::runtime_error("libfilter_counting_block_init");
+    }
+  }
+
+ public:
+  CountingBF(const CountingBF& that) {
+    if (0 != libfilter_counting_block_clone(&that.payload_, &payload_)) {
+      throw std::bad_alloc();
+    }
+  }
+  CountingBF& operator=(const CountingBF& that) {
+    CountingBF copy(that);
+    std::swap(payload_, copy.payload_);
+    return *this;
+  }
+  CountingBF(CountingBF&& that) : payload_(that.payload_) {
+    libfilter_counting_block_zero_out(&that.payload_);
+  }
+  CountingBF& operator=(CountingBF&& that) {
+    std::swap(payload_, that.payload_);
+    return *this;
+  }
+  ~CountingBF() {
+    // TODO: this swallows an error when return value is negative
+    libfilter_counting_block_destruct(&payload_);
+  }
+
+  bool operator==(const CountingBF& that) const {
+    return libfilter_counting_block_equals(&payload_, &that.payload_);
+  }
+
+  uint64_t SizeInBytes() const { return libfilter_counting_block_size_in_bytes(&payload_); }
+  bool InsertHash(uint64_t hash) { INSERT_HASH(hash, &payload_); return true; }
+  // Returns false, and does nothing, if the hash is not found. See
+  // libfilter_counting_block_remove_hash.
+  bool RemoveHash(uint64_t hash) { return REMOVE_HASH(hash, &payload_); }
+  bool FindHash(uint64_t hash) const { return FIND_HASH(hash, &payload_); }
+
+  static double FalsePositiveProbability(uint64_t ndv, uint64_t bytes) {
+    return libfilter_counting_block_fpp(ndv, bytes);
+  }
+  static uint64_t MinSpaceNeeded(uint64_t ndv, double fpp) {
+    return libfilter_counting_block_bytes_needed(ndv, fpp);
+  }
+  static uint64_t MaxCapacity(uint64_t bytes, double fpp) {
+    return libfilter_counting_block_capacity(bytes, fpp);
+  }
+};
+
+}  // namespace detail
+
+struct ScalarCountingBlockFilter
+    : detail::CountingBF<libfilter_counting_block_scalar_add_hash,
+                         libfilter_counting_block_scalar_remove_hash,
+                         libfilter_counting_block_scalar_find_hash> {
+  static const char* Name() {
+    static const char NAME[] = "ScalarCountingBlockFilter";
+    return NAME;
+  }
+  static constexpr bool is_simd = false;
+  using Scalar = ScalarCountingBlockFilter;
+  static ScalarCountingBlockFilter CreateWithBytes(uint64_t bytes) {
+    return ScalarCountingBlockFilter(bytes);
+  }
+  static ScalarCountingBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return CreateWithBytes(MinSpaceNeeded(ndv, fpp));
+  }
+
+ private:
+  using Parent = detail::CountingBF<libfilter_counting_block_scalar_add_hash,
+                                    libfilter_counting_block_scalar_remove_hash,
+                                    libfilter_counting_block_scalar_find_hash>;
+  explicit ScalarCountingBlockFilter(uint64_t bytes) : Parent(bytes) {}
+};
+
+#if defined(LIBFILTER_COUNTING_BLOCK_SIMD)
+
+struct SimdCountingBlockFilter
+    : detail::CountingBF<libfilter_counting_block_simd_add_hash,
+                         libfilter_counting_block_simd_remove_hash,
+                         libfilter_counting_block_simd_find_hash> {
+  static const char* Name() {
+    static const char NAME[] = "SimdCountingBlockFilter";
+    return NAME;
+  }
+  static constexpr bool is_simd = true;
+  using Scalar = ScalarCountingBlockFilter;
+  static SimdCountingBlockFilter CreateWithBytes(uint64_t bytes) {
+    return SimdCountingBlockFilter(bytes);
+  }
+  static SimdCountingBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return CreateWithBytes(MinSpaceNeeded(ndv, fpp));
+  }
+
+ private:
+  using Parent = detail::CountingBF<libfilter_counting_block_simd_add_hash,
+                                    libfilter_counting_block_simd_remove_hash,
+                                    libfilter_counting_block_simd_find_hash>;
+  explicit SimdCountingBlockFilter(uint64_t bytes) : Parent(bytes) {}
+};
+
+using CountingBlockFilter = SimdCountingBlockFilter;
+
+#else
+using CountingBlockFilter = ScalarCountingBlockFilter;
+#endif
+
+}  // namespace filter
@@ -4,7 +4,13 @@ extern "C" {
 #include "filter/static.h"
 }
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 namespace filter {
 
@@ -14,7 +20,25 @@ struct StaticFilter {
 
  public:
   StaticFilter(size_t n, const uint64_t* hashes)
-      : payload_(libfilter_static_construct(n, hashes)) {}
+      : payload_(libfilter_static_construct(n, hashes)) {
+    if (payload_.region_.block == nullptr) throw std::bad_alloc();
+  }
+
+  // Builds the filter with the given number of threads. The result is the same for any
+  // number of threads. See libfilter_static_builder_init.
+  StaticFilter(size_t n, const uint64_t* hashes, int threads) {
+    libfilter_static_builder b;
+    if (0 != libfilter_static_builder_init(n, hashes, threads, &b)) {
+      throw std::invalid_argument("libfilter_static_builder_init");
+    }
+    libfilter_static_builder_set_partitioned(&b, true);
+    if (threads == 1) {
+      while (libfilter_static_builder_next(&b)) libfilter_static_builder_step(&b, 0);
+    } else {
+      BuildOnWorkers(&b, threads);
+    }
+    payload_ = libfilter_static_builder_finish(&b);
+  }
 
   ~StaticFilter() { libfilter_static_destruct(payload_); }
 
@@ -47,6 +71,48 @@ struct StaticFilter {
   }
 
   size_t SizeInBytes() const { return payload_.length_; }
+
+ private:
+  // Runs every phase of b, with shard 0 on this thread and the others on threads - 1
+  // workers. The workers are started once and wait for each phase to start.
+  static void BuildOnWorkers(libfilter_static_builder* b, int threads) {
+    std::mutex m;
+    std::condition_variable cv;
+    uint64_t phase = 0;  // the number of phases started
+    int running = 0;     // the number of workers still in the current phase
+    bool done = false;
+    auto work = [&](int shard) {
+      for (uint64_t seen = 0;; ++seen) {
+        {
+          std::unique_lock<std::mutex> lock(m);
+          cv.wait(lock, [&] { return done || phase > seen; });
+          if (done) return;
+        }
+        libfilter_static_builder_step(b, shard);
+        std::lock_guard<std::mutex> lock(m);
+        if (--running == 0) cv.notify_all();
+      }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) workers.emplace_back(work, i);
+    while (libfilter_static_builder_next(b)) {
+      {
+        std::lock_guard<std::mutex> lock(m);
+        running = threads - 1;
+        ++phase;
+      }
+      cv.notify_all();
+      libfilter_static_builder_step(b, 0);
+      std::unique_lock<std::mutex> lock(m);
+      cv.wait(lock, [&] { return running == 0; });
+    }
+    {
+      std::lock_guard<std::mutex> lock(m);
+      done = true;
+    }
+    cv.notify_all();
+    for (auto& w : workers) w.join();
+  }
 };
 
 }  // namespace filter
@@ -1,15 +1,19 @@
+#include <cstddef>
 #include <cstdint>
 #include <new>
+#include <stdexcept>
 #include <utility>
 
 extern "C" {
 #include "filter/taffy-block.h"
 }
 
+#include "filter/block.hpp"
+
 namespace filter {
 
 struct TaffyBlockFilter {
-  libfilter_taffy_block data;
+  libfilter_taffy_block data{};
   TaffyBlockFilter(const TaffyBlockFilter& that) {
     if (0 != libfilter_taffy_block_clone(&that.data, &data)) throw std::bad_alloc();
   }
@@ -21,6 +25,9 @@ struct TaffyBlockFilter {
   TaffyBlockFilter(TaffyBlockFilter&& that)
       : data(that.data) {
     for (int i = 0; i < 48; ++i) libfilter_block_zero_out(&that.data.levels[i]);
+    that.data.cursor = 0;
+    that.data.num_arenas = 0;
+    that.data.arena_levels = 0;
   }
   TaffyBlockFilter& operator=(TaffyBlockFilter&& that) {
     this->~TaffyBlockFilter();
@@ -35,9 +42,25 @@ struct TaffyBlockFilter {
     return result;
   }
 
+  // Reads a filter written by Serialize. Throws std::invalid_argument if the image is
+  // invalid. See libfilter_taffy_block_deserialize.
+  static TaffyBlockFilter Deserialize(const char* from, uint64_t bytes) {
+    TaffyBlockFilter result;
+    if (0 != libfilter_taffy_block_deserialize(from, bytes, &result.data)) {
+      throw std::invalid_argument("libfilter_taffy_block_deserialize");
+    }
+    return result;
+  }
+
  private:
+  // Owns a block filter made by libfilter_taffy_block_compact
+  struct Compacted : detail::GenericBF {
+    explicit Compacted(const libfilter_block& payload) : GenericBF(payload) {}
+  };
+
+  TaffyBlockFilter() = default;
   TaffyBlockFilter(uint64_t ndv, double fpp) {
-    libfilter_taffy_block_init(ndv, fpp, &data);
+    if (0 != libfilter_taffy_block_init(ndv, fpp, &data)) throw std::bad_alloc();
   }
 
   public:
@@ -47,7 +70,106 @@ struct TaffyBlockFilter {
 
   bool FindHash(uint64_t h) const { return libfilter_taffy_block_find_hash(&data, h); }
 
+  uint64_t SerializedBytes() const { return libfilter_taffy_block_serialized_bytes(&data); }
+  void Serialize(char* to) const { libfilter_taffy_block_serialize(&data, to); }
+
+  // Sets out[i] to FindHash(hashes[i]) for each i < n. See
+  // libfilter_taffy_block_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_taffy_block_find_hash_batch(&data, hashes, n, out);
+  }
+
+  // Returns a single-level filter that finds every hash value this one does, with false
+  // positive probability about fpp. See libfilter_taffy_block_compact: if hashes is
+  // nullptr, the levels are folded together, which throws std::runtime_error if their
+  // sizes do not allow it, as once this filter has grown.
+  BlockFilter Compact(double fpp, const uint64_t* hashes = nullptr, size_t n = 0) const {
+    libfilter_block payload;
+    if (0 != libfilter_taffy_block_compact(&data, fpp, hashes, n, &payload)) {
+      throw std::runtime_error("libfilter_taffy_block_compact");
+    }
+    return BlockFilter(Compacted(payload));
+  }
+
   static const char* Name() { return "TaffyBlock"; }
 };
 
+// A taffy block filter whose InsertHash is safe to call from many threads at once, and
+// concurrently with FindHash and FindHashBatch. See
+// libfilter_taffy_block_add_hash_atomic. The TaffyBlockFilter base is private, so that
+// no caller can reach the non-atomic InsertHash through a reference to it.
+struct ConcurrentTaffyBlockFilter : private TaffyBlockFilter {
+  static ConcurrentTaffyBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return ConcurrentTaffyBlockFilter(TaffyBlockFilter::CreateWithNdvFpp(ndv, fpp));
+  }
+
+  using TaffyBlockFilter::data;
+  using TaffyBlockFilter::SizeInBytes;
+  using TaffyBlockFilter::FindHash;
+  using TaffyBlockFilter::FindHashBatch;
+  using TaffyBlockFilter::SerializedBytes;
+  using TaffyBlockFilter::Serialize;
+  using TaffyBlockFilter::Compact;
+
+  bool InsertHash(uint64_t h) { return libfilter_taffy_block_add_hash_atomic(&data, h); }
+
+  static const char* Name() { return "ConcurrentTaffyBlock"; }
+
+ private:
+  explicit ConcurrentTaffyBlockFilter(TaffyBlockFilter&& that)
+      : TaffyBlockFilter(std::move(that)) {}
+};
+
+// A read-only filter over an image written by TaffyBlockFilter::Serialize, either in a
+// buffer the caller owns or in a file mapped into memory, with no copy. See
+// libfilter_taffy_block_view_init.
+class TaffyBlockFilterView {
+  libfilter_taffy_block_view payload_{};
+
+  TaffyBlockFilterView() = default;
+
+ public:
+  // from must be 32-byte aligned and must outlive the view
+  static TaffyBlockFilterView FromBuffer(const void* from, uint64_t bytes) {
+    TaffyBlockFilterView result;
+    if (0 != libfilter_taffy_block_view_init(from, bytes, &result.payload_)) {
+      throw std::invalid_argument("libfilter_taffy_block_view_init");
+    }
+    return result;
+  }
+  static TaffyBlockFilterView FromFile(const char* path) {
+    TaffyBlockFilterView result;
+    if (0 != libfilter_taffy_block_view_map(path, &result.payload_)) {
+      throw std::runtime_error("libfilter_taffy_block_view_map");
+    }
+    return result;
+  }
+
+  TaffyBlockFilterView(const TaffyBlockFilterView&) = delete;
+  TaffyBlockFilterView& operator=(const TaffyBlockFilterView&) = delete;
+  TaffyBlockFilterView(TaffyBlockFilterView&& that) : payload_(that.payload_) {
+    that.payload_.mapping = nullptr;
+  }
+  TaffyBlockFilterView& operator=(TaffyBlockFilterView&& that) {
+    std::swap(payload_, that.payload_);
+    return *this;
+  }
+  ~TaffyBlockFilterView() {
+    // TODO: this swallows an error when return value is negative
+    libfilter_taffy_block_view_destruct(&payload_);
+  }
+
+  uint64_t SizeInBytes() const {
+    return libfilter_taffy_block_size_in_bytes(&payload_.filter);
+  }
+  bool FindHash(uint64_t h) const {
+    return libfilter_taffy_block_find_hash(&payload_.filter, h);
+  }
+  // Sets out[i] to FindHash(hashes[i]) for each i < n. See
+  // libfilter_taffy_block_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_taffy_block_find_hash_batch(&payload_.filter, hashes, n, out);
+  }
+};
+
 }  // namespace filter
@@ -8,7 +8,7 @@
 // See "How to Approximate A Set Without Knowing Its Size In Advance", by
 // Rasmus Pagh, Gil Segev, and Udi Wieder
 //
-// TODO: Intersection, iteration, Freeze/Thaw, serialize/deserialize
+// TODO: Intersection, iteration, serialize/deserialize of unfrozen filters
 
 #pragma once
 
@@ -16,21 +16,71 @@ extern "C" {
 #include "filter/taffy-cuckoo.h"
 }
 
+#include <algorithm>
 #include <cstdint>
 #include <new>
+#include <stdexcept>
+#include <thread>
 #include <utility>
+#include <vector>
 
 namespace filter {
 
+namespace detail {
+
+// Adds everything in that to here, with the work split across the given number of
+// threads. See libfilter_taffy_cuckoo_merge_init.
+inline void ParallelMerge(libfilter_taffy_cuckoo* here, const libfilter_taffy_cuckoo* that,
+                          int threads) {
+  libfilter_taffy_cuckoo_merge m;
+  if (0 != libfilter_taffy_cuckoo_merge_init(here, that, threads, &m)) {
+    throw std::invalid_argument("libfilter_taffy_cuckoo_merge_init");
+  }
+  for (int phase = 0; phase < LIBFILTER_TAFFY_CUCKOO_MERGE_PHASES; ++phase) {
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+      workers.emplace_back(libfilter_taffy_cuckoo_merge_step, &m, phase, i);
+    }
+    libfilter_taffy_cuckoo_merge_step(&m, phase, 0);
+    for (auto& w : workers) w.join();
+  }
+  libfilter_taffy_cuckoo_merge_finish(&m);
+}
+
+}  // namespace detail
+
 struct FrozenTaffyCuckoo {
   libfilter_frozen_taffy_cuckoo b;
   bool FindHash(uint64_t x) const {
     return libfilter_frozen_taffy_cuckoo_find_hash(&b, x);
   }
+  // Sets out[i] to FindHash(hashes[i]) for each i < n. See
+  // libfilter_frozen_taffy_cuckoo_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_frozen_taffy_cuckoo_find_hash_batch(&b, hashes, n, out);
+  }
 
   size_t SizeInBytes() const { return libfilter_frozen_taffy_cuckoo_size_in_bytes(&b); }
   // bool InsertHash(uint64_t hash);
 
+  uint64_t SerializedBytes() const {
+    return libfilter_frozen_taffy_cuckoo_serialized_bytes(&b);
+  }
+  void Serialize(char* to) const {
+    if (0 != libfilter_frozen_taffy_cuckoo_serialize(&b, to)) {
+      throw std::runtime_error("libfilter_frozen_taffy_cuckoo_serialize");
+    }
+  }
+  // Reads a filter written by Serialize. Throws std::invalid_argument if the image is
+  // invalid. See libfilter_frozen_taffy_cuckoo_deserialize.
+  static FrozenTaffyCuckoo Deserialize(const char* from, uint64_t bytes) {
+    libfilter_frozen_taffy_cuckoo result;
+    if (0 != libfilter_frozen_taffy_cuckoo_deserialize(from, bytes, &result)) {
+      throw std::invalid_argument("libfilter_frozen_taffy_cuckoo_deserialize");
+    }
+    return FrozenTaffyCuckoo{std::move(result)};
+  }
+
   INLINE static const char* Name() {
     thread_local const constexpr char result[] = "FrozenTaffyCuckoo";
     return result;
@@ -60,6 +110,56 @@ struct FrozenTaffyCuckoo {
   }
 };
 
+// A read-only frozen filter over an image written by FrozenTaffyCuckoo::Serialize, either
+// in a buffer the caller owns or in a file mapped into memory, with no copy. See
+// libfilter_frozen_taffy_cuckoo_view_init.
+class FrozenTaffyCuckooView {
+  libfilter_frozen_taffy_cuckoo_view payload_{};
+
+  FrozenTaffyCuckooView() = default;
+
+ public:
+  // from must be 8-byte aligned and must outlive the view
+  static FrozenTaffyCuckooView FromBuffer(const void* from, uint64_t bytes) {
+    FrozenTaffyCuckooView result;
+    if (0 != libfilter_frozen_taffy_cuckoo_view_init(from, bytes, &result.payload_)) {
+      throw std::invalid_argument("libfilter_frozen_taffy_cuckoo_view_init");
+    }
+    return result;
+  }
+  static FrozenTaffyCuckooView FromFile(const char* path) {
+    FrozenTaffyCuckooView result;
+    if (0 != libfilter_frozen_taffy_cuckoo_view_map(path, &result.payload_)) {
+      throw std::runtime_error("libfilter_frozen_taffy_cuckoo_view_map");
+    }
+    return result;
+  }
+
+  FrozenTaffyCuckooView(const FrozenTaffyCuckooView&) = delete;
+  FrozenTaffyCuckooView& operator=(const FrozenTaffyCuckooView&) = delete;
+  FrozenTaffyCuckooView(FrozenTaffyCuckooView&& that) : payload_(that.payload_) {
+    that.payload_.mapping = nullptr;
+  }
+  FrozenTaffyCuckooView& operator=(FrozenTaffyCuckooView&& that) {
+    std::swap(payload_, that.payload_);
+    return *this;
+  }
+  ~FrozenTaffyCuckooView() {
+    // TODO: this swallows an error when return value is negative
+    libfilter_frozen_taffy_cuckoo_view_destruct(&payload_);
+  }
+
+  size_t SizeInBytes() const {
+    return libfilter_frozen_taffy_cuckoo_size_in_bytes(&payload_.filter);
+  }
+  bool FindHash(uint64_t x) const {
+    return libfilter_frozen_taffy_cuckoo_find_hash(&payload_.filter, x);
+  }
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_frozen_taffy_cuckoo_find_hash_batch(&payload_.filter, hashes, n, out);
+  }
+};
+
 struct TaffyCuckooFilter {
   TaffyCuckooFilter(const TaffyCuckooFilter& that) {
     libfilter_taffy_cuckoo_clone(&that.b, &b);
@@ -80,6 +180,7 @@ struct TaffyCuckooFilter {
       that.b.sides[i].data = NULL;
       that.b.sides[i].stash = NULL;
     }
+    that.b.migrating = NULL;
   }
 
   TaffyCuckooFilter(libfilter_taffy_cuckoo&& that) {
@@ -88,6 +189,7 @@ struct TaffyCuckooFilter {
       that.sides[i].data = NULL;
       that.sides[i].stash = NULL;
     }
+    that.migrating = NULL;
   }
 
   libfilter_taffy_cuckoo b;
@@ -96,6 +198,16 @@ struct TaffyCuckooFilter {
   static TaffyCuckooFilter CreateWithBytes(size_t bytes) {
     return TaffyCuckooFilter{libfilter_taffy_cuckoo_create_with_bytes(bytes)};
   }
+  // Rebuilds a filter that can grow from one frozen by Freeze. Throws
+  // std::invalid_argument if that was not frozen from a filter made by CreateWithBytes.
+  // See libfilter_frozen_taffy_cuckoo_thaw.
+  static TaffyCuckooFilter Thaw(const FrozenTaffyCuckoo& that) {
+    libfilter_taffy_cuckoo result;
+    if (0 != libfilter_frozen_taffy_cuckoo_thaw(&that.b, NULL, &result)) {
+      throw std::invalid_argument("libfilter_frozen_taffy_cuckoo_thaw");
+    }
+    return TaffyCuckooFilter{std::move(result)};
+  }
 
   static const char* Name() {
     thread_local const constexpr char result[] = "TaffyCuckoo";
@@ -104,7 +216,34 @@ struct TaffyCuckooFilter {
 
   bool InsertHash(uint64_t h) { return libfilter_taffy_cuckoo_add_hash(&b, h); }
   bool FindHash(uint64_t h) const { return libfilter_taffy_cuckoo_find_hash(&b, h); }
+  // Sets out[i] to FindHash(hashes[i]) for each i < n. See
+  // libfilter_taffy_cuckoo_find_hash_batch.
+  void FindHashBatch(const uint64_t* hashes, size_t n, uint8_t* out) const {
+    libfilter_taffy_cuckoo_find_hash_batch(&b, hashes, n, out);
+  }
+  void InsertHashBatch(const uint64_t* hashes, size_t n) {
+    libfilter_taffy_cuckoo_add_hash_batch(&b, hashes, n);
+  }
   size_t SizeInBytes() const { return libfilter_taffy_cuckoo_size_in_bytes(&b); }
+  // If true, upsizing spreads the work of moving the filter to a larger table across the
+  // inserts that follow it. See libfilter_taffy_cuckoo::incremental.
+  void SetIncremental(bool incremental) {
+    libfilter_taffy_cuckoo_set_incremental(&b, incremental);
+  }
+  // Doubles the size of the filter, moving its contents with the given number of threads
+  void Upsize(int threads) {
+    libfilter_taffy_cuckoo_finish_upsize(&b);
+    libfilter_taffy_cuckoo t = libfilter_taffy_cuckoo_create(1 + b.log_side_size, b.entropy);
+    t.incremental = b.incremental;
+    try {
+      detail::ParallelMerge(&t, &b, threads);
+    } catch (...) {
+      libfilter_taffy_cuckoo_destruct(&t);
+      throw;
+    }
+    libfilter_taffy_cuckoo_swap(&b, &t);
+    libfilter_taffy_cuckoo_destruct(&t);
+  }
   FrozenTaffyCuckoo Freeze() const {
     return FrozenTaffyCuckoo{libfilter_taffy_cuckoo_freeze(&b)};
   }
@@ -115,4 +254,24 @@ TaffyCuckooFilter Union(const TaffyCuckooFilter& x, const TaffyCuckooFilter& y)
   return {libfilter_taffy_cuckoo_union(&x.b, &y.b)};
 }
 
+// The same as the above, but split across the given number of threads. The result starts
+// out empty and large enough for everything in x and y, rather than as a copy of the
+// larger one, so that the shards have room to place their paths.
+inline TaffyCuckooFilter Union(const TaffyCuckooFilter& x, const TaffyCuckooFilter& y,
+                               int threads) {
+  const libfilter_taffy_cuckoo* tables[] = {&x.b, x.b.migrating, &y.b, y.b.migrating};
+  uint64_t occupied = 0;
+  for (const libfilter_taffy_cuckoo* t : tables) {
+    if (t != nullptr) occupied += t->occupied;
+  }
+  int log_side_size = std::max(x.b.log_side_size, y.b.log_side_size);
+  while (occupied > 0.90 * 2 * libfilter_slots * (uint64_t{1} << log_side_size)) {
+    ++log_side_size;
+  }
+  TaffyCuckooFilter result{libfilter_taffy_cuckoo_create(log_side_size, x.b.entropy)};
+  detail::ParallelMerge(&result.b, &x.b, threads);
+  detail::ParallelMerge(&result.b, &y.b, threads);
+  return result;
+}
+
 }  // namespace filter
@@ -0,0 +1,127 @@
+// C++ wrapper around wide-block.h.
+
+#pragma once
+
+extern "C" {
+#include "filter/wide-block.h"
+}
+
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+namespace filter {
+
+namespace detail {
+
+template <void (*INSERT_HASH)(uint64_t, libfilter_wide_block*),
+          bool (*FIND_HASH)(uint64_t, const libfilter_wide_block*)>
+class WideBF {
+ protected:
+  libfilter_wide_block payload_;
+  using uint64_t = std::uint64_t;
+
+  explicit WideBF(uint64_t bytes) {
+    if (0 != libfilter_wide_block_init(bytes, &payload_)) {
+      throw std::runtime_error("libfilter_wide_block_init");
+    }
+  }
+
+ public:
+  WideBF(const WideBF& that) {
+    if (0 != libfilter_wide_block_clone(&that.payload_, &payload_)) {
+      throw std::bad_alloc();
+    }
+  }
+  WideBF& operator=(const WideBF& that) {
+    WideBF copy(that);
+    std::swap(payload_, copy.payload_);
+    return *this;
+  }
+  WideBF(WideBF&& that) : payload_(that.payload_) {
+    libfilter_wide_block_zero_out(&that.payload_);
+  }
+  WideBF& operator=(WideBF&& that) {
+    std::swap(payload_, that.payload_);
+    return *this;
+  }
+  ~WideBF() {
+    // TODO: this swallows an error when return value is negative
+    libfilter_wide_block_destruct(&payload_);
+  }
+
+  bool operator==(const WideBF& that) const {
+    return libfilter_wide_block_equals(&payload_, &that.payload_);
+  }
+
+  uint64_t SizeInBytes() const { return libfilter_wide_block_size_in_bytes(&payload_); }
+  bool InsertHash(uint64_t hash) { INSERT_HASH(hash, &payload_); return true; }
+  bool FindHash(uint64_t hash) const { return FIND_HASH(hash, &payload_); }
+
+  static double FalsePositiveProbability(uint64_t ndv, uint64_t bytes) {
+    return libfilter_wide_block_fpp(ndv, bytes);
+  }
+  static uint64_t MinSpaceNeeded(uint64_t ndv, double fpp) {
+    return libfilter_wide_block_bytes_needed(ndv, fpp);
+  }
+  static uint64_t MaxCapacity(uint64_t bytes, double fpp) {
+    return libfilter_wide_block_capacity(bytes, fpp);
+  }
+};
+
+}  // namespace detail
+
+struct ScalarWideBlockFilter
+    : detail::WideBF<libfilter_wide_block_scalar_add_hash,
+                     libfilter_wide_block_scalar_find_hash> {
+  static const char* Name() {
+    static const char NAME[] = "ScalarWideBlockFilter";
+    return NAME;
+  }
+  static constexpr bool is_simd = false;
+  using Scalar = ScalarWideBlockFilter;
+  static ScalarWideBlockFilter CreateWithBytes(uint64_t bytes) {
+    return ScalarWideBlockFilter(bytes);
+  }
+  static ScalarWideBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return CreateWithBytes(MinSpaceNeeded(ndv, fpp));
+  }
+
+ private:
+  using Parent = detail::WideBF<libfilter_wide_block_scalar_add_hash,
+                                libfilter_wide_block_scalar_find_hash>;
+  explicit ScalarWideBlockFilter(uint64_t bytes) : Parent(bytes) {}
+};
+
+#if defined(LIBFILTER_WIDE_BLOCK_SIMD)
+
+struct SimdWideBlockFilter
+    : detail::WideBF<libfilter_wide_block_simd_add_hash,
+                     libfilter_wide_block_simd_find_hash> {
+  static const char* Name() {
+    static const char NAME[] = "SimdWideBlockFilter";
+    return NAME;
+  }
+  static constexpr bool is_simd = true;
+  using Scalar = ScalarWideBlockFilter;
+  static SimdWideBlockFilter CreateWithBytes(uint64_t bytes) {
+    return SimdWideBlockFilter(bytes);
+  }
+  static SimdWideBlockFilter CreateWithNdvFpp(uint64_t ndv, double fpp) {
+    return CreateWithBytes(MinSpaceNeeded(ndv, fpp));
+  }
+
+ private:
+  using Parent = detail::WideBF<libfilter_wide_block_simd_add_hash,
+                                libfilter_wide_block_simd_find_hash>;
+  explicit SimdWideBlockFilter(uint64_t bytes) : Parent(bytes) {}
+};
+
+using WideBlockFilter = SimdWideBlockFilter;
+
+#else
+using WideBlockFilter = ScalarWideBlockFilter;
+#endif
+
+}  // namespace filter
@@ -1,12 +1,13 @@
 package libfilter
 
-// TODO: union, intersection
-
 // #cgo CFLAGS: -march=native
 // #cgo LDFLAGS: lib/libfilter.a -lm
 // #include <filter/block.h>
 import "C"
-import "runtime"
+import (
+	"errors"
+	"runtime"
+)
 
 type BlockFilter = C.libfilter_block
 
@@ -39,3 +40,19 @@ func (b BlockFilter) Clone() *BlockFilter {
 	runtime.SetFinalizer(result, FreeBlockFilter)
 	return result
 }
+
+// Union sets b to the union of b and other, which must be the same size.
+func (b BlockFilter) Union(other *BlockFilter) error {
+	if C.libfilter_block_union(&b, other) != 0 {
+		return errors.New("block filters are not the same size")
+	}
+	return nil
+}
+
+// Intersect sets b to the intersection of b and other, which must be the same size.
+func (b BlockFilter) Intersect(other *BlockFilter) error {
+	if C.libfilter_block_intersect(&b, other) != 0 {
+		return errors.New("block filters are not the same size")
+	}
+	return nil
+}
@@ -31,10 +31,54 @@ func TestCumulativeTaffyBlock(t *testing.T) {
 	CumulativeHelper(NewTaffyBlockFilter(123456, 0.01), t)
 }
 
+func TestSerializeTaffyBlock(t *testing.T) {
+	b := NewTaffyBlockFilter(123456, 0.01)
+	keys := make([]uint64, 1234)
+	for i := range keys {
+		keys[i] = rand.Uint64()
+		b.AddHash(keys[i])
+	}
+	c, err := DeserializeTaffyBlockFilter(b.Serialize())
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, k := range keys {
+		if !c.FindHash(k) {
+			t.Fatal("Not found", k)
+		}
+	}
+	if _, err := DeserializeTaffyBlockFilter(b.Serialize()[1:]); err == nil {
+		t.Fatal("Truncated filter deserialized")
+	}
+}
+
 func TestCumulativeTaffyCuckoo(t *testing.T) {
 	CumulativeHelper(NewTaffyCuckooFilter(123456), t)
 }
 
+func TestThawTaffyCuckoo(t *testing.T) {
+	b := NewTaffyCuckooFilter(123456)
+	keys := make([]uint64, 1234)
+	for i := range keys {
+		keys[i] = rand.Uint64()
+		b.AddHash(keys[i])
+	}
+	f := b.Freeze()
+	c, err := f.Thaw()
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, k := range keys {
+		if !c.FindHash(k) {
+			t.Fatal("Not found", k)
+		}
+	}
+	f.hash_[0].keys[0][0] ^= 1
+	if _, err := f.Thaw(); err == nil {
+		t.Fatal("Thawed a filter with different entropy")
+	}
+}
+
 func TestCumulative(t *testing.T) {
 	CumulativeHelper(NewBlockFilter(123456), t)
 }
@@ -57,6 +101,40 @@ func CumulativeHelper[U interface {
 	}
 }
 
+func TestUnionIntersect(t *testing.T) {
+	x := NewBlockFilter(123456)
+	y := NewBlockFilter(123456)
+	const count = 1234
+	keys := make([]uint64, count)
+	for i := 0; i < count; i++ {
+		keys[i] = rand.Uint64()
+		if i%2 == 0 {
+			x.AddHash(keys[i])
+		} else {
+			y.AddHash(keys[i])
+		}
+	}
+	u := x.Clone()
+	if err := u.Union(y); err != nil {
+		t.Fatal(err)
+	}
+	v := x.Clone()
+	if err := v.Intersect(y); err != nil {
+		t.Fatal(err)
+	}
+	for i := 0; i < count; i++ {
+		if !u.FindHash(keys[i]) {
+			t.Fatal("Not found in union", keys[i])
+		}
+		if v.FindHash(keys[i]) && !x.FindHash(keys[i]) {
+			t.Fatal("Found in intersection but not in x", keys[i])
+		}
+	}
+	if NewBlockFilter(2*123456).Union(x) == nil {
+		t.Fatal("Union of different sizes succeeded")
+	}
+}
+
 // func BenchmarkFind(context *testing.B) {
 // 	b := NewBlockFilter(1234567)
 // 	keys := make([]uint64, context.N)
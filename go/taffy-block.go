@@ -6,7 +6,11 @@ package libfilter
 // #cgo LDFLAGS: lib/libfilter.a -lm
 // #include <filter/taffy-block.h>
 import "C"
-import "runtime"
+import (
+	"errors"
+	"runtime"
+	"unsafe"
+)
 
 type TaffyBlockFilter = C.libfilter_taffy_block
 
@@ -36,3 +40,22 @@ func (b TaffyBlockFilter) Clone() *TaffyBlockFilter {
 	C.libfilter_taffy_block_clone(&b, result)
 	return result;
 }
+
+func (b TaffyBlockFilter) Serialize() []byte {
+	result := make([]byte, C.libfilter_taffy_block_serialized_bytes(&b))
+	C.libfilter_taffy_block_serialize(&b, (*C.char)(unsafe.Pointer(&result[0])))
+	return result
+}
+
+func DeserializeTaffyBlockFilter(data []byte) (*TaffyBlockFilter, error) {
+	if len(data) == 0 {
+		return nil, errors.New("invalid serialized taffy block filter")
+	}
+	result := new(TaffyBlockFilter)
+	if 0 != C.libfilter_taffy_block_deserialize(
+		(*C.char)(unsafe.Pointer(&data[0])), C.uint64_t(len(data)), result) {
+		return nil, errors.New("invalid serialized taffy block filter")
+	}
+	runtime.SetFinalizer(result, FreeTaffyBlockFilter)
+	return result, nil
+}
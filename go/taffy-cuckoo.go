@@ -5,7 +5,10 @@ package libfilter
 // #cgo LDFLAGS: lib/libfilter.a
 // #include <filter/taffy-cuckoo.h>
 import "C"
-import "runtime"
+import (
+	"errors"
+	"runtime"
+)
 
 type TaffyCuckooFilter = C.libfilter_taffy_cuckoo
 type FrozenTaffyCuckooFilter = C.libfilter_frozen_taffy_cuckoo
@@ -24,6 +27,17 @@ func (b TaffyCuckooFilter) Freeze() *FrozenTaffyCuckooFilter {
 	return f
 }
 
+// Thaw returns a growable filter that finds everything b does. It fails if b was not made
+// with the default entropy.
+func (b FrozenTaffyCuckooFilter) Thaw() (*TaffyCuckooFilter, error) {
+	result := new(TaffyCuckooFilter)
+	if 0 != C.libfilter_frozen_taffy_cuckoo_thaw(&b, nil, result) {
+		return nil, errors.New("frozen taffy cuckoo filter has different entropy")
+	}
+	runtime.SetFinalizer(result, FreeTaffyCuckooFilter)
+	return result, nil
+}
+
 func FreeFrozenTaffyCuckooFilter(b *FrozenTaffyCuckooFilter) {
 	C.libfilter_frozen_taffy_cuckoo_destruct(b)
 }
@@ -1,27 +1,36 @@
 package com.github.jbapple.libfilter;
 
+import java.io.IOException;
 import java.lang.Math;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.StandardOpenOption;
 import java.util.ArrayList;
 import java.util.Arrays;
 
-// TODO: Comparable, Serializable
+// TODO: Comparable
 public class FrozenTaffyCuckooFilter implements StaticFilter /* Clone */ {
   private int log_side_size;
-  private byte[] sides[];
+  // Five bytes per bucket, holding four ten-bit fingerprints, least significant first.
+  // These may be slices of a serialized image, including one mapped from a file.
+  private ByteBuffer sides[];
   private Feistel feistels[];
   private ArrayList<ArrayList<TaffyCuckooFilter.Path>> stashes;
 
   void fromSide(TaffyCuckooFilter.Side side, int s) {
+    byte[] data = new byte[5 << log_side_size];
     for (int i = 0; i + 3 < side.data.length; i += 4) {
       int j = 5 * (i / 4);
-      sides[s][j + 0]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 0]) << 0);
-      sides[s][j + 1]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 0]) >> 8);
-      sides[s][j + 1] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 1]) << 2);
-      sides[s][j + 2]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 1]) >> 6);
-      sides[s][j + 2] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 2]) << 4);
-      sides[s][j + 3]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 2]) >> 4);
-      sides[s][j + 3] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 3]) << 6);
-      sides[s][j + 4]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 3]) >> 2);
+      data[j + 0]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 0]) << 0);
+      data[j + 1]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 0]) >> 8);
+      data[j + 1] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 1]) << 2);
+      data[j + 2]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 1]) >> 6);
+      data[j + 2] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 2]) << 4);
+      data[j + 3]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 2]) >> 4);
+      data[j + 3] |= (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 3]) << 6);
+      data[j + 4]  = (byte)(TaffyCuckooFilter.fingerprint(side.data[i + 3]) >> 2);
       // for (int k = 0; k < 4; ++k) {
       //   System.out.print(String.format("0x%08X", TaffyCuckooFilter.fingerprint(side.data[i + k])));
       // }
@@ -31,23 +40,148 @@ public class FrozenTaffyCuckooFilter implements StaticFilter /* Clone */ {
       // }
       // System.out.println("");
     }
+    sides[s] = ByteBuffer.wrap(data);
     feistels[s] = side.f.clone();
     stashes.set(s, new ArrayList<TaffyCuckooFilter.Path>(side.stash));
   }
 
   FrozenTaffyCuckooFilter(TaffyCuckooFilter tcf) {
-    sides = new byte[2][5 << tcf.log_side_size];
+    sides = new ByteBuffer[2];
     feistels = new Feistel[2];
     stashes = new ArrayList<ArrayList<TaffyCuckooFilter.Path>>();
     stashes.add(null);
     stashes.add(null);
+    log_side_size = tcf.log_side_size;
     fromSide(tcf.sides[0], 0);
     fromSide(tcf.sides[1], 1);
-    log_side_size = tcf.log_side_size;
+  }
+
+  private FrozenTaffyCuckooFilter() {
+    sides = new ByteBuffer[2];
+    feistels = new Feistel[2];
+    stashes = new ArrayList<ArrayList<TaffyCuckooFilter.Path>>();
+    stashes.add(new ArrayList<TaffyCuckooFilter.Path>());
+    stashes.add(new ArrayList<TaffyCuckooFilter.Path>());
+  }
+
+  // The serialized format, shared with libfilter_frozen_taffy_cuckoo_serialize in the C
+  // library: a 96-byte header holding MAGIC, VERSION, log_side_size, the size of each
+  // stash and each side's four Feistel keys, then each side's stash as sorted longs of
+  // the form (bucket << 10) | fingerprint, then each side's buckets. All little-endian.
+  private static final byte[] MAGIC = "libftcf\0".getBytes(StandardCharsets.US_ASCII);
+  private static final int VERSION = 1;
+  private static final int HEADER_BYTES = 96;
+
+  private static long[] sortedStash(ArrayList<TaffyCuckooFilter.Path> stash) {
+    long[] result = new long[stash.size()];
+    for (int i = 0; i < result.length; ++i) {
+      TaffyCuckooFilter.Path p = stash.get(i);
+      result[i] = (((long) p.bucket) << 10) | TaffyCuckooFilter.fingerprint(p.slot);
+    }
+    Arrays.sort(result);
+    return result;
+  }
+
+  /**
+   * Serializes the filter in a format that {@link #Deserialize} and the C library's
+   * <code>libfilter_frozen_taffy_cuckoo_deserialize</code> can read.
+   */
+  public byte[] Serialize() {
+    long[][] stash = new long[][] {sortedStash(stashes.get(0)), sortedStash(stashes.get(1))};
+    ByteBuffer out =
+        ByteBuffer
+            .allocate(HEADER_BYTES + 8 * (stash[0].length + stash[1].length)
+                + 2 * (5 << log_side_size))
+            .order(ByteOrder.LITTLE_ENDIAN);
+    out.put(MAGIC);
+    out.putInt(VERSION);
+    out.putInt(log_side_size);
+    out.putLong(stash[0].length);
+    out.putLong(stash[1].length);
+    for (int s = 0; s < 2; ++s) {
+      for (int i = 0; i < 4; ++i) out.putLong(feistels[s].keys[i]);
+    }
+    for (int s = 0; s < 2; ++s) {
+      for (long x : stash[s]) out.putLong(x);
+    }
+    for (int s = 0; s < 2; ++s) {
+      // rewind, not clear: a side sliced from an image is limited to its own buckets
+      ByteBuffer side = sides[s].duplicate();
+      side.rewind();
+      out.put(side);
+    }
+    return out.array();
+  }
+
+  /**
+   * Reads a filter written by {@link #Serialize} or by the C library, starting at the
+   * position of <code>in</code> and using the rest of it. The buckets are not copied, so
+   * <code>in</code> must not be changed while the filter is in use.
+   *
+   * @throws IllegalArgumentException if the image is invalid
+   */
+  public static FrozenTaffyCuckooFilter Deserialize(ByteBuffer in) {
+    ByteBuffer b = in.duplicate().order(ByteOrder.LITTLE_ENDIAN);
+    if (b.remaining() < HEADER_BYTES) throw new IllegalArgumentException("too short");
+    byte[] magic = new byte[MAGIC.length];
+    b.get(magic);
+    if (!Arrays.equals(magic, MAGIC)) throw new IllegalArgumentException("magic");
+    if (b.getInt() != VERSION) throw new IllegalArgumentException("version");
+    FrozenTaffyCuckooFilter result = new FrozenTaffyCuckooFilter();
+    result.log_side_size = b.getInt();
+    // Buckets are indexed by int
+    if (result.log_side_size < 1 || result.log_side_size > 28) {
+      throw new IllegalArgumentException("log_side_size");
+    }
+    long[] stash_size = new long[] {b.getLong(), b.getLong()};
+    for (int s = 0; s < 2; ++s) {
+      long[] keys = new long[4];
+      for (int i = 0; i < 4; ++i) keys[i] = b.getLong();
+      result.feistels[s] = new Feistel(keys);
+    }
+    for (int s = 0; s < 2; ++s) {
+      if (stash_size[s] < 0 || stash_size[s] > b.remaining() / 8) {
+        throw new IllegalArgumentException("stash size");
+      }
+    }
+    if (b.remaining()
+        != 8 * (stash_size[0] + stash_size[1]) + 2 * (5L << result.log_side_size)) {
+      throw new IllegalArgumentException("size");
+    }
+    for (int s = 0; s < 2; ++s) {
+      long last = 0;
+      for (long i = 0; i < stash_size[s]; ++i) {
+        long x = b.getLong();
+        if (x < last) throw new IllegalArgumentException("unsorted stash");
+        last = x;
+        TaffyCuckooFilter.Path p = new TaffyCuckooFilter.Path();
+        p.bucket = (int) (x >>> 10);
+        p.slot = (short) ((x & 0x3ff) << 6);
+        result.stashes.get(s).add(p);
+      }
+    }
+    for (int s = 0; s < 2; ++s) {
+      ByteBuffer side = b.slice();
+      side.limit(5 << result.log_side_size);
+      result.sides[s] = side;
+      b.position(b.position() + (5 << result.log_side_size));
+    }
+    return result;
+  }
+
+  /**
+   * Maps the file at <code>path</code> read-only and reads the filter in it, as
+   * {@link #Deserialize} does. Pages of the file are read as lookups touch them.
+   */
+  public static FrozenTaffyCuckooFilter Map(java.nio.file.Path path) throws IOException {
+    try (FileChannel channel = FileChannel.open(path, StandardOpenOption.READ)) {
+      // The mapping stays valid after the channel is closed
+      return Deserialize(channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size()));
+    }
   }
 
   private boolean FindFingerprintInBytes(short fingerprint, int index, int side) {
-    byte[] data = sides[side];
+    ByteBuffer data = sides[side];
     fingerprint = TaffyCuckooFilter.fingerprint(fingerprint);
     // System.out.println(String.format("A 0x%08X", fingerprint));
     // System.out.println(String.format("B1 0x%08X",
@@ -62,17 +196,17 @@ public class FrozenTaffyCuckooFilter implements StaticFilter /* Clone */ {
     //     (((((short) data[index + 3]) & 0xff) >> 6)
     //         | ((((short) data[index + 4]) & 0xff) << 2))));
     return (fingerprint
-               == ((((short) data[index]) & 0xff)
-                   | (((short) (data[index + 1] & 0x3)) << 8)))
+               == ((((short) data.get(index)) & 0xff)
+                   | (((short) (data.get(index + 1) & 0x3)) << 8)))
         || (fingerprint
-            == (((((short) data[index + 1]) & 0xff) >> 2)
-                | (((short) (data[index + 2] & 0xf)) << 6)))
+            == (((((short) data.get(index + 1)) & 0xff) >> 2)
+                | (((short) (data.get(index + 2) & 0xf)) << 6)))
         || (fingerprint
-            == (((((short) data[index + 2]) & 0xff) >> 4)
-                | (((short) (data[index + 3] & 0x3f)) << 4)))
+            == (((((short) data.get(index + 2)) & 0xff) >> 4)
+                | (((short) (data.get(index + 3) & 0x3f)) << 4)))
         || (fingerprint
-            == (((((short) data[index + 3]) & 0xff) >> 6)
-                | ((((short) data[index + 4]) & 0xff) << 2)));
+            == (((((short) data.get(index + 3)) & 0xff) >> 6)
+                | ((((short) data.get(index + 4)) & 0xff) << 2)));
   }
 
   public boolean FindHash32(int k) {
@@ -1,10 +1,15 @@
 package com.github.jbapple.libfilter;
 
+import static org.junit.Assert.assertArrayEquals;
+import static org.junit.Assert.assertEquals;
 import static org.junit.Assert.assertFalse;
 import static org.junit.Assert.assertTrue;
 
 import org.junit.Test;
 
+import java.nio.ByteBuffer;
+import java.nio.file.Files;
+import java.nio.file.Paths;
 import java.util.ArrayList;
 import java.util.Random;
 import java.util.concurrent.ThreadLocalRandom;
@@ -50,6 +55,63 @@ public class FilterTest {
     }
   }
 
+  @Test
+  public void FreezeSerialize() throws java.io.IOException {
+    TaffyCuckooFilter tcf = TaffyCuckooFilter.CreateWithBytes(1);
+    int ndv = 234567;
+    long[] hashes = new long[ndv];
+    Random r = new Random(0xdeadbeef);
+    for (int i = 0; i < ndv; ++i) {
+      hashes[i] = r.nextLong();
+      tcf.AddHash64(hashes[i]);
+    }
+    FrozenTaffyCuckooFilter ftcf = new FrozenTaffyCuckooFilter(tcf);
+    byte[] image = ftcf.Serialize();
+    FrozenTaffyCuckooFilter copy = FrozenTaffyCuckooFilter.Deserialize(ByteBuffer.wrap(image));
+    java.nio.file.Path path = Files.createTempFile("libfilter-frozen", "");
+    Files.write(path, image);
+    FrozenTaffyCuckooFilter mapped = FrozenTaffyCuckooFilter.Map(path);
+    for (int i = 0; i < ndv; ++i) {
+      assertTrue(copy.FindHash64(hashes[i]));
+      assertTrue(mapped.FindHash64(hashes[i]));
+    }
+    for (int i = 0; i < ndv; ++i) {
+      long h = r.nextLong();
+      assertEquals(ftcf.FindHash64(h), copy.FindHash64(h));
+      assertEquals(ftcf.FindHash64(h), mapped.FindHash64(h));
+    }
+    assertArrayEquals(image, copy.Serialize());
+    Files.delete(path);
+  }
+
+  @Test(expected = IllegalArgumentException.class)
+  public void DeserializeTruncated() {
+    TaffyCuckooFilter tcf = TaffyCuckooFilter.CreateWithBytes(1);
+    tcf.AddHash64(1);
+    byte[] image = new FrozenTaffyCuckooFilter(tcf).Serialize();
+    FrozenTaffyCuckooFilter.Deserialize(ByteBuffer.wrap(image, 0, image.length - 1));
+  }
+
+  // frozen-taffy-cuckoo.bin was written by libfilter_frozen_taffy_cuckoo_serialize after
+  // adding i * 0x9e3779b97f4a7c15 for 1 <= i <= 106 to
+  // libfilter_taffy_cuckoo_create_with_bytes(1) and freezing it. That leaves one path in
+  // the stash of side 0. The C library found 843 of the probes below.
+  @Test
+  public void DeserializeFromC() throws Exception {
+    byte[] image = Files.readAllBytes(
+        Paths.get(FilterTest.class.getResource("/frozen-taffy-cuckoo.bin").toURI()));
+    FrozenTaffyCuckooFilter ftcf = FrozenTaffyCuckooFilter.Deserialize(ByteBuffer.wrap(image));
+    for (long i = 1; i <= 106; ++i) {
+      assertTrue(ftcf.FindHash64(i * 0x9e3779b97f4a7c15L));
+    }
+    int found = 0;
+    for (long i = 1; i <= 100000; ++i) {
+      if (ftcf.FindHash64(i * 0xc2b2ae3d27d4eb4fL)) ++found;
+    }
+    assertEquals(843, found);
+    assertArrayEquals(image, ftcf.Serialize());
+  }
+
   public <T extends Filter> void InsertPersistsHelp(T x) {
     int ndv = 8000;
     ArrayList<Long> hashes = new ArrayList<Long>(ndv);
@@ -39,6 +39,9 @@ typedef struct {
   int cursor;
   uint64_t last_ndv;
   int64_t ttl;
+  void* arena;
+  uint64_t arena_bytes;
+  int arena_levels;
 } libfilter_taffy_block;
 
 int libfilter_taffy_block_clone(const libfilter_taffy_block* b, libfilter_taffy_block*);
@@ -47,6 +50,10 @@ int libfilter_taffy_block_init(uint64_t ndv, double fpp, libfilter_taffy_block*)
 inline uint64_t libfilter_taffy_block_size_in_bytes(const libfilter_taffy_block* here);
 inline bool libfilter_taffy_block_add_hash(libfilter_taffy_block* here, uint64_t h);
 inline bool libfilter_taffy_block_find_hash(const libfilter_taffy_block* here, uint64_t h);
+uint64_t libfilter_taffy_block_serialized_bytes(const libfilter_taffy_block* here);
+void libfilter_taffy_block_serialize(const libfilter_taffy_block* here, char* to);
+int libfilter_taffy_block_deserialize(const char* from, uint64_t bytes,
+                                      libfilter_taffy_block* to);
 
 typedef struct {
   uint64_t fingerprint : 10;
@@ -88,6 +95,9 @@ typedef struct libfilter_taffy_cuckoo_struct {
   libfilter_pcg_random rng;
   const uint64_t* entropy;
   uint64_t occupied;
+  bool incremental;
+  struct libfilter_taffy_cuckoo_struct* migrating;
+  uint64_t migrated;
 } libfilter_taffy_cuckoo;
 
 void libfilter_taffy_cuckoo_swap(libfilter_taffy_cuckoo* x, libfilter_taffy_cuckoo* y);
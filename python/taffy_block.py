@@ -27,3 +27,20 @@ class TaffyBlock:
 
   def __deepcopy__(self, memo):
     return self.clone()
+
+  def serialize(self):
+    size = lib.libfilter_taffy_block_serialized_bytes(self.b)
+    result = ffi.new("char[]", size)
+    lib.libfilter_taffy_block_serialize(self.b, result)
+    return ffi.buffer(result, size)[:]
+
+  @staticmethod
+  def deserialize(data):
+    result = ffi.new("libfilter_taffy_block *")
+    if 0 != lib.libfilter_taffy_block_deserialize(data, len(data), result):
+      raise ValueError("invalid serialized taffy block filter")
+    result = ffi.gc(result, lib.libfilter_taffy_block_destruct,
+                    lib.libfilter_taffy_block_size_in_bytes(result))
+    answer = TaffyBlock()
+    answer.b = result
+    return answer